@@ -0,0 +1,708 @@
+#define _GNU_SOURCE
+
+#include "async.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blake3.h"
+#include "digest.h"
+#include "utilities.h"
+
+// Request-id table size to start with. Doubles whenever two outstanding ids collide.
+#define INITIAL_SLOTS 1024
+
+// Longest async_run() waits at a time, while anything is pending, before looking for
+// requests past their deadline.
+#define SWEEP_MS 1000
+
+/**
+ * Bytes in [head, len) of `data` are waiting: to be sent, or to be parsed.
+ */
+typedef struct {
+  uint8_t* data;
+  size_t head;
+  size_t len;
+  size_t cap;
+} ByteQueue;
+
+typedef enum {
+  OP_SEARCH,
+  OP_LOOKUP,  // A fetch, waiting for SEARCH_DIGEST to say who has the file.
+  OP_FETCH,   // A fetch, waiting for (or reading) the file from its holder.
+} OpKind;
+
+typedef struct AsyncConn AsyncConn;
+
+typedef struct {
+  uint32_t id;  // Of the request it's waiting on now.
+  OpKind kind;
+  char name[NAME_MAX + 1];
+  void* arg;
+  SearchCallback searched;
+  FetchCallback fetched;
+  AsyncConn* conn;  // Where that request went. NULL only while drop_conn fails it.
+  time_t deadline;  // When that request is overdue.
+
+  // Fetches only.
+  int out_fd;
+  int verify;
+  int failed;  // Still reading the file off the connection, but it's no good.
+  uint8_t digest[DIGEST_LEN];
+  blake3_hasher hasher;
+  uint64_t size;
+  uint64_t received;
+} AsyncOp;
+
+struct AsyncConn {
+  int fd;
+  int connecting;
+  uint32_t events;  // What epoll is watching it for.
+  uint32_t ip;      // Peers only, network byte order.
+  uint16_t port;
+  time_t heard;  // When anything last arrived on it.
+  ByteQueue in;
+  ByteQueue out;
+  AsyncOp* receiving;  // The fetch whose file bytes are arriving.
+  AsyncConn* next;
+};
+
+struct AsyncClient {
+  Cluster cluster;  // For routing; the sockets live in `registries`.
+  AsyncConn registries[MAX_SHARDS];
+  AsyncConn* peers;
+  int epoll_fd;
+
+  // Outstanding requests by id: an op sits at slots[id & slot_mask].
+  uint32_t next_id;
+  AsyncOp** slots;
+  uint32_t slot_mask;
+  size_t pending;
+};
+
+static int reserve(ByteQueue* q, size_t want) {
+  if (q->head > 0 && q->cap - q->len < want) {
+    memmove(q->data, q->data + q->head, q->len - q->head);
+    q->len -= q->head;
+    q->head = 0;
+  }
+  if (q->cap - q->len < want) {
+    size_t cap = q->cap * 2 > q->len + want ? q->cap * 2 : q->len + want;
+    uint8_t* data = realloc(q->data, cap);
+    if (data == NULL) {
+      return -1;
+    }
+    q->data = data;
+    q->cap = cap;
+  }
+  return 0;
+}
+
+static int watch(AsyncClient* client, AsyncConn* conn, uint32_t events) {
+  if (conn->events == events) {
+    return 0;
+  }
+  struct epoll_event ev = {.events = events, .data.ptr = conn};
+  int op = conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(client->epoll_fd, op, conn->fd, &ev) != 0) {
+    return -1;
+  }
+  conn->events = events;
+  return 0;
+}
+
+/**
+ * Finds a free slot for `op`'s id, growing the table until there is one.
+ */
+static int slot_put(AsyncClient* client, AsyncOp* op) {
+  while (client->slots[op->id & client->slot_mask] != NULL) {
+    uint32_t mask = client->slot_mask * 2 + 1;
+    AsyncOp** slots = calloc((size_t)mask + 1, sizeof(AsyncOp*));
+    if (slots == NULL) {
+      return -1;
+    }
+
+    for (uint32_t i = 0; i <= client->slot_mask; i++) {
+      AsyncOp* moving = client->slots[i];
+      if (moving != NULL) {
+        slots[moving->id & mask] = moving;
+      }
+    }
+
+    free(client->slots);
+    client->slots = slots;
+    client->slot_mask = mask;
+  }
+
+  client->slots[op->id & client->slot_mask] = op;
+  return 0;
+}
+
+static AsyncOp* slot_find(AsyncClient* client, uint32_t id) {
+  AsyncOp* op = client->slots[id & client->slot_mask];
+  return op != NULL && op->id == id ? op : NULL;
+}
+
+static uint32_t take_id(AsyncClient* client) {
+  uint32_t id;
+  do {
+    id = client->next_id++;
+  } while (id == 0 || slot_find(client, id) != NULL);
+  return id;
+}
+
+/**
+ * Queues one frame on `conn`; it goes out from async_run().
+ */
+static int queue_frame(AsyncClient* client, AsyncConn* conn, uint8_t action, uint32_t id, const uint8_t* prefix,
+                       size_t prefix_len, const char* name) {
+  size_t name_len = strlen(name) + 1;
+  size_t len = FRAME_HEADER_LEN + prefix_len + name_len;
+  if (reserve(&conn->out, len) != 0) {
+    return -1;
+  }
+
+  uint8_t* at = conn->out.data + conn->out.len;
+  encode_frame_header(at, action, id, (uint32_t)(prefix_len + name_len));
+  if (prefix_len > 0) {
+    memcpy(at + FRAME_HEADER_LEN, prefix, prefix_len);
+  }
+  memcpy(at + FRAME_HEADER_LEN + prefix_len, name, name_len);
+  conn->out.len += len;
+
+  if (!conn->connecting) {
+    return watch(client, conn, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+  }
+  return 0;
+}
+
+/**
+ * Runs `op`'s callback and frees it. It must already be out of the slot table.
+ */
+static void complete(AsyncClient* client, AsyncOp* op, SearchResponse owner, int64_t size) {
+  client->pending--;
+  if (op->kind == OP_SEARCH) {
+    op->searched(op->arg, op->name, owner);
+  } else {
+    op->fetched(op->arg, op->name, size);
+  }
+  free(op);
+}
+
+static void finish(AsyncClient* client, AsyncOp* op, SearchResponse owner, int64_t size) {
+  client->slots[op->id & client->slot_mask] = NULL;
+  complete(client, op, owner, size);
+}
+
+/**
+ * Closes `conn` and fails every request waiting on it. A registry's connection stays
+ * in place, closed, so requests routed to it fail from then on; a peer's is freed.
+ */
+static void drop_conn(AsyncClient* client, AsyncConn* conn) {
+  // Mark them all first. A callback may open a new connection, which could land where
+  // a freed one was, so `conn` can't be what tells them apart afterwards.
+  for (uint32_t i = 0; i <= client->slot_mask; i++) {
+    AsyncOp* op = client->slots[i];
+    if (op != NULL && op->conn == conn) {
+      op->conn = NULL;
+    }
+  }
+
+  if (conn->fd >= 0) {
+    epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+  }
+  conn->fd = -1;
+  conn->events = 0;
+  conn->receiving = NULL;
+  free(conn->in.data);
+  free(conn->out.data);
+  conn->in = conn->out = (ByteQueue){0};
+
+  if (conn < client->registries || conn >= client->registries + MAX_SHARDS) {
+    AsyncConn** link = &client->peers;
+    while (*link != conn) {
+      link = &(*link)->next;
+    }
+    *link = conn->next;
+    free(conn);
+  }
+
+  // Callbacks may queue requests. Those never need failing here, but if the table grew
+  // to fit them, the rest have moved and it's back to the top.
+  uint32_t i = 0;
+  while (i <= client->slot_mask) {
+    AsyncOp* op = client->slots[i];
+    if (op == NULL || op->conn != NULL) {
+      i++;
+      continue;
+    }
+    AsyncOp** slots = client->slots;
+    client->slots[i] = NULL;
+    complete(client, op, (SearchResponse){.peer_id = 0}, -1);
+    i = client->slots == slots ? i + 1 : 0;
+  }
+}
+
+/**
+ * The connection to `owner`, opening one (without waiting for it) if there isn't one.
+ */
+static AsyncConn* peer_conn(AsyncClient* client, SearchResponse owner) {
+  for (AsyncConn* conn = client->peers; conn != NULL; conn = conn->next) {
+    if (conn->ip == owner.ip && conn->port == owner.port) {
+      return conn;
+    }
+  }
+
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    return NULL;
+  }
+  int one = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(owner.port), .sin_addr.s_addr = owner.ip};
+  if (connect(s, (struct sockaddr*)&address, sizeof(address)) != 0 && errno != EINPROGRESS) {
+    close(s);
+    return NULL;
+  }
+
+  AsyncConn* conn = calloc(1, sizeof(AsyncConn));
+  if (conn == NULL) {
+    close(s);
+    return NULL;
+  }
+  conn->fd = s;
+  conn->connecting = 1;
+  conn->ip = owner.ip;
+  conn->port = owner.port;
+
+  // Writable once the connection is up (or has failed).
+  if (watch(client, conn, EPOLLOUT) != 0) {
+    close(s);
+    free(conn);
+    return NULL;
+  }
+  conn->next = client->peers;
+  client->peers = conn;
+  return conn;
+}
+
+/**
+ * Moves a fetch on from its SEARCH_DIGEST reply to a FETCH from the first holder.
+ */
+static void start_download(AsyncClient* client, AsyncOp* op, const uint8_t* body, uint32_t len) {
+  static const uint8_t unknown[DIGEST_LEN] = {0};
+
+  // [digest][count: u8] then `count` x [10-byte owner record][name\0]
+  uint8_t count = len > DIGEST_LEN ? body[DIGEST_LEN] : 0;
+  const char* holder_name = (const char*)body + DIGEST_LEN + 1 + 10;
+  size_t name_room = len > DIGEST_LEN + 1 + 10 ? len - (DIGEST_LEN + 1 + 10) : 0;
+  size_t name_len = strnlen(holder_name, name_room);
+  if (count == 0 || name_len == name_room || name_len > NAME_MAX) {
+    finish(client, op, (SearchResponse){.peer_id = 0}, -1);
+    return;
+  }
+  SearchResponse owner = parse_owner(body + DIGEST_LEN + 1);
+
+  AsyncConn* conn = peer_conn(client, owner);
+  client->slots[op->id & client->slot_mask] = NULL;
+  if (conn == NULL) {
+    complete(client, op, owner, -1);
+    return;
+  }
+
+  memcpy(op->digest, body, DIGEST_LEN);
+  op->verify = memcmp(op->digest, unknown, DIGEST_LEN) != 0;
+  blake3_hasher_init(&op->hasher);
+  op->kind = OP_FETCH;
+  op->conn = conn;
+  op->deadline = time(NULL) + ASYNC_TIMEOUT_SECS;
+  op->id = take_id(client);
+  if (slot_put(client, op) != 0) {
+    complete(client, op, owner, -1);
+    return;
+  }
+  if (queue_frame(client, conn, FETCH, op->id, NULL, 0, holder_name) != 0) {
+    client->slots[op->id & client->slot_mask] = NULL;
+    complete(client, op, owner, -1);
+  }
+}
+
+/**
+ * Handles every whole reply frame buffered from a registry.
+ * @return 0, or -1 if the registry sent something that's no reply to us.
+ */
+static int parse_registry(AsyncClient* client, AsyncConn* conn) {
+  ByteQueue* in = &conn->in;
+  while (in->len - in->head >= FRAME_HEADER_LEN) {
+    FrameHeader header;
+    decode_frame_header(in->data + in->head, &header);
+    if (in->len - in->head < FRAME_HEADER_LEN + (size_t)header.length) {
+      break;
+    }
+    const uint8_t* body = in->data + in->head + FRAME_HEADER_LEN;
+
+    AsyncOp* op = slot_find(client, header.request_id);
+    if (header.version != PROTO_V1 || op == NULL || op->conn != conn) {
+      return -1;
+    }
+    if (op->kind == OP_SEARCH) {
+      if (header.action != SEARCH || header.length != 10) {
+        return -1;
+      }
+      finish(client, op, parse_owner(body), 0);
+    } else {
+      if (header.action != SEARCH_DIGEST) {
+        return -1;
+      }
+      start_download(client, op, body, header.length);
+    }
+    // The callbacks can queue on other connections, never read from this one, so
+    // `in` is still where it was.
+    in->head += FRAME_HEADER_LEN + header.length;
+  }
+  return 0;
+}
+
+/**
+ * Ends a fetch whose bytes have all arrived.
+ */
+static void finish_download(AsyncClient* client, AsyncConn* conn, AsyncOp* op) {
+  conn->receiving = NULL;
+  if (!op->failed && op->verify) {
+    uint8_t actual[DIGEST_LEN];
+    blake3_hasher_finalize(&op->hasher, actual);
+    op->failed = memcmp(actual, op->digest, DIGEST_LEN) != 0;
+  }
+  finish(client, op, (SearchResponse){.peer_id = 0}, op->failed ? -1 : (int64_t)op->size);
+}
+
+/**
+ * Handles everything buffered from a peer: reply frames, and the file bytes after each.
+ * @return 0, or -1 if the peer sent something that's no reply to us.
+ */
+static int parse_peer(AsyncClient* client, AsyncConn* conn) {
+  ByteQueue* in = &conn->in;
+  while (1) {
+    AsyncOp* op = conn->receiving;
+    if (op != NULL) {
+      size_t n = in->len - in->head;
+      if (n > op->size - op->received) {
+        n = (size_t)(op->size - op->received);
+      }
+      if (n == 0) {
+        break;
+      }
+
+      const uint8_t* data = in->data + in->head;
+      if (!op->failed && pwrite(op->out_fd, data, n, (off_t)op->received) != (ssize_t)n) {
+        op->failed = 1;
+      }
+      if (!op->failed && op->verify) {
+        blake3_hasher_update(&op->hasher, data, n);
+      }
+      op->received += n;
+      in->head += n;
+
+      if (op->received == op->size) {
+        finish_download(client, conn, op);
+      }
+      continue;
+    }
+
+    if (in->len - in->head < FRAME_HEADER_LEN + FETCH_REPLY_LEN) {
+      break;
+    }
+    FrameHeader header;
+    decode_frame_header(in->data + in->head, &header);
+    op = slot_find(client, header.request_id);
+    if (header.version != PROTO_V1 || header.action != FETCH || header.length != FETCH_REPLY_LEN || op == NULL ||
+        op->conn != conn) {
+      return -1;
+    }
+
+    const uint8_t* body = in->data + in->head + FRAME_HEADER_LEN;
+    uint64_t size;
+    memcpy(&size, body + 1, sizeof(size));
+    in->head += FRAME_HEADER_LEN + FETCH_REPLY_LEN;
+
+    if (body[0] != FETCH_OK) {
+      finish(client, op, (SearchResponse){.peer_id = 0}, -1);
+      continue;
+    }
+    op->size = be64toh(size);
+    conn->receiving = op;
+    if (op->size == 0) {
+      finish_download(client, conn, op);
+    }
+  }
+
+  if (in->head == in->len) {
+    in->head = in->len = 0;
+  }
+  return 0;
+}
+
+/**
+ * Writes out as much of `conn`'s queue as the kernel takes.
+ * @return 0, or -1 if the connection is dead.
+ */
+static int flush(AsyncClient* client, AsyncConn* conn) {
+  if (conn->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+      return -1;
+    }
+    conn->connecting = 0;
+  }
+
+  ByteQueue* out = &conn->out;
+  while (out->head < out->len) {
+    ssize_t n = send(conn->fd, out->data + out->head, out->len - out->head, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    out->head += (size_t)n;
+  }
+
+  int done = out->head == out->len;
+  if (done) {
+    out->head = out->len = 0;
+  }
+  return watch(client, conn, EPOLLIN | EPOLLRDHUP | (done ? 0u : (uint32_t)EPOLLOUT));
+}
+
+/**
+ * Reads everything the kernel has for `conn` and handles the replies in it.
+ * @return 0, or -1 if the connection is dead or talking nonsense.
+ */
+static int drain(AsyncClient* client, AsyncConn* conn) {
+  int registry = conn >= client->registries && conn < client->registries + MAX_SHARDS;
+  while (1) {
+    if (reserve(&conn->in, ASYNC_READ_CHUNK) != 0) {
+      return -1;
+    }
+    ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (n == 0) {
+      return -1;
+    }
+    conn->in.len += (size_t)n;
+    conn->heard = time(NULL);
+
+    if ((registry ? parse_registry(client, conn) : parse_peer(client, conn)) != 0) {
+      return -1;
+    }
+  }
+}
+
+AsyncClient* async_open(const Cluster* routing) {
+  AsyncClient* client = calloc(1, sizeof(AsyncClient));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->cluster = *routing;
+  client->next_id = 1;
+  client->slot_mask = INITIAL_SLOTS - 1;
+  client->slots = calloc(INITIAL_SLOTS, sizeof(AsyncOp*));
+  client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  for (uint32_t i = 0; i < MAX_SHARDS; i++) {
+    client->registries[i].fd = -1;
+    client->cluster.shards[i].s = -1;
+  }
+
+  int ok = client->slots != NULL && client->epoll_fd >= 0;
+  for (uint32_t i = 0; i < routing->count && ok; i++) {
+    // "address:port" or "[address]:port", as cluster_open() left it.
+    char host[sizeof(routing->shards[i].name)];
+    strcpy(host, routing->shards[i].name);
+    char* colon = strrchr(host, ':');
+    if (colon == NULL) {
+      ok = 0;
+      break;
+    }
+    *colon = '\0';
+    char* address = host;
+    if (*address == '[') {
+      address++;
+      colon[-1] = '\0';
+    }
+
+    int s = lookup_and_connect(address, colon + 1);
+    if (s < 0) {
+      ok = 0;
+      break;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    client->registries[i].fd = s;
+    ok = watch(client, &client->registries[i], EPOLLIN | EPOLLRDHUP) == 0;
+  }
+
+  if (!ok) {
+    async_close(client);
+    return NULL;
+  }
+  return client;
+}
+
+void async_close(AsyncClient* client) {
+  while (client->peers != NULL) {
+    drop_conn(client, client->peers);
+  }
+  for (uint32_t i = 0; i < MAX_SHARDS; i++) {
+    drop_conn(client, &client->registries[i]);
+  }
+  if (client->epoll_fd >= 0) {
+    close(client->epoll_fd);
+  }
+  free(client->slots);
+  free(client);
+}
+
+/**
+ * Starts `op` with a request to the registry that owns its name.
+ */
+static int submit(AsyncClient* client, AsyncOp* op, uint8_t action, const uint8_t* prefix, size_t prefix_len) {
+  AsyncConn* conn = &client->registries[cluster_shard_of(&client->cluster, op->name)];
+  if (conn->fd < 0) {
+    free(op);
+    return -1;
+  }
+
+  op->conn = conn;
+  op->deadline = time(NULL) + ASYNC_TIMEOUT_SECS;
+  op->id = take_id(client);
+  if (slot_put(client, op) != 0) {
+    free(op);
+    return -1;
+  }
+  if (queue_frame(client, conn, action, op->id, prefix, prefix_len, op->name) != 0) {
+    client->slots[op->id & client->slot_mask] = NULL;
+    free(op);
+    return -1;
+  }
+  client->pending++;
+  return 0;
+}
+
+int async_search(AsyncClient* client, const char* name, SearchCallback done, void* arg) {
+  if (strlen(name) > NAME_MAX) {
+    return -1;
+  }
+  AsyncOp* op = calloc(1, sizeof(AsyncOp));
+  if (op == NULL) {
+    return -1;
+  }
+  op->kind = OP_SEARCH;
+  strcpy(op->name, name);
+  op->searched = done;
+  op->arg = arg;
+  return submit(client, op, SEARCH, NULL, 0);
+}
+
+int async_fetch(AsyncClient* client, const char* name, int out_fd, FetchCallback done, void* arg) {
+  if (strlen(name) > NAME_MAX) {
+    return -1;
+  }
+  AsyncOp* op = calloc(1, sizeof(AsyncOp));
+  if (op == NULL) {
+    return -1;
+  }
+  op->kind = OP_LOOKUP;
+  strcpy(op->name, name);
+  op->fetched = done;
+  op->arg = arg;
+  op->out_fd = out_fd;
+
+  // SEARCH_DIGEST's [k][policy], asking for one holder.
+  const uint8_t query[2] = {1, POLICY_LEAST_LOADED};
+  return submit(client, op, SEARCH_DIGEST, query, sizeof(query));
+}
+
+size_t async_pending(const AsyncClient* client) { return client->pending; }
+
+/**
+ * Drops every connection with a request past its deadline that hasn't heard a thing
+ * for as long. Replies come in order, so nothing behind that request can arrive
+ * either, and one that turned up late would be taken for whatever was sent next.
+ * @return Number of connections dropped.
+ */
+static int expire(AsyncClient* client, time_t now) {
+  int dropped = 0;
+  uint32_t i = 0;
+  while (i <= client->slot_mask) {
+    AsyncOp* op = client->slots[i];
+    if (op == NULL || now < op->deadline || now - op->conn->heard < ASYNC_TIMEOUT_SECS) {
+      i++;
+      continue;
+    }
+    drop_conn(client, op->conn);
+    dropped++;
+    // Its callbacks may have grown the table.
+    i = 0;
+  }
+  return dropped;
+}
+
+int async_run(AsyncClient* client, int timeout_ms) {
+  int waited = 0;
+  while (1) {
+    int wait = timeout_ms;
+    if (client->pending > 0 && (wait < 0 || wait - waited > SWEEP_MS)) {
+      wait = SWEEP_MS;
+    } else if (wait > 0) {
+      wait -= waited;
+    }
+
+    struct epoll_event events[ASYNC_MAX_EVENTS];
+    int n = epoll_wait(client->epoll_fd, events, ASYNC_MAX_EVENTS, wait);
+    if (n < 0) {
+      return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      AsyncConn* conn = events[i].data.ptr;
+      int ok = 1;
+      if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+        ok = flush(client, conn) == 0;
+      }
+      if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        ok = drain(client, conn) == 0;
+      }
+      if (!ok) {
+        drop_conn(client, conn);
+      }
+    }
+
+    n += expire(client, time(NULL));
+    waited += wait;
+    if (n > 0 || (timeout_ms >= 0 && waited >= timeout_ms)) {
+      return n;
+    }
+  }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cluster.h"
+#include "protocol.h"
+
+// Smallest free space we'll hand to recv() on a client connection.
+#define ASYNC_READ_CHUNK (64 * 1024)
+
+// Most sockets handled per async_run() wakeup.
+#define ASYNC_MAX_EVENTS 64
+
+// How long a request may wait for its reply, with nothing at all arriving on its
+// connection, before it's failed.
+#define ASYNC_TIMEOUT_SECS 15
+
+/**
+ * Called once a SEARCH completes. `owner.peer_id` is 0 if the name isn't indexed, or
+ * its registry couldn't be asked.
+ */
+typedef void (*SearchCallback)(void* arg, const char* name, SearchResponse owner);
+
+/**
+ * Called once a FETCH completes, with the file's size, or -1 if it couldn't be had
+ * (not indexed, peer unreachable, or the bytes didn't match the published digest).
+ */
+typedef void (*FetchCallback)(void* arg, const char* name, int64_t size);
+
+typedef struct AsyncClient AsyncClient;
+
+/**
+ * @brief Opens a client that keeps any number of SEARCHes and FETCHes in flight at
+ * once, from one thread.
+ *
+ * Requests are queued on non-blocking connections and written out together; replies
+ * are matched to their requests by request id and handed to the callbacks from
+ * async_run(). Each registry in `routing` gets one connection of the client's own, and
+ * names go to their owners just as `routing` sends them. Each peer gets one
+ * connection too, and every FETCH from it is pipelined on that; peers answer in order,
+ * and each file's bytes follow its reply frame.
+ *
+ * A FETCH asks the name's registry with SEARCH_DIGEST, takes the first holder, and
+ * checks the bytes against the digest if one was published.
+ *
+ * @return The client, or NULL if any registry can't be reached.
+ */
+AsyncClient* async_open(const Cluster* routing);
+
+/**
+ * Fails everything still pending (running its callback) and closes every connection.
+ */
+void async_close(AsyncClient* client);
+
+/**
+ * Queues a SEARCH for `name`; `done` runs from a later async_run().
+ * @return 0, or -1 if it can't be sent (its registry has gone away), in which case
+ *         `done` is never called.
+ */
+int async_search(AsyncClient* client, const char* name, SearchCallback done, void* arg);
+
+/**
+ * Queues a FETCH of `name` into `out_fd`, written from offset 0 with pwrite(2);
+ * `done` runs from a later async_run(). On failure `out_fd` may hold part of the file.
+ * @return 0, or -1 if it can't be sent, in which case `done` is never called.
+ */
+int async_fetch(AsyncClient* client, const char* name, int out_fd, FetchCallback done, void* arg);
+
+/**
+ * Requests whose callbacks haven't run yet.
+ */
+size_t async_pending(const AsyncClient* client);
+
+/**
+ * @brief Sends what's queued and handles whatever arrives within `timeout_ms` (-1 to
+ * wait indefinitely), running callbacks as requests complete.
+ *
+ * Requests that have waited ASYNC_TIMEOUT_SECS on a connection that has gone just as
+ * long without a byte are failed from here too, along with everything else on that
+ * connection, which is closed.
+ *
+ * Callbacks may queue new requests, but must not close the client.
+ *
+ * @return Number of connections that had activity or were given up on; 0 if none
+ *         were in time, -1 on error.
+ */
+int async_run(AsyncClient* client, int timeout_ms);
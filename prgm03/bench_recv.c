@@ -0,0 +1,136 @@
+/**
+ * Microbenchmark for bulk receives: the original recv_all (grow by 1 KiB, read
+ * 1 KiB at a time) against recv_all_into (geometric growth, whole-buffer reads,
+ * reused across calls, with and without a size hint).
+ *
+ * A writer thread pushes N bytes down a socketpair and hangs up; the reader
+ * times how long it takes to collect all of it.
+ *
+ * Usage: bench_recv [max_mb]   (default 1024, i.e. 1 MB through 1 GB)
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utilities.h"
+
+#define WRITE_CHUNK (1 << 20)
+
+typedef struct {
+  int s;
+  size_t len;
+} Writer;
+
+static void* writer(void* arg) {
+  Writer* w = arg;
+  static uint8_t chunk[WRITE_CHUNK];
+  memset(chunk, 0xab, sizeof(chunk));
+
+  size_t sent = 0;
+  while (sent < w->len) {
+    size_t n = w->len - sent < WRITE_CHUNK ? w->len - sent : WRITE_CHUNK;
+    if (send_all(w->s, chunk, n) < 0) {
+      break;
+    }
+    sent += n;
+  }
+  close(w->s);
+  return NULL;
+}
+
+/**
+ * The original recv_all, kept verbatim for comparison.
+ */
+static NetBuffer recv_all_1k(int s) {
+  ptrdiff_t total = 0;
+  ssize_t bytesleft = 0;
+  ssize_t n;
+  uint8_t* buf = NULL;
+
+  while (1) {
+    buf = realloc(buf, total + 1024);
+    bytesleft = 1024;
+    n = recv_buffer(s, buf + total, bytesleft);
+    if (n < 0) {
+      free(buf);
+      return (NetBuffer){.buf = NULL, .len = 0, .error = -1};
+    } else if (n == 0) {
+      break;
+    }
+    total += n;
+  }
+
+  return (NetBuffer){.buf = buf, .len = total, .error = 0};
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum Mode { OLD, NEW, NEW_HINTED };
+
+/**
+ * Runs one transfer of `len` bytes and returns the seconds it took to receive.
+ * `reuse` is the NetBuffer carried between runs for the new paths.
+ */
+static double run(enum Mode mode, size_t len, NetBuffer* reuse) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    perror("socketpair");
+    exit(EXIT_FAILURE);
+  }
+
+  Writer w = {.s = sv[1], .len = len};
+  pthread_t tid;
+  pthread_create(&tid, NULL, writer, &w);
+
+  double start = now();
+  ptrdiff_t got;
+  if (mode == OLD) {
+    NetBuffer nb = recv_all_1k(sv[0]);
+    got = nb.len;
+    free(nb.buf);
+  } else {
+    recv_all_into(sv[0], reuse, mode == NEW_HINTED ? len : 0);
+    got = reuse->len;
+  }
+  double elapsed = now() - start;
+
+  pthread_join(tid, NULL);
+  close(sv[0]);
+
+  if ((size_t)got != len) {
+    fprintf(stderr, "short read: %td of %zu\n", got, len);
+    exit(EXIT_FAILURE);
+  }
+  return elapsed;
+}
+
+int main(int argc, char** argv) {
+  size_t max_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+
+  printf("%10s %14s %14s %14s\n", "size", "old MB/s", "new MB/s", "hinted MB/s");
+
+  for (size_t mb = 1; mb <= max_mb; mb *= 4) {
+    size_t len = mb << 20;
+    NetBuffer reuse = {0};
+
+    // Warm the reused buffer once so the new paths show their steady state.
+    run(NEW, len, &reuse);
+
+    double t_old = run(OLD, len, NULL);
+    double t_new = run(NEW, len, &reuse);
+    double t_hint = run(NEW_HINTED, len, &reuse);
+
+    printf("%8zuMB %14.0f %14.0f %14.0f\n", mb, mb / t_old, mb / t_new, mb / t_hint);
+    free(reuse.buf);
+  }
+
+  return 0;
+}
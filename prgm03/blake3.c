@@ -0,0 +1,346 @@
+#include "blake3.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Domain separation flags.
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// Message word order for each round: the spec's permutation applied 0..6 times,
+// spelled out so rounds index the block directly instead of shuffling it.
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t rotr(uint32_t w, int c) { return (w >> c) | (w << (32 - c)); }
+
+static inline uint32_t load32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void g(uint32_t* state, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+  state[a] = state[a] + state[b] + mx;
+  state[d] = rotr(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = rotr(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + my;
+  state[d] = rotr(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = rotr(state[b] ^ state[c], 7);
+}
+
+static inline void round_fn(uint32_t* state, const uint32_t* m, int r) {
+  const uint8_t* s = MSG_SCHEDULE[r];
+  // Columns.
+  g(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+  g(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+  g(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+  g(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+  // Diagonals.
+  g(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+  g(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+  g(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+  g(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+/**
+ * The compression function, truncated to the 8 words we ever use (the chaining value,
+ * or the first 32 bytes of root output).
+ */
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len, uint64_t counter,
+                     uint8_t flags, uint32_t out[8]) {
+  uint32_t m[16];
+  for (int i = 0; i < 16; i++) {
+    m[i] = load32(block + 4 * i);
+  }
+
+  uint32_t state[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      IV[0], IV[1], IV[2], IV[3], (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+  };
+
+  // Written out so every schedule index is a constant and m stays in registers.
+  round_fn(state, m, 0);
+  round_fn(state, m, 1);
+  round_fn(state, m, 2);
+  round_fn(state, m, 3);
+  round_fn(state, m, 4);
+  round_fn(state, m, 5);
+  round_fn(state, m, 6);
+
+  for (int i = 0; i < 8; i++) {
+    out[i] = state[i] ^ state[i + 8];
+  }
+}
+
+#ifdef __SSE2__
+// Chunks hashed side by side, one per 32-bit lane of an SSE2 register. SSE2 is part
+// of x86-64 itself, so unlike the wider instruction sets it's always there.
+#define SIMD_DEGREE 4
+
+// No vector rotate in SSE2. Macros rather than functions so the shift counts stay
+// immediates even in an unoptimised build.
+#define ROTR4(x, c) _mm_or_si128(_mm_srli_epi32((x), (c)), _mm_slli_epi32((x), 32 - (c)))
+
+#define G4(v, a, b, c, d, mx, my)                                 \
+  do {                                                            \
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), (mx));        \
+    v[d] = ROTR4(_mm_xor_si128(v[d], v[a]), 16);                  \
+    v[c] = _mm_add_epi32(v[c], v[d]);                             \
+    v[b] = ROTR4(_mm_xor_si128(v[b], v[c]), 12);                  \
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), (my));        \
+    v[d] = ROTR4(_mm_xor_si128(v[d], v[a]), 8);                   \
+    v[c] = _mm_add_epi32(v[c], v[d]);                             \
+    v[b] = ROTR4(_mm_xor_si128(v[b], v[c]), 7);                   \
+  } while (0)
+
+static inline void round4(__m128i* v, const __m128i* m, int r) {
+  const uint8_t* s = MSG_SCHEDULE[r];
+  G4(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+  G4(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+  G4(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+  G4(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+  G4(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+  G4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+  G4(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+  G4(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+/**
+ * 4x4 transpose of 32-bit words: afterwards row i holds word i of each input row.
+ */
+static inline void transpose4(__m128i* rows) {
+  __m128i t0 = _mm_unpacklo_epi32(rows[0], rows[1]);
+  __m128i t1 = _mm_unpacklo_epi32(rows[2], rows[3]);
+  __m128i t2 = _mm_unpackhi_epi32(rows[0], rows[1]);
+  __m128i t3 = _mm_unpackhi_epi32(rows[2], rows[3]);
+  rows[0] = _mm_unpacklo_epi64(t0, t1);
+  rows[1] = _mm_unpackhi_epi64(t0, t1);
+  rows[2] = _mm_unpacklo_epi64(t2, t3);
+  rows[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+/**
+ * Chaining values of SIMD_DEGREE consecutive whole chunks starting at `input`, the
+ * first of which is chunk number `counter`. None of them may be the root.
+ */
+static void hash_chunks(const uint8_t* input, uint64_t counter, uint32_t out[SIMD_DEGREE][8]) {
+  __m128i h[8];
+  for (int i = 0; i < 8; i++) {
+    h[i] = _mm_set1_epi32((int)IV[i]);
+  }
+  __m128i counter_lo = _mm_set_epi32((int)(uint32_t)(counter + 3), (int)(uint32_t)(counter + 2),
+                                     (int)(uint32_t)(counter + 1), (int)(uint32_t)counter);
+  __m128i counter_hi = _mm_set_epi32((int)(uint32_t)((counter + 3) >> 32), (int)(uint32_t)((counter + 2) >> 32),
+                                     (int)(uint32_t)((counter + 1) >> 32), (int)(uint32_t)(counter >> 32));
+
+  for (int block = 0; block < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; block++) {
+    // Lane j of m[i] is word i of this block in chunk j. x86 is little-endian, so
+    // plain loads give us the words the spec wants.
+    __m128i m[16];
+    for (int group = 0; group < 4; group++) {
+      for (int lane = 0; lane < SIMD_DEGREE; lane++) {
+        const uint8_t* p = input + lane * BLAKE3_CHUNK_LEN + block * BLAKE3_BLOCK_LEN + group * 16;
+        m[4 * group + lane] = _mm_loadu_si128((const __m128i*)p);
+      }
+      transpose4(m + 4 * group);
+    }
+
+    uint32_t flags = (block == 0 ? CHUNK_START : 0) | (block == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+    __m128i v[16] = {
+        h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+        _mm_set1_epi32((int)IV[0]), _mm_set1_epi32((int)IV[1]), _mm_set1_epi32((int)IV[2]), _mm_set1_epi32((int)IV[3]),
+        counter_lo, counter_hi, _mm_set1_epi32(BLAKE3_BLOCK_LEN), _mm_set1_epi32((int)flags),
+    };
+
+    round4(v, m, 0);
+    round4(v, m, 1);
+    round4(v, m, 2);
+    round4(v, m, 3);
+    round4(v, m, 4);
+    round4(v, m, 5);
+    round4(v, m, 6);
+
+    for (int i = 0; i < 8; i++) {
+      h[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+  }
+
+  // Back from one word per register to one chaining value per chunk.
+  transpose4(h);
+  transpose4(h + 4);
+  for (int lane = 0; lane < SIMD_DEGREE; lane++) {
+    _mm_storeu_si128((__m128i*)out[lane], h[lane]);
+    _mm_storeu_si128((__m128i*)(out[lane] + 4), h[4 + lane]);
+  }
+}
+#endif
+
+static void chunk_state_init(blake3_chunk_state* self, uint64_t chunk_counter) {
+  memcpy(self->cv, IV, sizeof(IV));
+  self->chunk_counter = chunk_counter;
+  memset(self->block, 0, sizeof(self->block));
+  self->block_len = 0;
+  self->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const blake3_chunk_state* self) {
+  return BLAKE3_BLOCK_LEN * (size_t)self->blocks_compressed + self->block_len;
+}
+
+static uint8_t chunk_state_start_flag(const blake3_chunk_state* self) {
+  return self->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_state_update(blake3_chunk_state* self, const uint8_t* input, size_t input_len) {
+  // Whole blocks that aren't the last of the input go straight from the caller's buffer.
+  if (self->block_len == BLAKE3_BLOCK_LEN && input_len > 0) {
+    compress(self->cv, self->block, BLAKE3_BLOCK_LEN, self->chunk_counter, chunk_state_start_flag(self), self->cv);
+    self->blocks_compressed++;
+    memset(self->block, 0, sizeof(self->block));
+    self->block_len = 0;
+  }
+  if (self->block_len == 0) {
+    while (input_len > BLAKE3_BLOCK_LEN) {
+      compress(self->cv, input, BLAKE3_BLOCK_LEN, self->chunk_counter, chunk_state_start_flag(self), self->cv);
+      self->blocks_compressed++;
+      input += BLAKE3_BLOCK_LEN;
+      input_len -= BLAKE3_BLOCK_LEN;
+    }
+  }
+
+  while (input_len > 0) {
+    // Only compress a full block once we know more input follows it; the last block
+    // of a chunk gets CHUNK_END instead.
+    if (self->block_len == BLAKE3_BLOCK_LEN) {
+      compress(self->cv, self->block, BLAKE3_BLOCK_LEN, self->chunk_counter, chunk_state_start_flag(self), self->cv);
+      self->blocks_compressed++;
+      memset(self->block, 0, sizeof(self->block));
+      self->block_len = 0;
+    }
+
+    size_t take = BLAKE3_BLOCK_LEN - self->block_len;
+    if (take > input_len) {
+      take = input_len;
+    }
+    memcpy(self->block + self->block_len, input, take);
+    self->block_len += (uint8_t)take;
+    input += take;
+    input_len -= take;
+  }
+}
+
+/**
+ * Chaining value of a finished chunk, or its root hash with ROOT in `extra_flags`.
+ */
+static void chunk_state_output(const blake3_chunk_state* self, uint8_t extra_flags, uint32_t out[8]) {
+  compress(self->cv, self->block, self->block_len, extra_flags & ROOT ? 0 : self->chunk_counter,
+           chunk_state_start_flag(self) | CHUNK_END | extra_flags, out);
+}
+
+static void parent_output(const uint32_t left[8], const uint32_t right[8], uint8_t extra_flags, uint32_t out[8]) {
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) {
+      block[4 * i + j] = (uint8_t)(left[i] >> (8 * j));
+      block[32 + 4 * i + j] = (uint8_t)(right[i] >> (8 * j));
+    }
+  }
+  compress(IV, block, BLAKE3_BLOCK_LEN, 0, PARENT | extra_flags, out);
+}
+
+void blake3_hasher_init(blake3_hasher* self) {
+  chunk_state_init(&self->chunk, 0);
+  self->cv_stack_len = 0;
+}
+
+/**
+ * Pushes a finished chunk's chaining value, first merging every completed subtree
+ * it closes off. After `total_chunks` chunks, there's one stack entry per 1 bit.
+ */
+static void push_chunk_cv(blake3_hasher* self, uint32_t cv[8], uint64_t total_chunks) {
+  while ((total_chunks & 1) == 0) {
+    self->cv_stack_len--;
+    parent_output(self->cv_stack[self->cv_stack_len], cv, 0, cv);
+    total_chunks >>= 1;
+  }
+  memcpy(self->cv_stack[self->cv_stack_len], cv, 8 * sizeof(uint32_t));
+  self->cv_stack_len++;
+}
+
+void blake3_hasher_update(blake3_hasher* self, const void* input, size_t input_len) {
+  const uint8_t* in = input;
+
+  while (input_len > 0) {
+    // Same as with blocks: a full chunk is only closed once more input arrives.
+    if (chunk_state_len(&self->chunk) == BLAKE3_CHUNK_LEN) {
+      uint32_t cv[8];
+      chunk_state_output(&self->chunk, 0, cv);
+      uint64_t total_chunks = self->chunk.chunk_counter + 1;
+      push_chunk_cv(self, cv, total_chunks);
+      chunk_state_init(&self->chunk, total_chunks);
+    }
+
+#ifdef __SSE2__
+    // Whole chunks with more input after them can't be the root, so do them in batches.
+    if (chunk_state_len(&self->chunk) == 0 && input_len > SIMD_DEGREE * BLAKE3_CHUNK_LEN) {
+      uint32_t cvs[SIMD_DEGREE][8];
+      uint64_t counter = self->chunk.chunk_counter;
+      hash_chunks(in, counter, cvs);
+      for (int i = 0; i < SIMD_DEGREE; i++) {
+        push_chunk_cv(self, cvs[i], counter + i + 1);
+      }
+      chunk_state_init(&self->chunk, counter + SIMD_DEGREE);
+      in += SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+      input_len -= SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+      continue;
+    }
+#endif
+
+    size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&self->chunk);
+    if (take > input_len) {
+      take = input_len;
+    }
+    chunk_state_update(&self->chunk, in, take);
+    in += take;
+    input_len -= take;
+  }
+}
+
+void blake3_hasher_finalize(const blake3_hasher* self, uint8_t out[BLAKE3_OUT_LEN]) {
+  uint32_t words[8];
+
+  if (self->cv_stack_len == 0) {
+    // Only one chunk: it's the root.
+    chunk_state_output(&self->chunk, ROOT, words);
+  } else {
+    // Fold the stack from the right. Only the topmost parent gets ROOT.
+    uint32_t cv[8];
+    chunk_state_output(&self->chunk, 0, cv);
+    for (int i = self->cv_stack_len - 1; i >= 0; i--) {
+      parent_output(self->cv_stack[i], cv, i == 0 ? ROOT : 0, i == 0 ? words : cv);
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) {
+      out[4 * i + j] = (uint8_t)(words[i] >> (8 * j));
+    }
+  }
+}
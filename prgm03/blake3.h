@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Plain-C BLAKE3 (unkeyed hash mode, 32-byte output).
+ *
+ * Long inputs are hashed four 1 KiB chunks at a time with SSE2, the only vector
+ * instruction set every x86-64 machine has; anywhere else, and for the tail of each
+ * update, it's one chunk at a time. The official library goes wider with
+ * SSE4.1/AVX2/AVX-512, but we can't count on those on jaguar.
+ */
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+// Enough subtree chaining values for 2^54 chunks, which is more than a u64 of bytes.
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct {
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint8_t block_len;
+  uint8_t blocks_compressed;
+} blake3_chunk_state;
+
+/**
+ * Incremental hasher. Feed it with blake3_hasher_update in as many pieces as you like;
+ * the result only depends on the concatenation.
+ */
+typedef struct {
+  blake3_chunk_state chunk;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+  uint8_t cv_stack_len;
+} blake3_hasher;
+
+void blake3_hasher_init(blake3_hasher* self);
+
+void blake3_hasher_update(blake3_hasher* self, const void* input, size_t input_len);
+
+/**
+ * Writes the hash of everything fed in so far. Doesn't change the hasher, so more
+ * input can still follow.
+ */
+void blake3_hasher_finalize(const blake3_hasher* self, uint8_t out[BLAKE3_OUT_LEN]);
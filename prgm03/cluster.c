@@ -0,0 +1,234 @@
+#include "cluster.h"
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/**
+ * FNV-1a, finished with MurmurHash3's fmix64 so nearby names and "host:port#i" point
+ * labels spread over the whole ring.
+ */
+static uint64_t ring_hash(const char* s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int compare_points(const void* a, const void* b) {
+  const RingPoint* x = a;
+  const RingPoint* y = b;
+  if (x->point != y->point) {
+    return x->point < y->point ? -1 : 1;
+  }
+  return (x->shard > y->shard) - (x->shard < y->shard);
+}
+
+/**
+ * Splits one registry from a spec, host[:port] or [IPv6 address][:port], in place.
+ * @return 0, or -1 if it's malformed, in which case `entry` is untouched.
+ */
+static int split_entry(char* entry, const char* default_port, char** host, const char** port) {
+  char* rest;  // Whatever follows the host: nothing, or ":port".
+  if (*entry == '[') {
+    char* close = strchr(entry, ']');
+    if (close == NULL || close == entry + 1) {
+      return -1;
+    }
+    rest = close + 1;
+  } else {
+    rest = entry + strcspn(entry, ":");
+    // A bare IPv6 address can't be told apart from host:port.
+    if (rest == entry || strchr(rest + (*rest != '\0'), ':') != NULL) {
+      return -1;
+    }
+  }
+  if (*rest != '\0' && (*rest != ':' || rest[1] == '\0')) {
+    return -1;
+  }
+  if (*rest == '\0' && *default_port == '\0') {
+    return -1;
+  }
+
+  *port = *rest == ':' ? rest + 1 : default_port;
+  if (*entry == '[') {
+    rest[-1] = '\0';
+    *host = entry + 1;
+  } else {
+    *rest = '\0';
+    *host = entry;
+  }
+  return 0;
+}
+
+/**
+ * Connects `shard` to the first address of `host`:`port` that answers, or takes over
+ * `reuse`'s connection to it, and names it after that address. Names are numeric, so
+ * every way of writing the same registry ("localhost", "127.0.0.1", with the default
+ * port or without) puts it at the same points on the ring.
+ * @return 0, or -1 if no address answers.
+ */
+static int connect_shard(Shard* shard, const char* host, const char* port, const Cluster* reuse) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo* result;
+  int err = getaddrinfo(host, port, &hints, &result);
+  if (err != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  shard->s = -1;
+  for (struct addrinfo* rp = result; rp != NULL && shard->s < 0; rp = rp->ai_next) {
+    char address[NI_MAXHOST];
+    char service[NI_MAXSERV];
+    if (getnameinfo(rp->ai_addr, rp->ai_addrlen, address, sizeof(address), service, sizeof(service),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+      continue;
+    }
+    snprintf(shard->name, sizeof(shard->name), rp->ai_family == AF_INET6 ? "[%s]:%s" : "%s:%s", address, service);
+
+    for (uint32_t i = 0; reuse != NULL && i < reuse->count; i++) {
+      if (reuse->shards[i].s >= 0 && strcmp(reuse->shards[i].name, shard->name) == 0) {
+        shard->s = reuse->shards[i].s;
+      }
+    }
+    if (shard->s >= 0) {
+      break;
+    }
+
+    int s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (s < 0) {
+      continue;
+    }
+    if (connect(s, rp->ai_addr, rp->ai_addrlen) != 0) {
+      close(s);
+      continue;
+    }
+    shard->s = s;
+  }
+  freeaddrinfo(result);
+  return shard->s < 0 ? -1 : 0;
+}
+
+int cluster_open(Cluster* cluster, const char* spec, const char* default_port, Cluster* reuse) {
+  cluster->count = 0;
+  cluster->ring_len = 0;
+
+  char* list = strdup(spec);
+  if (list == NULL) {
+    return -1;
+  }
+
+  int ok = 1;
+  char* saveptr;
+  for (char* entry = strtok_r(list, ",", &saveptr); entry != NULL && ok; entry = strtok_r(NULL, ",", &saveptr)) {
+    if (cluster->count == MAX_SHARDS) {
+      fprintf(stderr, "More than %d registries.\n", MAX_SHARDS);
+      ok = 0;
+      break;
+    }
+
+    Shard* shard = &cluster->shards[cluster->count];
+    char* host;
+    const char* port;
+    if (split_entry(entry, default_port, &host, &port) != 0) {
+      fprintf(stderr, "Invalid registry \"%s\"; expected host[:port] or [IPv6 address][:port].\n", entry);
+      ok = 0;
+      break;
+    }
+    if (connect_shard(shard, host, port, reuse) != 0) {
+      fprintf(stderr, "Unable to connect to registry %s:%s.\n", host, port);
+      ok = 0;
+      break;
+    }
+    cluster->count++;
+
+    // Counted already, so it's closed below.
+    for (uint32_t i = 0; i + 1 < cluster->count; i++) {
+      if (strcmp(cluster->shards[i].name, shard->name) == 0) {
+        fprintf(stderr, "Registry %s is listed twice.\n", shard->name);
+        ok = 0;
+      }
+    }
+  }
+  free(list);
+
+  if (!ok || cluster->count == 0) {
+    // Only close what we opened ourselves.
+    for (uint32_t i = 0; i < cluster->count; i++) {
+      int reused = 0;
+      for (uint32_t j = 0; reuse != NULL && j < reuse->count; j++) {
+        reused |= reuse->shards[j].s == cluster->shards[i].s;
+      }
+      if (!reused) {
+        close(cluster->shards[i].s);
+      }
+    }
+    cluster->count = 0;
+    return -1;
+  }
+
+  // Everything worked, so the reused connections are ours now.
+  for (uint32_t i = 0; reuse != NULL && i < reuse->count; i++) {
+    for (uint32_t j = 0; j < cluster->count; j++) {
+      if (reuse->shards[i].s == cluster->shards[j].s) {
+        reuse->shards[i].s = -1;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < cluster->count; i++) {
+    for (uint32_t v = 0; v < SHARD_VNODES; v++) {
+      char label[sizeof(cluster->shards[i].name) + 16];
+      int len = snprintf(label, sizeof(label), "%s#%u", cluster->shards[i].name, v);
+      cluster->ring[cluster->ring_len++] = (RingPoint){.point = ring_hash(label, (size_t)len), .shard = i};
+    }
+  }
+  qsort(cluster->ring, cluster->ring_len, sizeof(RingPoint), compare_points);
+  return 0;
+}
+
+void cluster_close(Cluster* cluster) {
+  for (uint32_t i = 0; i < cluster->count; i++) {
+    if (cluster->shards[i].s >= 0) {
+      close(cluster->shards[i].s);
+      cluster->shards[i].s = -1;
+    }
+  }
+}
+
+uint32_t cluster_shard_of(const Cluster* cluster, const char* name) {
+  if (cluster->count == 1) {
+    return 0;
+  }
+
+  uint64_t h = ring_hash(name, strlen(name));
+
+  // First point at or after h, wrapping around past the last.
+  uint32_t lo = 0;
+  uint32_t hi = cluster->ring_len;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (cluster->ring[mid].point < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return cluster->ring[lo == cluster->ring_len ? 0 : lo].shard;
+}
+
+int cluster_socket_for(const Cluster* cluster, const char* name) {
+  return cluster->shards[cluster_shard_of(cluster, name)].s;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <netdb.h>
+#include <stdint.h>
+
+// Most registries one peer can spread the index over.
+#define MAX_SHARDS 32
+
+// Points each registry gets on the hash ring. More points even out how many names
+// land on each, and how many move when one is added.
+#define SHARD_VNODES 128
+
+typedef struct {
+  char name[NI_MAXHOST + NI_MAXSERV];  // "address:port" connected to, or "[address]:port".
+  int s;                               // Connection to it, or -1.
+} Shard;
+
+typedef struct {
+  uint64_t point;
+  uint32_t shard;
+} RingPoint;
+
+/**
+ * A set of registries that split the file index between them by consistent hashing.
+ * Each filename belongs to exactly one of them: the first point on the ring at or after
+ * the name's hash. The registries themselves know nothing of each other; peers route
+ * every PUBLISH and SEARCH of a name to its owner.
+ *
+ * Adding a registry only moves the names that now hash to it, about 1/count of them.
+ *
+ * A single registry is a cluster of one, and routes everything to it.
+ */
+typedef struct {
+  uint32_t count;
+  Shard shards[MAX_SHARDS];
+  uint32_t ring_len;
+  RingPoint ring[MAX_SHARDS * SHARD_VNODES];
+} Cluster;
+
+/**
+ * Connects to every registry in `spec`, a comma-separated list of host[:port], with
+ * IPv6 addresses in brackets: [::1]:port.
+ *
+ * @param default_port Port for hosts given without one.
+ * @param reuse If not NULL, a cluster whose connections to registries also in `spec`
+ *              are taken over instead of opening new ones; they're set to -1 there.
+ * @return 0 on success, -1 if `spec` is malformed or any registry can't be reached,
+ *         in which case nothing is left open (and `reuse` is untouched).
+ */
+int cluster_open(Cluster* cluster, const char* spec, const char* default_port, Cluster* reuse);
+
+/**
+ * Closes every connection still open.
+ */
+void cluster_close(Cluster* cluster);
+
+/**
+ * Index in `shards` of the registry that owns `name`.
+ */
+uint32_t cluster_shard_of(const Cluster* cluster, const char* name);
+
+/**
+ * Connection to the registry that owns `name`.
+ */
+int cluster_socket_for(const Cluster* cluster, const char* name);
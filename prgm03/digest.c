@@ -0,0 +1,190 @@
+#include "digest.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read size when hashing a file.
+#define HASH_CHUNK (1 << 20)
+
+// One cache record on disk: [dev][ino][mtime s][mtime ns][size], all u64 in host
+// order, then the digest. The file never leaves this machine, so no byte swapping.
+#define RECORD_LEN (5 * sizeof(uint64_t) + DIGEST_LEN)
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t size;
+  uint8_t digest[DIGEST_LEN];
+  uint8_t state;  // SLOT_EMPTY, SLOT_LOADED or SLOT_USED.
+} CacheEntry;
+
+#define SLOT_EMPTY 0
+#define SLOT_LOADED 1  // Came from DIGEST_CACHE, not looked at since.
+#define SLOT_USED 2    // Looked up (or hashed) this run.
+
+// Open-addressed table keyed by (dev, ino). Capacity is a power of two, kept at
+// least twice the count.
+static CacheEntry* table = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+static int loaded = 0;
+
+static size_t slot_for(uint64_t dev, uint64_t ino) {
+  size_t i = (size_t)((ino * 0x9E3779B97F4A7C15ull) ^ dev) & (capacity - 1);
+  while (table[i].state != SLOT_EMPTY && (table[i].dev != dev || table[i].ino != ino)) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return i;
+}
+
+static int grow(void) {
+  size_t old_capacity = capacity;
+  CacheEntry* old = table;
+
+  capacity = capacity == 0 ? 256 : capacity * 2;
+  table = calloc(capacity, sizeof(CacheEntry));
+  if (table == NULL) {
+    table = old;
+    capacity = old_capacity;
+    return -1;
+  }
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].state != SLOT_EMPTY) {
+      table[slot_for(old[i].dev, old[i].ino)] = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+static void insert(const CacheEntry* entry) {
+  if ((count + 1) * 2 > capacity && grow() != 0) {
+    return;  // Just means we'll hash this one again next time.
+  }
+
+  size_t i = slot_for(entry->dev, entry->ino);
+  if (table[i].state == SLOT_EMPTY) {
+    count++;
+  }
+  table[i] = *entry;
+}
+
+static void load(void) {
+  loaded = 1;
+
+  FILE* f = fopen(DIGEST_CACHE, "rb");
+  if (f == NULL) {
+    return;
+  }
+
+  uint8_t record[RECORD_LEN];
+  while (fread(record, RECORD_LEN, 1, f) == 1) {
+    CacheEntry entry;
+    memcpy(&entry.dev, record, 5 * sizeof(uint64_t));
+    memcpy(entry.digest, record + 5 * sizeof(uint64_t), DIGEST_LEN);
+    entry.state = SLOT_LOADED;
+    insert(&entry);
+  }
+  fclose(f);
+}
+
+int digest_fd(int fd, uint8_t out[DIGEST_LEN]) {
+  uint8_t* buf = malloc(HASH_CHUNK);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  blake3_hasher hasher;
+  blake3_hasher_init(&hasher);
+
+  ssize_t n;
+  while ((n = read(fd, buf, HASH_CHUNK)) > 0) {
+    blake3_hasher_update(&hasher, buf, (size_t)n);
+  }
+  free(buf);
+
+  if (n < 0) {
+    return -1;
+  }
+  blake3_hasher_finalize(&hasher, out);
+  return 0;
+}
+
+int digest_shared_file(const char* name, uint8_t out[DIGEST_LEN]) {
+  if (!loaded) {
+    load();
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "SharedFiles/%s", name);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  CacheEntry entry = {
+      .dev = st.st_dev,
+      .ino = st.st_ino,
+      .mtime_sec = (uint64_t)st.st_mtim.tv_sec,
+      .mtime_nsec = (uint64_t)st.st_mtim.tv_nsec,
+      .size = (uint64_t)st.st_size,
+      .state = SLOT_USED,
+  };
+
+  if (capacity > 0) {
+    CacheEntry* cached = &table[slot_for(entry.dev, entry.ino)];
+    if (cached->state != SLOT_EMPTY && cached->mtime_sec == entry.mtime_sec && cached->mtime_nsec == entry.mtime_nsec &&
+        cached->size == entry.size) {
+      cached->state = SLOT_USED;
+      memcpy(out, cached->digest, DIGEST_LEN);
+      close(fd);
+      return 0;
+    }
+  }
+
+  int result = digest_fd(fd, entry.digest);
+  close(fd);
+  if (result != 0) {
+    return -1;
+  }
+
+  insert(&entry);
+  memcpy(out, entry.digest, DIGEST_LEN);
+  return 0;
+}
+
+void digest_cache_save(void) {
+  FILE* f = fopen(DIGEST_CACHE ".tmp", "wb");
+  if (f == NULL) {
+    return;
+  }
+
+  uint8_t record[RECORD_LEN];
+  for (size_t i = 0; i < capacity; i++) {
+    if (table[i].state != SLOT_USED) {
+      continue;
+    }
+    memcpy(record, &table[i].dev, 5 * sizeof(uint64_t));
+    memcpy(record + 5 * sizeof(uint64_t), table[i].digest, DIGEST_LEN);
+    fwrite(record, RECORD_LEN, 1, f);
+  }
+
+  if (fclose(f) == 0) {
+    rename(DIGEST_CACHE ".tmp", DIGEST_CACHE);
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "blake3.h"
+
+#define DIGEST_LEN BLAKE3_OUT_LEN
+
+// Where digests of SharedFiles survive between runs, next to SharedFiles itself.
+#define DIGEST_CACHE ".digests"
+
+/**
+ * Hashes everything from `fd`'s current position to EOF.
+ * @return 0 on success, -1 on a read error.
+ */
+int digest_fd(int fd, uint8_t out[DIGEST_LEN]);
+
+/**
+ * @brief Digest of SharedFiles/<name>.
+ *
+ * Digests are cached by (device, inode, mtime, size), so a file is only read again
+ * once it has changed. The cache is loaded from DIGEST_CACHE the first time this is
+ * called.
+ *
+ * @return 0 on success, -1 if the file couldn't be read.
+ */
+int digest_shared_file(const char* name, uint8_t out[DIGEST_LEN]);
+
+/**
+ * Writes the cache back to DIGEST_CACHE. Only entries looked up since the process
+ * started are kept, so files that have since disappeared drop out.
+ */
+void digest_cache_save(void);
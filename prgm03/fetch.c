@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+
+#include "fetch.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blake3.h"
+#include "peerpool.h"
+#include "utilities.h"
+
+// Checkpoint file: [file size: u64][chunk size: u32][digest], then one byte per chunk,
+// 1 once it's on disk. The digest is all zeros when we weren't given one.
+#define CHECKPOINT_HEADER_LEN (12 + DIGEST_LEN)
+
+// Read size when hashing what's already been written.
+#define HASH_SLICE (256 * 1024)
+
+// How much of a chunk we receive between checks for whether another source beat us to it.
+#define SLICE_SIZE (1 << 20)
+
+typedef enum {
+  CHUNK_TODO = 0,
+  CHUNK_ACTIVE,
+  CHUNK_DONE,
+} ChunkState;
+
+typedef struct {
+  ChunkState state;
+  int workers;     // Sources currently pulling this chunk.
+  double started;  // When the first of them started.
+} Chunk;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  int out_fd;
+  int checkpoint_fd;
+  uint64_t size;
+  const uint8_t* digest;  // NULL if we aren't verifying.
+
+  // Sources not given a thread yet, for threads whose source fails to move on to.
+  const FetchSource* sources;
+  int source_count;
+  int next_source;
+
+  Chunk* chunks;
+  uint32_t chunk_count;
+  uint32_t done;
+  uint32_t first_todo;  // No TODO chunk below this index.
+  int running;          // Source threads that haven't exited yet.
+
+  // The whole-file hash, fed chunk by chunk in file order. Guarded by hash_lock
+  // rather than lock, so hashing never holds up the workers' bookkeeping.
+  pthread_mutex_t hash_lock;
+  blake3_hasher hasher;
+  uint32_t hashed;  // Chunks fed in so far.
+  int hash_error;
+} FetchJob;
+
+typedef struct {
+  FetchJob* job;
+  const FetchSource* source;
+  int s;     // Only changed under job->lock, so the finish can shut it down safely.
+  int busy;  // Working on a chunk, so `s` may be mid-reply. Also under job->lock.
+} Source;
+
+static uint32_t next_request_id = 1;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Sends one FETCH_RANGE and reads back the reply preamble. On success the socket is
+ * left positioned at the first byte of file data.
+ *
+ * @param size Set to the file's total size.
+ * @param length Set to the number of file bytes that follow.
+ * @return 0 on success, 1 if the peer doesn't have the file, -1 if the connection
+ * or the reply is bad.
+ */
+static int request_range(int s, const char* name, uint64_t offset, uint64_t want, uint64_t* size, uint64_t* length) {
+  size_t name_len = strlen(name) + 1;
+  if (name_len > NAME_MAX + 1) {
+    return 1;
+  }
+
+  uint8_t request[FRAME_HEADER_LEN + FETCH_RANGE_REQUEST_LEN + NAME_MAX + 1];
+  uint32_t body_len = (uint32_t)(FETCH_RANGE_REQUEST_LEN + name_len);
+  uint64_t range[2] = {htobe64(offset), htobe64(want)};
+
+  encode_frame_header(request, FETCH_RANGE, __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED), body_len);
+  memcpy(request + FRAME_HEADER_LEN, range, sizeof(range));
+  memcpy(request + FRAME_HEADER_LEN + FETCH_RANGE_REQUEST_LEN, name, name_len);
+
+  if (send_all(s, request, FRAME_HEADER_LEN + body_len) < 0) {
+    return -1;
+  }
+
+  uint8_t reply[FRAME_HEADER_LEN + FETCH_RANGE_REPLY_LEN];
+  if (recv_buffer(s, reply, sizeof(reply)) != sizeof(reply)) {
+    return -1;
+  }
+
+  FrameHeader header;
+  decode_frame_header(reply, &header);
+  if (header.version != PROTO_V1 || header.action != FETCH_RANGE || header.length != FETCH_RANGE_REPLY_LEN) {
+    return -1;
+  }
+  if (reply[FRAME_HEADER_LEN] != FETCH_OK) {
+    return 1;
+  }
+
+  uint64_t fields[3];
+  memcpy(fields, reply + FRAME_HEADER_LEN + 1, sizeof(fields));
+  *size = be64toh(fields[0]);
+  *length = be64toh(fields[2]);
+
+  return be64toh(fields[1]) == offset ? 0 : -1;
+}
+
+/**
+ * Picks the next chunk for a source: the lowest unclaimed one, or failing that the
+ * longest-stalled chunk nobody is duplicating yet. Waits while there's nothing to
+ * take but other sources are still busy.
+ *
+ * @return Chunk index, or -1 once every chunk is done.
+ */
+static int64_t claim_chunk(Source* src) {
+  FetchJob* job = src->job;
+  pthread_mutex_lock(&job->lock);
+
+  while (job->done < job->chunk_count) {
+    for (uint32_t i = job->first_todo; i < job->chunk_count; i++) {
+      if (job->chunks[i].state == CHUNK_TODO) {
+        job->chunks[i].state = CHUNK_ACTIVE;
+        job->chunks[i].workers = 1;
+        job->chunks[i].started = now();
+        job->first_todo = i + 1;
+        src->busy = 1;
+        pthread_mutex_unlock(&job->lock);
+        return i;
+      }
+    }
+    job->first_todo = job->chunk_count;
+
+    double t = now();
+    int64_t stalled = -1;
+    for (uint32_t i = 0; i < job->chunk_count; i++) {
+      Chunk* chunk = &job->chunks[i];
+      if (chunk->state == CHUNK_ACTIVE && chunk->workers == 1 && t - chunk->started >= STALL_SECS &&
+          (stalled < 0 || chunk->started < job->chunks[stalled].started)) {
+        stalled = i;
+      }
+    }
+    if (stalled >= 0) {
+      job->chunks[stalled].workers++;
+      src->busy = 1;
+      pthread_mutex_unlock(&job->lock);
+      return stalled;
+    }
+
+    // Wake up on progress, or when something may have become stalled.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 200 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    pthread_cond_timedwait(&job->changed, &job->lock, &deadline);
+  }
+
+  pthread_mutex_unlock(&job->lock);
+  return -1;
+}
+
+/**
+ * Records how a source's attempt at chunk `i` went. A failed chunk nobody else is
+ * working on goes back up for grabs.
+ */
+static void release_chunk(Source* src, uint32_t i, int ok) {
+  FetchJob* job = src->job;
+  pthread_mutex_lock(&job->lock);
+
+  src->busy = 0;
+  Chunk* chunk = &job->chunks[i];
+  chunk->workers--;
+
+  if (ok && chunk->state != CHUNK_DONE) {
+    chunk->state = CHUNK_DONE;
+    job->done++;
+    if (job->checkpoint_fd >= 0) {
+      uint8_t mark = 1;
+      pwrite(job->checkpoint_fd, &mark, 1, CHECKPOINT_HEADER_LEN + (off_t)i);
+    }
+  } else if (!ok && chunk->state == CHUNK_ACTIVE && chunk->workers == 0) {
+    chunk->state = CHUNK_TODO;
+    if (i < job->first_todo) {
+      job->first_todo = i;
+    }
+  }
+
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static void set_socket(Source* src, int s) {
+  pthread_mutex_lock(&src->job->lock);
+  if (src->s >= 0) {
+    close(src->s);
+  }
+  src->s = s;
+  pthread_mutex_unlock(&src->job->lock);
+}
+
+/**
+ * Puts the source's connection back in the peer pool. Only between chunks, when
+ * there's no reply left in it.
+ */
+static void hand_back(Source* src) {
+  pthread_mutex_lock(&src->job->lock);
+  peer_pool_put(src->source->peer, src->s);
+  src->s = -1;
+  pthread_mutex_unlock(&src->job->lock);
+}
+
+/**
+ * Switches a thread whose source failed to the next one nobody has tried.
+ * @return 0 if there's none left.
+ */
+static int next_source(Source* src) {
+  FetchJob* job = src->job;
+  pthread_mutex_lock(&job->lock);
+  int found = job->next_source < job->source_count;
+  if (found) {
+    src->source = &job->sources[job->next_source++];
+  }
+  pthread_mutex_unlock(&job->lock);
+  return found;
+}
+
+static int chunk_is_done(FetchJob* job, uint32_t i) {
+  pthread_mutex_lock(&job->lock);
+  int done = job->chunks[i].state == CHUNK_DONE;
+  pthread_mutex_unlock(&job->lock);
+  return done;
+}
+
+/**
+ * Pulls chunk `i` from this source into the output file.
+ *
+ * @return 0 when the chunk is written, 1 if another source finished it first (our
+ * connection is dropped, since the rest of the reply is still in it), -1 on error.
+ */
+static int fetch_chunk(Source* src, uint32_t i) {
+  FetchJob* job = src->job;
+  uint64_t offset = (uint64_t)i * CHUNK_SIZE;
+  uint64_t want = job->size - offset < CHUNK_SIZE ? job->size - offset : CHUNK_SIZE;
+  uint64_t size, length;
+
+  if (request_range(src->s, src->source->name, offset, want, &size, &length) != 0 || size != job->size ||
+      length != want) {
+    return -1;
+  }
+
+  off_t at = offset;
+  while (length > 0) {
+    uint64_t slice = length < SLICE_SIZE ? length : SLICE_SIZE;
+    ssize_t n = recv_to_file(src->s, job->out_fd, &at, slice);
+    if (n < 0 || (uint64_t)n != slice) {
+      return -1;
+    }
+    length -= slice;
+
+    if (length > 0 && chunk_is_done(job, i)) {
+      set_socket(src, -1);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Feeds the hasher every chunk from job->hashed onwards that's done, stopping at the
+ * first one that isn't. Caller must hold hash_lock.
+ */
+static void hash_done_chunks(FetchJob* job) {
+  if (job->digest == NULL || job->hash_error) {
+    return;
+  }
+
+  uint8_t buf[HASH_SLICE];
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    int ready = job->hashed < job->chunk_count && job->chunks[job->hashed].state == CHUNK_DONE;
+    pthread_mutex_unlock(&job->lock);
+    if (!ready) {
+      return;
+    }
+
+    // Just written, so this comes straight out of the page cache.
+    uint64_t offset = (uint64_t)job->hashed * CHUNK_SIZE;
+    uint64_t end = job->size - offset < CHUNK_SIZE ? job->size : offset + CHUNK_SIZE;
+    while (offset < end) {
+      size_t want = end - offset < HASH_SLICE ? (size_t)(end - offset) : HASH_SLICE;
+      ssize_t n = pread(job->out_fd, buf, want, (off_t)offset);
+      if (n <= 0) {
+        job->hash_error = 1;
+        return;
+      }
+      blake3_hasher_update(&job->hasher, buf, (size_t)n);
+      offset += (uint64_t)n;
+    }
+    job->hashed++;
+  }
+}
+
+/**
+ * Marks the chunks an earlier attempt already got as done, and leaves the checkpoint
+ * describing this attempt. Must run before the output file is resized, so that a
+ * file with no checkpoint is always one that was written front to back.
+ *
+ * @return 0, or -1 if the checkpoint couldn't be written.
+ */
+static int resume(FetchJob* job) {
+  if (job->checkpoint_fd < 0) {
+    return 0;
+  }
+
+  uint8_t header[CHECKPOINT_HEADER_LEN];
+  uint8_t digest[DIGEST_LEN] = {0};
+  uint64_t size;
+  uint32_t chunk_size;
+  if (job->digest != NULL) {
+    memcpy(digest, job->digest, DIGEST_LEN);
+  }
+
+  int found = pread(job->checkpoint_fd, header, sizeof(header), 0) == sizeof(header);
+  int matches = found;
+  if (matches) {
+    memcpy(&size, header, sizeof(size));
+    memcpy(&chunk_size, header + sizeof(size), sizeof(chunk_size));
+    matches = be64toh(size) == job->size && be32toh(chunk_size) == CHUNK_SIZE &&
+              memcmp(header + sizeof(size) + sizeof(chunk_size), digest, DIGEST_LEN) == 0;
+  }
+
+  if (matches) {
+    uint8_t* marks = calloc(job->chunk_count > 0 ? job->chunk_count : 1, 1);
+    if (marks == NULL) {
+      return -1;
+    }
+    // Anything missing off the end just reads as not done.
+    pread(job->checkpoint_fd, marks, job->chunk_count, CHECKPOINT_HEADER_LEN);
+    for (uint32_t i = 0; i < job->chunk_count; i++) {
+      if (marks[i] == 1) {
+        job->chunks[i].state = CHUNK_DONE;
+        job->done++;
+      }
+    }
+    free(marks);
+    return 0;
+  }
+
+  // A checkpoint for some other version of the file means the partial file is junk.
+  // No checkpoint at all means either there's no partial file, or it was written in
+  // order and every whole chunk it covers is good. (The last chunk counts if the file
+  // is complete.)
+  struct stat st;
+  uint64_t have = !found && fstat(job->out_fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+  uint32_t prefix = have >= job->size && have > 0 ? job->chunk_count : (uint32_t)(have / CHUNK_SIZE);
+
+  size = htobe64(job->size);
+  chunk_size = htobe32(CHUNK_SIZE);
+  memcpy(header, &size, sizeof(size));
+  memcpy(header + sizeof(size), &chunk_size, sizeof(chunk_size));
+  memcpy(header + sizeof(size) + sizeof(chunk_size), digest, DIGEST_LEN);
+
+  uint8_t* marks = calloc(job->chunk_count > 0 ? job->chunk_count : 1, 1);
+  if (marks == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < prefix; i++) {
+    marks[i] = 1;
+    job->chunks[i].state = CHUNK_DONE;
+  }
+  job->done = prefix;
+
+  int ok = ftruncate(job->checkpoint_fd, 0) == 0 && pwrite(job->checkpoint_fd, header, sizeof(header), 0) == sizeof(header) &&
+           pwrite(job->checkpoint_fd, marks, job->chunk_count, CHECKPOINT_HEADER_LEN) == (ssize_t)job->chunk_count;
+  free(marks);
+  return ok ? 0 : -1;
+}
+
+static void* source_main(void* arg) {
+  Source* src = arg;
+  FetchJob* job = src->job;
+  int64_t claimed;
+
+  while ((claimed = claim_chunk(src)) >= 0) {
+    uint32_t i = (uint32_t)claimed;
+
+    if (src->s < 0) {
+      set_socket(src, peer_pool_get(src->source->peer));
+    }
+
+    int result = src->s >= 0 ? fetch_chunk(src, i) : -1;
+    release_chunk(src, i, result == 0);
+    if (result == 0 && pthread_mutex_trylock(&job->hash_lock) == 0) {
+      // Otherwise someone else is already hashing and will pick this chunk up.
+      hash_done_chunks(job);
+      pthread_mutex_unlock(&job->hash_lock);
+    }
+
+    if (result < 0) {
+      // This source is broken or too slow to be worth it. Leave the rest to the others,
+      // and a spare source if there is one.
+      set_socket(src, -1);
+      if (!next_source(src)) {
+        break;
+      }
+    }
+  }
+
+  // Between chunks, so whatever connection is left can serve the next fetch.
+  hand_back(src);
+
+  pthread_mutex_lock(&job->lock);
+  job->running--;
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+int64_t fetch_parallel(const FetchSource* sources, int count, const uint8_t* digest, int out_fd, int checkpoint_fd) {
+  if (count > MAX_SOURCES) {
+    count = MAX_SOURCES;
+  }
+
+  // Ask for an empty range from the first source that answers, just to learn the size.
+  uint64_t size = 0;
+  int found = 0;
+  for (int i = 0; i < count && !found; i++) {
+    int s = peer_pool_get(sources[i].peer);
+    if (s < 0) {
+      continue;
+    }
+    uint64_t length;
+    int result = request_range(s, sources[i].name, 0, 0, &size, &length);
+    if (result < 0) {
+      // The peer may just have closed the pooled connection while it sat idle; that's
+      // no reason to give up on it. Try once more on a connection of our own.
+      close(s);
+      s = connect_to_peer(sources[i].peer);
+      if (s < 0) {
+        continue;
+      }
+      result = request_range(s, sources[i].name, 0, 0, &size, &length);
+    }
+    found = result == 0;
+    if (result < 0) {
+      close(s);
+    } else {
+      // The reply is all read, and the source thread will want it again.
+      peer_pool_put(sources[i].peer, s);
+    }
+  }
+  if (!found) {
+    return -1;
+  }
+
+  FetchJob job = {
+      .sources = sources,
+      .source_count = count,
+      .out_fd = out_fd,
+      .checkpoint_fd = checkpoint_fd,
+      .size = size,
+      .digest = digest,
+      .chunk_count = (uint32_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE),
+  };
+  job.chunks = calloc(job.chunk_count > 0 ? job.chunk_count : 1, sizeof(Chunk));
+  if (job.chunks == NULL) {
+    return -1;
+  }
+
+  // Claim the space up front so chunks can land anywhere. Not every filesystem
+  // supports fallocate; ftruncate alone still gives us a file of the right size.
+  if (resume(&job) != 0 || ftruncate(out_fd, size) != 0) {
+    free(job.chunks);
+    return -1;
+  }
+  if (size > 0) {
+    posix_fallocate(out_fd, 0, size);
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.changed, NULL);
+  pthread_mutex_init(&job.hash_lock, NULL);
+  blake3_hasher_init(&job.hasher);
+
+  Source srcs[MAX_SOURCES];
+  pthread_t threads[MAX_SOURCES];
+  int started = 0;
+
+  // More threads than chunks would only wait around; the other sources are spares.
+  int wanted = job.chunk_count < (uint32_t)count ? (int)job.chunk_count : count;
+  job.next_source = wanted;
+  for (int i = 0; i < wanted; i++) {
+    srcs[started] = (Source){.job = &job, .source = &sources[i], .s = -1};
+    if (pthread_create(&threads[started], NULL, source_main, &srcs[started]) == 0) {
+      started++;
+    }
+  }
+
+  pthread_mutex_lock(&job.lock);
+  job.running += started;
+  while (job.done < job.chunk_count && job.running > 0) {
+    pthread_cond_wait(&job.changed, &job.lock);
+  }
+  // Anyone still busy is stuck on a chunk somebody else already finished. Kick them
+  // out of their recv instead of waiting out PEER_TIMEOUT_SECS. The rest are between
+  // chunks, and keep their connections for the pool.
+  for (int i = 0; i < started; i++) {
+    if (srcs[i].s >= 0 && srcs[i].busy) {
+      shutdown(srcs[i].s, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&job.lock);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  int complete = job.done == job.chunk_count;
+
+  if (complete && digest != NULL) {
+    // Usually only the last few chunks are left to hash by now.
+    uint8_t actual[DIGEST_LEN];
+    pthread_mutex_lock(&job.hash_lock);
+    hash_done_chunks(&job);
+    blake3_hasher_finalize(&job.hasher, actual);
+    pthread_mutex_unlock(&job.hash_lock);
+
+    if (job.hash_error || job.hashed != job.chunk_count || memcmp(actual, digest, DIGEST_LEN) != 0) {
+      // Some source sent bad bytes and we can't tell which chunk, so none of it is
+      // worth resuming from.
+      fprintf(stderr, "Downloaded file doesn't match its digest.\n");
+      ftruncate(out_fd, 0);
+      if (checkpoint_fd >= 0) {
+        ftruncate(checkpoint_fd, 0);
+      }
+      complete = 0;
+    }
+  }
+
+  free(job.chunks);
+  pthread_mutex_destroy(&job.hash_lock);
+  pthread_cond_destroy(&job.changed);
+  pthread_mutex_destroy(&job.lock);
+
+  return complete ? (int64_t)size : -1;
+}
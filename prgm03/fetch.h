@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <limits.h>
+
+#include "digest.h"
+#include "protocol.h"
+
+// Most peers we'll pull one file from at once.
+#define MAX_SOURCES 8
+
+// Unit of work handed to a source. Big enough to amortise a request, small
+// enough that a slow source holding one doesn't hold up the finish for long.
+#define CHUNK_SIZE (4 << 20)
+
+// A source that goes this long without sending us anything is written off.
+#define PEER_TIMEOUT_SECS 15
+
+// Appended to the partial file's name to get its checkpoint file.
+#define CHECKPOINT_SUFFIX ".chunks"
+
+// Once nothing is left unassigned, an idle source re-fetches a chunk that's been
+// in flight at least this long, and whoever finishes first wins.
+#define STALL_SECS 2
+
+/**
+ * A peer to fetch from, and the name it has the content under (which may not be the
+ * name we asked the registry about).
+ */
+typedef struct {
+  SearchResponse peer;
+  char name[NAME_MAX + 1];
+} FetchSource;
+
+/**
+ * @brief Downloads one file in CHUNK_SIZE pieces from several peers at once.
+ *
+ * One thread per source, up to one per chunk, keeps a FETCH_RANGE connection open and
+ * pulls the next unclaimed chunk whenever it finishes one, so faster sources naturally
+ * take more. When the unclaimed chunks run out, idle sources duplicate chunks that
+ * have been in flight for STALL_SECS, which takes the tail away from a slow source. A
+ * source that errors or times out gives its chunk back and its thread moves on to the
+ * next source nobody has tried yet, if any.
+ *
+ * Connections come from the peer pool (see peerpool.h) and go back to it afterwards,
+ * so a run of small files from the same peers reuses the same few connections.
+ *
+ * Chunks are written into `out_fd` with pwrite(2) at their own offsets; the file is
+ * preallocated to the full size first. If `digest` is given, the file is hashed in
+ * order as the chunks at the front complete, and the result must match it.
+ *
+ * If `checkpoint_fd` is given, every chunk that lands is marked in it, and chunks it
+ * already marks (from an earlier, interrupted call for the same file) aren't fetched
+ * again. A checkpoint that doesn't match the file's current size and digest is
+ * discarded. With an empty checkpoint, whatever `out_fd` already holds is taken as a
+ * prefix written in order and only the rest is fetched. Marks aren't synced, so they
+ * survive a dropped connection or a killed client, not a power cut.
+ *
+ * @param sources Peers that have the file, best first. At most MAX_SOURCES are used.
+ * @param digest Expected BLAKE3 of the whole file, or NULL to skip the check.
+ * @param out_fd Partial or empty file, open read/write.
+ * @param checkpoint_fd Open read/write, or -1 to always start from scratch.
+ * @return The file's size on success, or -1 if the file couldn't be completed. On
+ * failure both files are left as they are, ready for another try, except after a
+ * digest mismatch, when both are emptied.
+ */
+int64_t fetch_parallel(const FetchSource* sources, int count, const uint8_t* digest, int out_fd, int checkpoint_fd);
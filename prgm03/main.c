@@ -1,15 +1,29 @@
 #include <arpa/inet.h>
-#include <bits/types/struct_iovec.h>
 #include <complex.h>
 #include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/stat.h>
+
+#include "async.h"
+#include "cluster.h"
+#include "digest.h"
+#include "fetch.h"
+#include "peerpool.h"
+#include "protocol.h"
+#include "server.h"
 #include "utilities.h"
+#include "watch.h"
 
 #define debug_print(fmt, ...) \
   do {                        \
@@ -20,22 +34,27 @@
 
 static int debug = 0;
 
-// Wish we had C23 on jaguar. Could specify enum size.
-// `enum Action : uint8_t {` my beloved.
-enum Action {
-  JOIN = 0,
-  PUBLISH,
-  SEARCH,
-  FETCH,  // New!
-};
+// Page size we ask the registry for when listing.
+#define LIST_PAGE 256
+
+// How often the -s daemon checks that its registries are still there, and tries again
+// to reach one that isn't.
+#define REGISTRY_RETRY_SECS 2
 
 typedef struct {
   uint32_t peer_id;
+  uint16_t listen_port;  // 0 if we aren't serving FETCH; not sent at all then.
 } JoinBody;
 
 typedef struct {
   uint32_t count;
   string* filenames;
+  uint8_t (*digests)[DIGEST_LEN];  // One per filename, or NULL to send none.
+
+  // If set, the same names already laid out back to back (a FileList arena), which
+  // goes out as one piece instead of one per name.
+  const char* packed;
+  size_t packed_len;
 } PublishBody;
 
 typedef struct {
@@ -47,6 +66,60 @@ typedef struct {
   string filename;
 } FetchBody;
 
+typedef struct {
+  uint8_t k;
+  uint8_t policy;
+  string filename;
+} SearchMultiBody;
+
+typedef struct {
+  uint8_t glob;
+  uint16_t limit;
+  string cursor;
+  string pattern;
+} SearchPrefixBody;
+
+// Same layout as PublishBody on the wire.
+typedef struct {
+  uint32_t count;
+  string* filenames;
+} SearchBatchBody;
+
+static uint32_t next_request_id = 1;
+
+// The registries we're talking to. Every name belongs to one of them; see Cluster.
+static Cluster cluster;
+
+// What we last sent JOIN with, so registries added later can be sent the same.
+// peer_id is 0 until then.
+static JoinBody joined = {0};
+
+// Registries the -s daemon reconnects to when one hangs up, as given on the command line.
+static const char* registry_spec;
+static const char* registry_port;
+
+// In the -s daemon, held by whoever uses the registry connections or the snapshot: the
+// watcher, and the thread that keeps the connections up. The prompt is on its own.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * What the registry has from us, so PUBLISH only has to send what changed. Names are
+ * sorted with strcmp, each with the digest it went out with (all zeros if we couldn't
+ * read the file). Until the first full PUBLISH, `published` is 0.
+ *
+ * Names from the last full listing point into its arena; any that -w has added since
+ * are allocated on their own.
+ */
+static struct {
+  int published;
+  uint32_t count;
+  uint32_t cap;  // Entries allocated in names and digests.
+  string* names;
+  uint8_t (*digests)[DIGEST_LEN];
+  char* arena;
+  size_t arena_len;
+} snapshot = {0};
+
 // Thanks to padding, the bit layout here will not match our wire format.
 // We'll still need to memcpy into a byte buffer.
 // Though there's always __attribute__((packed))...
@@ -60,24 +133,19 @@ typedef struct {
     PublishBody publish;
     SearchBody search;
     FetchBody fetch;  // New!
+    SearchMultiBody search_multi;
+    SearchBatchBody search_batch;
+    SearchPrefixBody search_prefix;
   } body;
 } Packet;
 
 /**
- * Represents a response to a search query.
- * If all fields are zero, the file was not found.
- * IP is stored in network byte order.
+ * Outcome of a FETCH. The file itself goes straight to disk, so all that's
+ * left to report is whether it worked and how big it was.
  */
-typedef struct {
-  uint32_t peer_id;
-  uint32_t ip;
-  uint16_t port;
-} SearchResponse;
-
 typedef struct {
   int8_t error;
   ptrdiff_t len;
-  uint8_t* buf;
 } FetchResponse;
 
 /**
@@ -91,13 +159,78 @@ typedef struct {
  */
 SearchResponse p2p_search(string search_term, int s);
 
-FetchResponse p2p_fetch(string search_term, int s);
+/**
+ * @brief Looks up many filenames in one round trip.
+ *
+ * Sends a single SEARCH_BATCH for all `count` names and fills `results[i]` with the
+ * owner of `names[i]` (peer_id 0 if the registry doesn't know it).
+ *
+ * @return 0 on success, -1 if the registry's reply was missing or malformed.
+ */
+int p2p_search_batch(string* names, uint32_t count, SearchResponse* results, int s);
+
+/**
+ * @brief Finds everyone holding the same bytes as `filename`, under whatever name.
+ *
+ * @param digest Set to the file's digest, or all zeros if it was published without one
+ *               (in which case `out` holds the name's owners).
+ * @param out Filled with up to `k` holders, each with the name it has the file under.
+ * @return Number of holders found (0 if none), or -1 if the reply was malformed.
+ */
+int p2p_search_digest(string filename, uint8_t k, uint8_t policy, uint8_t digest[DIGEST_LEN], FetchSource* out, int s);
+
+/**
+ * @brief Prints every indexed file whose name starts with `pattern`.
+ *
+ * If `pattern` contains a glob character (`*`, `?` or `[`) it is matched as a
+ * shell glob instead. Results are fetched from the registry one page at a time.
+ *
+ * @return Number of files listed, or -1 if a reply was malformed.
+ */
+int64_t p2p_list(string pattern, int s);
+
+/**
+ * @brief Fetches `search_term` from every peer that has its content, in parallel.
+ *
+ * Asks for up to MAX_SOURCES holders of the same digest (any name) and hands them to
+ * fetch_parallel, which checks the result against the digest. With a single holder
+ * this is just a chunked download from that peer. The file is streamed to `out_fd` as
+ * it arrives, so memory use doesn't depend on the file's size.
+ *
+ * @param out_fd Open, read/write file, empty or left over from an earlier attempt. It is
+ *               resized to the file's size and written with pwrite(2).
+ * @param checkpoint_fd Records which chunks of `out_fd` are done; see fetch_parallel.
+ */
+FetchResponse p2p_fetch(string search_term, int s, int out_fd, int checkpoint_fd);
 
 /**
  * Returns a pointer to an allocated buffer that contains
  * the network representation of a Packet.
  */
-NetBuffer packet_to_netbuf(Packet packet);
+NetBuffer packet_to_netbuf(Packet packet, uint32_t request_id);
+
+/**
+ * @return The request id it went out with, for matching the reply; 0 for a PUBLISH,
+ *         which gets none.
+ */
+uint32_t send_packet(int s, Packet packet);
+
+/**
+ * Reads one frame header off `s` and checks it is a v1 reply to `action` sent with
+ * `request_id`.
+ * @return 0 on success, -1 on a short read, a header we don't understand, or a reply
+ *         to some other request.
+ */
+int recv_frame_header(int s, uint8_t action, uint32_t request_id, FrameHeader* header);
+
+/**
+ * Request IDs are handed out from more than one thread when a publish is split
+ * between registries.
+ */
+static uint32_t take_request_id(void) { return __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED); }
+
+static int publish_routed(Cluster* cluster, enum Action tag, const PublishBody* body);
+static int rejoin_cluster(void);
 
 void dump_packet(const NetBuffer* packet) {
   for (ssize_t i = 0; i < packet->len; i++) {
@@ -106,20 +239,819 @@ void dump_packet(const NetBuffer* packet) {
   printf("\n");
 }
 
-void send_packet(int s, Packet packet) {
-  NetBuffer nb = packet_to_netbuf(packet);
+/**
+ * Binary search of the snapshot.
+ * @param index Set to where `name` is, or where it would go if it isn't there.
+ * @return 1 if `name` is in the snapshot, 0 if not.
+ */
+static int snapshot_find(const char* name, uint32_t* index) {
+  uint32_t lo = 0;
+  uint32_t hi = snapshot.count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(snapshot.names[mid].buf, name);
+    if (cmp == 0) {
+      *index = mid;
+      return 1;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *index = lo;
+  return 0;
+}
+
+static int snapshot_insert(uint32_t index, const char* name, const uint8_t digest[DIGEST_LEN]) {
+  if (snapshot.count == snapshot.cap) {
+    uint32_t cap = snapshot.cap == 0 ? 16 : snapshot.cap * 2;
+    string* names = realloc(snapshot.names, cap * sizeof(string));
+    if (names == NULL) {
+      return -1;
+    }
+    snapshot.names = names;
+    uint8_t(*digests)[DIGEST_LEN] = realloc(snapshot.digests, cap * sizeof(*digests));
+    if (digests == NULL) {
+      return -1;
+    }
+    snapshot.digests = digests;
+    snapshot.cap = cap;
+  }
+
+  char* copy = strdup(name);
+  if (copy == NULL) {
+    return -1;
+  }
+
+  memmove(snapshot.names + index + 1, snapshot.names + index, (snapshot.count - index) * sizeof(string));
+  memmove(snapshot.digests + index + 1, snapshot.digests + index, (snapshot.count - index) * sizeof(*snapshot.digests));
+  snapshot.names[index] = (string){.buf = copy, .len = (ptrdiff_t)strlen(copy) + 1};
+  memcpy(snapshot.digests[index], digest, DIGEST_LEN);
+  snapshot.count++;
+  return 0;
+}
+
+static void snapshot_free_name(const string* name) {
+  uintptr_t p = (uintptr_t)name->buf;
+  uintptr_t arena = (uintptr_t)snapshot.arena;
+  if (p < arena || p >= arena + snapshot.arena_len) {
+    free(name->buf);
+  }
+}
+
+static void snapshot_erase(uint32_t index) {
+  snapshot_free_name(&snapshot.names[index]);
+  memmove(snapshot.names + index, snapshot.names + index + 1, (snapshot.count - index - 1) * sizeof(string));
+  memmove(snapshot.digests + index, snapshot.digests + index + 1, (snapshot.count - index - 1) * sizeof(*snapshot.digests));
+  snapshot.count--;
+}
+
+/**
+ * Sends a PUBLISH_ADD for `added` and a PUBLISH_REMOVE for `removed`, skipping
+ * whichever is empty.
+ * @return 0 on success, -1 if either couldn't be sent to every registry it was for.
+ */
+static int send_deltas(Cluster* cluster, string* added, uint8_t (*added_digests)[DIGEST_LEN], uint32_t added_count,
+                       string* removed, uint32_t removed_count) {
+  debug_print("%u added or changed, %u removed\n", added_count, removed_count);
+
+  if (added_count > 0) {
+    PublishBody body = {.count = added_count, .filenames = added, .digests = added_digests};
+    if (publish_routed(cluster, PUBLISH_ADD, &body) != 0) {
+      return -1;
+    }
+  }
+  if (removed_count > 0) {
+    PublishBody body = {.count = removed_count, .filenames = removed};
+    if (publish_routed(cluster, PUBLISH_REMOVE, &body) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Enumerates SharedFiles and brings the registry up to date with it. The first time,
+ * that's a full PUBLISH; after that, a PUBLISH_ADD of new or changed files and a
+ * PUBLISH_REMOVE of the ones that are gone, each only if non-empty.
+ *
+ * If anything can't be sent, the snapshot is left as it was and the next call starts
+ * over with a full PUBLISH. That one also withdraws whatever the old snapshot has that
+ * SharedFiles no longer does, since the registry may still have it from before.
+ *
+ * @return 0 on success, 1 if a registry couldn't be sent our changes, -1 if the
+ *         directory couldn't be read.
+ */
+int publish_shared_files(Cluster* cluster) {
+  FileList listing;
+  int32_t count = list_files(&listing);
+  string* file_names = listing.names;
+
+  debug_print("Found %d files\n", count);
+
+  if (debug && count > 0) {
+    for (int i = 0; i < count; i++) {
+      debug_print("%s\n", file_names[i].buf);
+    }
+  }
+
+  if (count < 0) {
+    return -1;
+  }
+
+  if (sort_file_list(&listing) != 0) {
+    free_file_list(&listing);
+    return -1;
+  }
+
+  // Content digests, so peers with the same bytes under other names can serve them too.
+  // Files we can't read right now go out as all zeros, which the registry takes as "unknown".
+  uint8_t(*digests)[DIGEST_LEN] = calloc(count > 0 ? count : 1, sizeof(*digests));
+  if (digests == NULL) {
+    free_file_list(&listing);
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    if (digest_shared_file(file_names[i].buf, digests[i]) != 0) {
+      memset(digests[i], 0, DIGEST_LEN);
+    }
+  }
+  digest_cache_save();
+
+  // Both lists are sorted, so one merge pass finds the difference.
+  string* added = malloc((count > 0 ? count : 1) * sizeof(string));
+  uint8_t(*added_digests)[DIGEST_LEN] = malloc((count > 0 ? count : 1) * sizeof(*added_digests));
+  string* removed = malloc((snapshot.count > 0 ? snapshot.count : 1) * sizeof(string));
+  if (added == NULL || added_digests == NULL || removed == NULL) {
+    free(added);
+    free(added_digests);
+    free(removed);
+    free(digests);
+    free_file_list(&listing);
+    return -1;
+  }
+
+  uint32_t added_count = 0;
+  uint32_t removed_count = 0;
+  uint32_t i = 0;
+  uint32_t j = 0;
+  while (i < (uint32_t)count || j < snapshot.count) {
+    int cmp;
+    if (i == (uint32_t)count) {
+      cmp = 1;
+    } else if (j == snapshot.count) {
+      cmp = -1;
+    } else {
+      cmp = strcmp(file_names[i].buf, snapshot.names[j].buf);
+    }
+
+    if (cmp < 0 || (cmp == 0 && memcmp(digests[i], snapshot.digests[j], DIGEST_LEN) != 0)) {
+      added[added_count] = file_names[i];
+      memcpy(added_digests[added_count++], digests[i], DIGEST_LEN);
+    } else if (cmp > 0) {
+      removed[removed_count++] = snapshot.names[j];
+    }
+    i += cmp <= 0;
+    j += cmp >= 0;
+  }
+
+  int status;
+  if (snapshot.published) {
+    status = send_deltas(cluster, added, added_digests, added_count, removed, removed_count);
+  } else {
+    PublishBody body = {.count = count,
+                        .filenames = file_names,
+                        .digests = digests,
+                        .packed = listing.arena,
+                        .packed_len = listing.arena_len};
+    debug_print("Sending packet\n");
+    status = publish_routed(cluster, PUBLISH, &body);
+    if (status == 0) {
+      status = send_deltas(cluster, NULL, NULL, 0, removed, removed_count);
+    }
+  }
+
+  free(added);
+  free(added_digests);
+  free(removed);
+
+  if (status != 0) {
+    // Some registries may have taken their share, so they all get everything next time.
+    snapshot.published = 0;
+    free(digests);
+    free_file_list(&listing);
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < snapshot.count; i++) {
+    snapshot_free_name(&snapshot.names[i]);
+  }
+  free(snapshot.names);
+  free(snapshot.digests);
+  free(snapshot.arena);
+  snapshot.published = 1;
+  snapshot.count = count;
+  snapshot.cap = count;
+  snapshot.names = file_names;
+  snapshot.digests = digests;
+  snapshot.arena = listing.arena;
+  snapshot.arena_len = listing.arena_len;
+  return 0;
+}
+
+/**
+ * WatchCallback for -w: works out what happened to each changed name from what's in
+ * SharedFiles now, and publishes just that. Nothing else in the directory is looked at.
+ * Runs under registry_lock.
+ *
+ * If that can't be sent, the registries are reconnected and sent everything again,
+ * just as when one hangs up (see rejoin_cluster).
+ *
+ * @param arg Points to the Cluster.
+ */
+static void publish_changes(string* names, uint32_t count, void* arg) {
+  Cluster* cluster = arg;
+  pthread_mutex_lock(&registry_lock);
+
+  if (count == 0) {
+    // Lost events, so we don't know what changed. A rescan still only sends the difference.
+    if (publish_shared_files(cluster) > 0) {
+      fprintf(stderr, "Unable to publish changes to SharedFiles. Reconnecting.\n");
+      rejoin_cluster();
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return;
+  }
+
+  string* added = malloc(count * sizeof(string));
+  uint8_t(*added_digests)[DIGEST_LEN] = malloc(count * sizeof(*added_digests));
+  string* removed = malloc(count * sizeof(string));
+  if (added == NULL || added_digests == NULL || removed == NULL) {
+    free(added);
+    free(added_digests);
+    free(removed);
+    if (publish_shared_files(cluster) > 0) {
+      fprintf(stderr, "Unable to publish changes to SharedFiles. Reconnecting.\n");
+      rejoin_cluster();
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return;
+  }
+
+  uint32_t added_count = 0;
+  uint32_t removed_count = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "SharedFiles/%s", names[i].buf);
+
+    uint32_t index;
+    int known = snapshot_find(names[i].buf, &index);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      uint8_t digest[DIGEST_LEN];
+      if (digest_shared_file(names[i].buf, digest) != 0) {
+        memset(digest, 0, DIGEST_LEN);
+      }
+
+      if (known) {
+        if (memcmp(snapshot.digests[index], digest, DIGEST_LEN) == 0) {
+          continue;  // Rewritten with the same bytes.
+        }
+        memcpy(snapshot.digests[index], digest, DIGEST_LEN);
+      } else if (snapshot_insert(index, names[i].buf, digest) != 0) {
+        continue;
+      }
+
+      added[added_count] = names[i];
+      memcpy(added_digests[added_count++], digest, DIGEST_LEN);
+    } else if (known) {
+      removed[removed_count++] = names[i];
+    }
+  }
+  digest_cache_save();
+
+  if (send_deltas(cluster, added, added_digests, added_count, removed, removed_count) == 0) {
+    for (uint32_t i = 0; i < removed_count; i++) {
+      uint32_t index;
+      if (snapshot_find(removed[i].buf, &index)) {
+        snapshot_erase(index);
+      }
+    }
+  } else {
+    // Removed names stay in the snapshot, so the full PUBLISH withdraws them too.
+    fprintf(stderr, "Unable to publish changes to SharedFiles. Reconnecting.\n");
+    snapshot.published = 0;
+    rejoin_cluster();
+  }
+  pthread_mutex_unlock(&registry_lock);
+
+  free(added);
+  free(added_digests);
+  free(removed);
+}
+
+static void* watch_main(void* arg) {
+  watch_shared_files(publish_changes, arg);
+  fprintf(stderr, "Stopped watching SharedFiles. The registry's index of our files will go stale.\n");
+  return NULL;
+}
+
+/**
+ * Sends a PUBLISH, PUBLISH_ADD or PUBLISH_REMOVE without building it first.
+ *
+ * Only the frame header and count are written out, on the stack. Names and digests go
+ * out by reference through sendmsg(2), IOV_MAX pieces at a time, so nothing is copied
+ * or allocated however many names there are.
+ *
+ * @return 0, or -1 if the connection is dead.
+ */
+static int send_publish(int s, enum Action tag, const PublishBody* body) {
+  size_t names_len = body->packed_len;
+  if (body->packed == NULL) {
+    names_len = 0;
+    for (uint32_t i = 0; i < body->count; i++) {
+      names_len += (size_t)body->filenames[i].len;
+    }
+  }
+  size_t digests_len = body->digests != NULL ? (size_t)body->count * DIGEST_LEN : 0;
+
+  uint8_t header[FRAME_HEADER_LEN + sizeof(uint32_t)];
+  uint32_t length = (uint32_t)(sizeof(uint32_t) + names_len + digests_len);
+  encode_frame_header(header, (uint8_t)tag, take_request_id(), length);
+  if (digests_len > 0) {
+    uint16_t flags = htons(PUBLISH_DIGESTS);
+    memcpy(header + 2, &flags, sizeof(flags));
+  }
+  uint32_t count = htonl(body->count);
+  memcpy(header + FRAME_HEADER_LEN, &count, sizeof(count));
+
+  debug_print("Sending %u names, %u bytes\n", body->count, length);
+
+  struct iovec iov[IOV_MAX];
+  int n = 0;
+  iov[n++] = (struct iovec){.iov_base = header, .iov_len = sizeof(header)};
+
+  if (body->packed != NULL) {
+    iov[n++] = (struct iovec){.iov_base = (void*)body->packed, .iov_len = body->packed_len};
+  } else {
+    for (uint32_t i = 0; i < body->count; i++) {
+      if (n == IOV_MAX) {
+        // MSG_MORE so the full batches don't each go out with a short segment at the end.
+        if (send_iov(s, iov, n, MSG_MORE) < 0) {
+          return -1;
+        }
+        n = 0;
+      }
+      iov[n++] = (struct iovec){.iov_base = body->filenames[i].buf, .iov_len = (size_t)body->filenames[i].len};
+    }
+  }
+
+  if (digests_len > 0) {
+    if (n == IOV_MAX) {
+      if (send_iov(s, iov, n, MSG_MORE) < 0) {
+        return -1;
+      }
+      n = 0;
+    }
+    iov[n++] = (struct iovec){.iov_base = body->digests, .iov_len = digests_len};
+  }
+
+  return send_iov(s, iov, n, 0) < 0 ? -1 : 0;
+}
+
+typedef struct {
+  int s;
+  enum Action tag;
+  PublishBody body;
+  int status;
+} ShardPublish;
+
+static void* send_publish_main(void* arg) {
+  ShardPublish* job = arg;
+  job->status = send_publish(job->s, job->tag, &job->body);
+  return NULL;
+}
+
+/**
+ * Sends each name in `body` (and its digest) to registry `owner[i]` of `cluster`, all
+ * registries at once, one thread each. Registries that get no names get nothing.
+ * @return 0 on success, -1 if any registry's share couldn't be sent.
+ */
+static int publish_split(Cluster* cluster, enum Action tag, const PublishBody* body, const uint32_t* owner) {
+  // Counting sort by registry, so each one's share is a contiguous run.
+  uint32_t start[MAX_SHARDS + 1] = {0};
+  for (uint32_t i = 0; i < body->count; i++) {
+    start[owner[i] + 1]++;
+  }
+  for (uint32_t k = 0; k < cluster->count; k++) {
+    start[k + 1] += start[k];
+  }
+
+  string* names = malloc((body->count > 0 ? body->count : 1) * sizeof(string));
+  uint8_t(*digests)[DIGEST_LEN] = body->digests != NULL ? malloc((body->count > 0 ? body->count : 1) * DIGEST_LEN) : NULL;
+  if (names == NULL || (body->digests != NULL && digests == NULL)) {
+    free(names);
+    free(digests);
+    return -1;
+  }
+
+  uint32_t next[MAX_SHARDS];
+  memcpy(next, start, sizeof(next));
+  for (uint32_t i = 0; i < body->count; i++) {
+    uint32_t at = next[owner[i]]++;
+    names[at] = body->filenames[i];
+    if (digests != NULL) {
+      memcpy(digests[at], body->digests[i], DIGEST_LEN);
+    }
+  }
+
+  ShardPublish jobs[MAX_SHARDS];
+  pthread_t threads[MAX_SHARDS];
+  int running[MAX_SHARDS] = {0};
+  int status = 0;
+  for (uint32_t k = 0; k < cluster->count; k++) {
+    uint32_t count = start[k + 1] - start[k];
+    if (count == 0) {
+      continue;
+    }
+    jobs[k] = (ShardPublish){
+        .s = cluster->shards[k].s,
+        .tag = tag,
+        .body = {.count = count, .filenames = names + start[k], .digests = digests != NULL ? digests + start[k] : NULL}};
+    debug_print("%u names for %s\n", count, cluster->shards[k].name);
+
+    running[k] = pthread_create(&threads[k], NULL, send_publish_main, &jobs[k]) == 0;
+    if (!running[k]) {
+      send_publish_main(&jobs[k]);
+      status |= jobs[k].status;
+    }
+  }
+  for (uint32_t k = 0; k < cluster->count; k++) {
+    if (running[k]) {
+      pthread_join(threads[k], NULL);
+      status |= jobs[k].status;
+    }
+  }
+
+  free(names);
+  free(digests);
+  return status;
+}
+
+/**
+ * Sends a PUBLISH, PUBLISH_ADD or PUBLISH_REMOVE to the cluster, each name to the
+ * registry that owns it.
+ * @return 0 on success, -1 if any registry's share couldn't be sent.
+ */
+static int publish_routed(Cluster* cluster, enum Action tag, const PublishBody* body) {
+  if (cluster->count == 1) {
+    return send_publish(cluster->shards[0].s, tag, body);
+  }
+
+  uint32_t* owner = malloc((body->count > 0 ? body->count : 1) * sizeof(uint32_t));
+  if (owner == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < body->count; i++) {
+    owner[i] = cluster_shard_of(cluster, body->filenames[i].buf);
+  }
+  int status = publish_split(cluster, tag, body, owner);
+  free(owner);
+  return status;
+}
+
+/**
+ * Sends JOIN to every registry in the cluster, or only to `only` if it's a valid index.
+ */
+static void join_cluster(Cluster* cluster, JoinBody body, uint32_t only) {
+  for (uint32_t k = 0; k < cluster->count; k++) {
+    if (only < cluster->count && k != only) {
+      continue;
+    }
+    Packet packet = {.tag = JOIN, .body.join = body};
+    send_packet(cluster->shards[k].s, packet);
+  }
+  joined = body;
+}
+
+static int find_shard(const Cluster* cluster, const char* name) {
+  for (uint32_t k = 0; k < cluster->count; k++) {
+    if (strcmp(cluster->shards[k].name, name) == 0) {
+      return (int)k;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Whether the registry on `s` has hung up on us. Registries never send the -s daemon
+ * anything, so whatever is there to read is thrown away; only the end of the stream or
+ * an error counts.
+ */
+static int registry_gone(int s) {
+  if (s < 0) {
+    return 1;
+  }
+  uint8_t buf[256];
+  ssize_t n;
+  while ((n = recv(s, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+  }
+  return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/**
+ * Reconnects to every registry that has hung up on us and JOINs it again, then sends
+ * everything with a full PUBLISH if the registries might not have it all. A persistent
+ * registry that restarted hands back what we had there as soon as we JOIN again, and
+ * the PUBLISH brings it up to date. For the -s daemon; caller holds registry_lock.
+ *
+ * @return 0 if every registry is connected and has our files, -1 if not yet.
+ */
+static int rejoin_cluster(void) {
+  int gone[MAX_SHARDS] = {0};
+  int any_gone = 0;
+  for (uint32_t k = 0; k < cluster.count; k++) {
+    if (!registry_gone(cluster.shards[k].s)) {
+      continue;
+    }
+    if (cluster.shards[k].s >= 0) {
+      fprintf(stderr, "Lost registry %s. Reconnecting.\n", cluster.shards[k].name);
+      close(cluster.shards[k].s);
+      cluster.shards[k].s = -1;
+    }
+    gone[k] = 1;
+    any_gone = 1;
+  }
+
+  if (any_gone) {
+    // Far too big for the stack.
+    static Cluster next;
+    if (cluster_open(&next, registry_spec, registry_port, &cluster) != 0) {
+      return -1;
+    }
+
+    // Connections cluster_open took over are still JOINed; the rest are new.
+    for (uint32_t k = 0; k < next.count; k++) {
+      int old = find_shard(&cluster, next.shards[k].name);
+      if (old < 0 || gone[old]) {
+        join_cluster(&next, joined, k);
+        fprintf(stderr, "Rejoined registry %s.\n", next.shards[k].name);
+      }
+    }
+    cluster_close(&cluster);
+    memcpy(&cluster, &next, sizeof(cluster));
+
+    // What we had there may be gone, or still there from before we lost it.
+    snapshot.published = 0;
+  }
+
+  if (!snapshot.published) {
+    return publish_shared_files(&cluster) == 0 ? 0 : -1;
+  }
+  return 0;
+}
+
+/**
+ * Keeps the -s daemon's registry connections up for as long as it runs: a registry
+ * that hangs up (restarted, say) is reconnected, JOINed and sent our files again,
+ * retried every REGISTRY_RETRY_SECS until it answers.
+ */
+static void* keep_registries_main(void* arg) {
+  (void)arg;
+  while (1) {
+    struct pollfd fds[MAX_SHARDS];
+    pthread_mutex_lock(&registry_lock);
+    uint32_t count = cluster.count;
+    for (uint32_t k = 0; k < count; k++) {
+      // Ones already lost are -1, which poll skips.
+      fds[k] = (struct pollfd){.fd = cluster.shards[k].s, .events = POLLIN};
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    // Nothing but a hangup should wake us. The watcher may have swapped connections
+    // in the meantime, so rejoin_cluster looks at them all again itself.
+    poll(fds, count, REGISTRY_RETRY_SECS * 1000);
+
+    pthread_mutex_lock(&registry_lock);
+    rejoin_cluster();
+    pthread_mutex_unlock(&registry_lock);
+  }
+  return NULL;
+}
+
+/**
+ * Switches to the registries in `spec`, moving what we've published along with it.
+ *
+ * New registries get a JOIN. Each published name that hashes to a different registry
+ * now goes to its new owner with PUBLISH_ADD, and is withdrawn from its old owner with
+ * PUBLISH_REMOVE if that one stays. Registries that are no longer listed are simply
+ * hung up on, which drops everything we had there.
+ *
+ * @return Number of names moved, or -1 if the new registries couldn't all be reached,
+ *         in which case nothing changes.
+ */
+static int64_t reshard(const char* spec, const char* default_port) {
+  // Far too big for the stack.
+  static Cluster next;
+  if (cluster_open(&next, spec, default_port, &cluster) != 0) {
+    return -1;
+  }
+
+  if (joined.peer_id != 0) {
+    for (uint32_t k = 0; k < next.count; k++) {
+      if (find_shard(&cluster, next.shards[k].name) < 0) {
+        join_cluster(&next, joined, k);
+      }
+    }
+  }
+
+  int64_t moved = 0;
+  if (snapshot.published && snapshot.count > 0) {
+    // Old owner of each name, as an index into next (-1 if it's going away).
+    int old_in_next[MAX_SHARDS];
+    for (uint32_t k = 0; k < cluster.count; k++) {
+      old_in_next[k] = find_shard(&next, cluster.shards[k].name);
+    }
+
+    string* added = malloc(snapshot.count * sizeof(string));
+    uint8_t(*added_digests)[DIGEST_LEN] = malloc(snapshot.count * sizeof(*added_digests));
+    uint32_t* added_owner = malloc(snapshot.count * sizeof(uint32_t));
+    string* removed = malloc(snapshot.count * sizeof(string));
+    uint32_t* removed_owner = malloc(snapshot.count * sizeof(uint32_t));
+
+    if (added != NULL && added_digests != NULL && added_owner != NULL && removed != NULL && removed_owner != NULL) {
+      uint32_t added_count = 0;
+      uint32_t removed_count = 0;
+      for (uint32_t i = 0; i < snapshot.count; i++) {
+        int from = old_in_next[cluster_shard_of(&cluster, snapshot.names[i].buf)];
+        uint32_t to = cluster_shard_of(&next, snapshot.names[i].buf);
+        if (from == (int)to) {
+          continue;
+        }
+
+        added[added_count] = snapshot.names[i];
+        memcpy(added_digests[added_count], snapshot.digests[i], DIGEST_LEN);
+        added_owner[added_count++] = to;
+        if (from >= 0) {
+          removed[removed_count] = snapshot.names[i];
+          removed_owner[removed_count++] = (uint32_t)from;
+        }
+      }
+
+      PublishBody add = {.count = added_count, .filenames = added, .digests = added_digests};
+      PublishBody remove = {.count = removed_count, .filenames = removed};
+      if (publish_split(&next, PUBLISH_ADD, &add, added_owner) != 0 ||
+          publish_split(&next, PUBLISH_REMOVE, &remove, removed_owner) != 0) {
+        // Not sure where everything ended up; have the next PUBLISH send it all again.
+        snapshot.published = 0;
+      }
+      moved = added_count;
+    } else {
+      // Can't work out the moves; have the next PUBLISH send everything instead.
+      snapshot.published = 0;
+    }
+
+    free(added);
+    free(added_digests);
+    free(added_owner);
+    free(removed);
+    free(removed_owner);
+  }
+
+  cluster_close(&cluster);
+  memcpy(&cluster, &next, sizeof(cluster));
+  return moved;
+}
+
+/**
+ * SEARCH_BATCH across the cluster: one batch per registry, for the names it owns.
+ */
+static int search_batch_routed(Cluster* cluster, string* names, uint32_t count, SearchResponse* results) {
+  if (cluster->count == 1) {
+    return p2p_search_batch(names, count, results, cluster->shards[0].s);
+  }
+
+  string* share = malloc(count * sizeof(string));
+  uint32_t* index = malloc(count * sizeof(uint32_t));
+  SearchResponse* share_results = malloc(count * sizeof(SearchResponse));
+  int status = share != NULL && index != NULL && share_results != NULL ? 0 : -1;
+
+  for (uint32_t k = 0; k < cluster->count && status == 0; k++) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      if (cluster_shard_of(cluster, names[i].buf) == k) {
+        share[n] = names[i];
+        index[n++] = i;
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+
+    status = p2p_search_batch(share, n, share_results, cluster->shards[k].s);
+    for (uint32_t i = 0; i < n && status == 0; i++) {
+      results[index[i]] = share_results[i];
+    }
+  }
+
+  free(share);
+  free(index);
+  free(share_results);
+  return status;
+}
+
+/**
+ * A PULL download in progress: lands in "name.part" and takes the real name once done.
+ */
+typedef struct {
+  int fd;
+  uint32_t* failed;
+} PullTarget;
+
+static void pulled(void* arg, const char* name, int64_t size) {
+  PullTarget* target = arg;
+  char part_name[PATH_MAX];
+  snprintf(part_name, sizeof(part_name), "%s.part", name);
+  close(target->fd);
+
+  if (size >= 0 && rename(part_name, name) == 0) {
+    printf("%s: %ld bytes\n", name, (long)size);
+  } else {
+    unlink(part_name);
+    fprintf(stderr, "%s: failed to fetch\n", name);
+    (*target->failed)++;
+  }
+  free(target);
+}
+
+/**
+ * Fetches all `count` names at once over one async client, each from the first peer
+ * that has it. Unlike FETCH there's no resuming: a failed file is just removed.
+ * @return Number of names that couldn't be fetched.
+ */
+static uint32_t pull_files(const Cluster* cluster, string* names, uint32_t count) {
+  AsyncClient* client = async_open(cluster);
+  if (client == NULL) {
+    fprintf(stderr, "Unable to connect to the registries.\n");
+    return count;
+  }
+
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    char part_name[PATH_MAX];
+    snprintf(part_name, sizeof(part_name), "%s.part", names[i].buf);
+
+    PullTarget* target = malloc(sizeof(PullTarget));
+    int fd = open(part_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (target == NULL || fd < 0) {
+      fprintf(stderr, "%s: failed to open for writing\n", names[i].buf);
+    } else {
+      *target = (PullTarget){.fd = fd, .failed = &failed};
+      if (async_fetch(client, names[i].buf, fd, pulled, target) == 0) {
+        continue;
+      }
+      fprintf(stderr, "%s: failed to fetch\n", names[i].buf);
+      unlink(part_name);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(target);
+    failed++;
+  }
+
+  // A peer that goes quiet this long is given up on, with whatever it still owes us.
+  while (async_pending(client) > 0 && async_run(client, PEER_TIMEOUT_SECS * 1000) > 0) {
+  }
+  async_close(client);
+  return failed;
+}
+
+uint32_t send_packet(int s, Packet packet) {
+  if (packet.tag == PUBLISH || packet.tag == PUBLISH_ADD || packet.tag == PUBLISH_REMOVE) {
+    send_publish(s, packet.tag, &packet.body.publish);
+    return 0;
+  }
+
+  uint32_t request_id = take_request_id();
+  NetBuffer nb = packet_to_netbuf(packet, request_id);
   debug_print("Sending packet: ");
   if (debug) {
     dump_packet(&nb);
   }
   send_all(s, nb.buf, nb.len);
   free(nb.buf);
+  return request_id;
 }
 
 
 int main(int argc, char* argv[]) {
   if (argc < 4) {
-    fprintf(stderr, "Usage: %s <registry> <port_number> <peer_id>\n", argv[0]);
+    fprintf(stderr, "Usage: %s <registry>[:port][,<registry>[:port]...] <port_number> <peer_id> [-d] [-s <serve_port> [-w]]\n",
+            argv[0]);
     return (EXIT_FAILURE);
   }
 
@@ -138,40 +1070,99 @@ int main(int argc, char* argv[]) {
     return (EXIT_FAILURE);
   }
 
-  if (argc == 5) {
-    if (strncmp(argv[4], "-d", 2) == 0) {
+  // -s <port> turns us into a daemon that serves SharedFiles instead of running the prompt.
+  const char* serve_port = NULL;
+
+  // -w keeps the registry up to date as SharedFiles changes, alongside serving it.
+  int watch = 0;
+
+  for (int i = 4; i < argc; i++) {
+    if (strncmp(argv[i], "-d", 2) == 0) {
       debug = 1;
+    } else if (strncmp(argv[i], "-s", 2) == 0 && i + 1 < argc) {
+      serve_port = argv[++i];
+    } else if (strncmp(argv[i], "-w", 2) == 0) {
+      watch = 1;
     }
   }
 
-  int s;
+  // Without -s we'd JOIN with no listen port, and publish files no one can fetch.
+  if (watch && serve_port == NULL) {
+    fprintf(stderr, "-w needs -s <serve_port>. Exiting.\n");
+    return (EXIT_FAILURE);
+  }
 
-  if ((s = lookup_and_connect(argv[1], argv[2])) < 0) {
+  // Several registries split the index between them; see Cluster. <port_number> is
+  // the port of any listed without one.
+  if (cluster_open(&cluster, argv[1], argv[2], NULL) < 0) {
     fprintf(stderr, "Unable to connect to host \"%s\". Exiting.\n", argv[1]);
     return (EXIT_FAILURE);
   }
 
+  if (serve_port != NULL) {
+    int listen_port = atoi(serve_port);
+    if (listen_port < 2000 || listen_port > 65535) {
+      fprintf(stderr, "Invalid serve port. Port must be between 2000 and 65535 inclusive.\n");
+      return (EXIT_FAILURE);
+    }
+
+    join_cluster(&cluster, (JoinBody){.peer_id = peer_id, .listen_port = (uint16_t)listen_port}, MAX_SHARDS);
+
+    int published = publish_shared_files(&cluster);
+    if (published < 0) {
+      fprintf(stderr, "Failed to read files. Exiting.\n");
+      return (EXIT_FAILURE);
+    } else if (published > 0) {
+      fprintf(stderr, "Unable to reach the registry. Our files will be published once it's back.\n");
+    }
+
+    // From here on the registry connections are only used under registry_lock, by the
+    // watcher and the thread that reconnects them.
+    registry_spec = argv[1];
+    registry_port = argv[2];
+    pthread_t keeper;
+    if (pthread_create(&keeper, NULL, keep_registries_main, NULL) == 0) {
+      pthread_detach(keeper);
+    }
+    pthread_t watcher;
+    if (watch && pthread_create(&watcher, NULL, watch_main, &cluster) == 0) {
+      pthread_detach(watcher);
+    }
+
+    // Only comes back on failure. The registry connections stay open the whole time,
+    // since hanging up is how we leave.
+    serve_files(serve_port);
+    fprintf(stderr, "File server stopped. Exiting.\n");
+    return (EXIT_FAILURE);
+  }
+
   int exit = 0;
 
   while (!exit) {
     printf("Command: ");
     string cmd_input = readline();
 
+    // Close peer connections left idle since earlier FETCHes.
+    peer_pool_expire();
+
     if (strncasecmp(cmd_input.buf, "EXIT", 4) == 0) {
       exit = 1;
       break;
     }
 
     if (strncasecmp(cmd_input.buf, "JOIN", 4) == 0) {
-      Packet packet = {.tag = JOIN, .body.join = {.peer_id = peer_id}};
-      send_packet(s, packet);
+      join_cluster(&cluster, (JoinBody){.peer_id = peer_id}, MAX_SHARDS);
+
+      // The registry drops a PUBLISH from a peer that hasn't joined yet, so we can't
+      // be sure what it has. Start over with a full PUBLISH.
+      snapshot.published = 0;
     }
 
     if (strncasecmp(cmd_input.buf, "SEARCH", 6) == 0) {
       printf("Filename: ");
       string search_term = readline();
 
-      SearchResponse response = p2p_search(search_term, s);
+      SearchResponse response = p2p_search(search_term, cluster_socket_for(&cluster, search_term.buf));
 
       if (response.peer_id == 0) {
         printf("File not indexed by registry.\n");
@@ -185,25 +1176,27 @@ int main(int argc, char* argv[]) {
     }
 
     if (strncasecmp(cmd_input.buf, "PUBLISH", 7) == 0) {
-      string* file_names = NULL;
-      int32_t count = list_files(&file_names);
-
-      debug_print("Found %d files\n", count);
-
-      if (debug && count > 0) {
-        for (int i = 0; i < count; i++) {
-          debug_print("%s\n", file_names[i].buf);
-        }
-      }
-
-      if (count < 0) {
+      int published = publish_shared_files(&cluster);
+      if (published < 0) {
         fprintf(stderr, "Failed to read files. Exiting.\n");
         return (EXIT_FAILURE);
+      } else if (published > 0) {
+        fprintf(stderr, "Unable to reach the registry. PUBLISH again to retry.\n");
       }
+    }
 
-      Packet packet = {.tag = PUBLISH, .body.publish = {.count = count, .filenames = file_names}};
-      debug_print("Sending packet\n");
-      send_packet(s, packet);
+    if (strncasecmp(cmd_input.buf, "SHARDS", 6) == 0) {
+      printf("Registries: ");
+      string spec = readline();
+      if (spec.buf != NULL) {
+        int64_t moved = reshard(spec.buf, argv[2]);
+        if (moved < 0) {
+          fprintf(stderr, "Unable to reach all of \"%s\". Keeping the old registries.\n", spec.buf);
+        } else {
+          printf("Now on %u registries; moved %ld files.\n", cluster.count, (long)moved);
+        }
+      }
+      free(spec.buf);
     }
 
     // New!
@@ -211,23 +1204,110 @@ int main(int argc, char* argv[]) {
       printf("Filename: ");
       string search_term = readline();
 
-      FetchResponse response = p2p_fetch(search_term, s);
+      // Land in a side file so a failed fetch never leaves a truncated copy under the
+      // real name. Both it and its checkpoint are kept on failure, and the next FETCH
+      // of the same name picks up where this one stopped.
+      char part_name[PATH_MAX];
+      char checkpoint_name[PATH_MAX];
+      snprintf(part_name, sizeof(part_name), "%s.part", search_term.buf);
+      snprintf(checkpoint_name, sizeof(checkpoint_name), "%s.part%s", search_term.buf, CHECKPOINT_SUFFIX);
+
+      int fd = open(part_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      int checkpoint_fd = open(checkpoint_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0 || checkpoint_fd < 0) {
+        fprintf(stderr, "Failed to open file for writing. Exiting.\n");
+        return (EXIT_FAILURE);
+      }
+
+      FetchResponse response = p2p_fetch(search_term, cluster_socket_for(&cluster, search_term.buf), fd, checkpoint_fd);
+      close(fd);
+      close(checkpoint_fd);
 
       if (response.error) {
-        fprintf(stderr, "Failed to fetch file. Exiting.\n");
+        fprintf(stderr, "Failed to fetch file. FETCH it again to resume.\n");
+      } else if (rename(part_name, search_term.buf) != 0) {
+        perror("rename");
         return (EXIT_FAILURE);
+      } else {
+        unlink(checkpoint_name);
       }
+      free(search_term.buf);
+    }
 
-      FILE* f = fopen(search_term.buf, "wb");
-      if (f == NULL) {
-        fprintf(stderr, "Failed to open file for writing. Exiting.\n");
-        return (EXIT_FAILURE);
+    if (strncasecmp(cmd_input.buf, "BATCH", 5) == 0) {
+      printf("Filenames (blank line to finish):\n");
+
+      string* names = NULL;
+      uint32_t count = 0;
+      while (1) {
+        string name = readline();
+        if (name.buf == NULL || name.buf[0] == '\0') {
+          free(name.buf);
+          break;
+        }
+        // Last line of piped input may have no newline, which throws len off by one.
+        name.len = strlen(name.buf) + 1;
+        names = realloc(names, (count + 1) * sizeof(string));
+        names[count++] = name;
       }
 
-      fwrite(response.buf, 1, response.len, f);
-      fclose(f); // This calls fflush for us.
+      SearchResponse* results = malloc(count * sizeof(SearchResponse));
+      if (count > 0 && results != NULL && search_batch_routed(&cluster, names, count, results) == 0) {
+        for (uint32_t i = 0; i < count; i++) {
+          if (results[i].peer_id == 0) {
+            printf("%s: not indexed\n", names[i].buf);
+            continue;
+          }
+          char peer_ip[INET_ADDRSTRLEN];
+          inet_ntop(AF_INET, &results[i].ip, peer_ip, INET_ADDRSTRLEN);
+          printf("%s: Peer %u at %s:%d\n", names[i].buf, results[i].peer_id, peer_ip, results[i].port);
+        }
+      }
 
-      free(response.buf);
+      for (uint32_t i = 0; i < count; i++) {
+        free(names[i].buf);
+      }
+      free(names);
+      free(results);
+    }
+
+    if (strncasecmp(cmd_input.buf, "PULL", 4) == 0) {
+      printf("Filenames (blank line to finish):\n");
+
+      string* names = NULL;
+      uint32_t count = 0;
+      while (1) {
+        string name = readline();
+        if (name.buf == NULL || name.buf[0] == '\0') {
+          free(name.buf);
+          break;
+        }
+        names = realloc(names, (count + 1) * sizeof(string));
+        names[count++] = name;
+      }
+
+      uint32_t failed = pull_files(&cluster, names, count);
+      printf("Fetched %u of %u files.\n", count - failed, count);
+
+      for (uint32_t i = 0; i < count; i++) {
+        free(names[i].buf);
+      }
+      free(names);
+    }
+
+    if (strncasecmp(cmd_input.buf, "LIST", 4) == 0) {
+      printf("Prefix or glob: ");
+      string pattern = readline();
+      if (pattern.buf != NULL) {
+        pattern.len = strlen(pattern.buf) + 1;
+        // Each registry lists its own share, in order; together they're everything.
+        for (uint32_t k = 0; k < cluster.count; k++) {
+          if (p2p_list(pattern, cluster.shards[k].s) < 0) {
+            fprintf(stderr, "Bad list response from registry %s.\n", cluster.shards[k].name);
+          }
+        }
+      }
+      free(pattern.buf);
     }
 
     // For fun.
@@ -236,7 +1316,11 @@ int main(int argc, char* argv[]) {
       printf("\tJOIN\n");
       printf("\tPUBLISH\n");
       printf("\tSEARCH\n");
+      printf("\tBATCH\n");
+      printf("\tLIST\n");
+      printf("\tSHARDS\n");
       printf("\tFETCH\n");
+      printf("\tPULL\n");
       printf("\tEXIT\n");
     }
     free(cmd_input.buf);
@@ -247,98 +1331,232 @@ int main(int argc, char* argv[]) {
 
 SearchResponse p2p_search(string search_term, int s) {
   Packet packet = {.tag = SEARCH, .body.search = {.search_term = search_term}};
-  send_packet(s, packet);
+  uint32_t request_id = send_packet(s, packet);
 
+  FrameHeader header;
   uint8_t response_buf[10];
-  ssize_t rx = recv_buffer(s, response_buf, 10);
 
-  if (rx < 0) {
-    fprintf(stderr, "Failed to receive search response. Exiting.\n");
+  if (recv_frame_header(s, SEARCH, request_id, &header) < 0 || header.length != sizeof(response_buf)) {
+    fprintf(stderr, "Bad search response from registry.\n");
     return (SearchResponse){.peer_id = 0};
   }
 
-  SearchResponse response;
-  memcpy(&response.peer_id, response_buf, sizeof(uint32_t));
-  memcpy(&response.ip, response_buf + sizeof(uint32_t), sizeof(uint32_t));
-  memcpy(&response.port, response_buf + (2 * sizeof(uint32_t)), sizeof(uint16_t));
-  response.peer_id = ntohl(response.peer_id);
-  response.port = ntohs(response.port);
+  ssize_t rx = recv_buffer(s, response_buf, sizeof(response_buf));
+
+  if (rx != sizeof(response_buf)) {
+    fprintf(stderr, "Failed to receive search response. Exiting.\n");
+    return (SearchResponse){.peer_id = 0};
+  }
 
-  return response;
+  return parse_owner(response_buf);
 }
 
-// Kind of lazy way to reuse lookup_and_connect.
-int connect_to_peer(SearchResponse response) {
-  char peer_ip[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &response.ip, peer_ip, INET_ADDRSTRLEN);
-  char port[6];
-  snprintf(port, 6, "%d", response.port);
-  return lookup_and_connect(peer_ip, port);
+int recv_frame_header(int s, uint8_t action, uint32_t request_id, FrameHeader* header) {
+  uint8_t raw[FRAME_HEADER_LEN];
+  if (recv_buffer(s, raw, FRAME_HEADER_LEN) != FRAME_HEADER_LEN) {
+    return -1;
+  }
+
+  decode_frame_header(raw, header);
+
+  if (header->version != PROTO_V1 || header->action != action || header->request_id != request_id) {
+    return -1;
+  }
+  return 0;
 }
 
-FetchResponse receive_file(int peer_s) {
-  NetBuffer rx = recv_all(peer_s);
-  if (rx.error) {
-    fprintf(stderr, "Failed to receive file. Exiting.\n");
-    return (FetchResponse){.error = 1};
+int p2p_search_batch(string* names, uint32_t count, SearchResponse* results, int s) {
+  Packet packet = {.tag = SEARCH_BATCH, .body.search_batch = {.count = count, .filenames = names}};
+  uint32_t request_id = send_packet(s, packet);
+
+  FrameHeader header;
+  if (recv_frame_header(s, SEARCH_BATCH, request_id, &header) < 0 || header.length != sizeof(uint32_t) + (size_t)count * 10) {
+    fprintf(stderr, "Bad batch search response from registry.\n");
+    return -1;
   }
 
-  FetchResponse fetch_response;
-  memcpy(&fetch_response.error, rx.buf, sizeof(int8_t));
-  fetch_response.len = rx.len - sizeof(int8_t);
-  fetch_response.buf = malloc(fetch_response.len);
-  if (fetch_response.buf == NULL) {
-    fprintf(stderr, "Memory allocation failed. Exiting.\n");
-    free(rx.buf);
-    return (FetchResponse){.error = 1};
+  uint8_t* body = malloc(header.length);
+  if (body == NULL) {
+    return -1;
+  }
+  if (recv_buffer(s, body, header.length) != header.length) {
+    free(body);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    results[i] = parse_owner(body + sizeof(uint32_t) + i * 10);
   }
-  memcpy(fetch_response.buf, rx.buf + sizeof(int8_t), fetch_response.len);
-  free(rx.buf);
 
-  return fetch_response;
+  free(body);
+  return 0;
 }
 
-FetchResponse p2p_fetch(string search_term, int s) {
-  SearchResponse response = p2p_search(search_term, s);
+int64_t p2p_list(string pattern, int s) {
+  int64_t total = 0;
+  uint8_t glob = strpbrk(pattern.buf, "*?[") != NULL;
+
+  // The cursor is the last name of the previous page; it starts out empty.
+  char* cursor = strdup("");
+
+  while (1) {
+    Packet packet = {.tag = SEARCH_PREFIX,
+                     .body.search_prefix = {.glob = glob,
+                                            .limit = LIST_PAGE,
+                                            .cursor = {.buf = cursor, .len = strlen(cursor) + 1},
+                                            .pattern = pattern}};
+    uint32_t request_id = send_packet(s, packet);
+
+    FrameHeader header;
+    if (recv_frame_header(s, SEARCH_PREFIX, request_id, &header) < 0 || header.length < 3) {
+      free(cursor);
+      return -1;
+    }
 
-  if (response.peer_id == 0) {
-    return (FetchResponse){.error = 1};
+    uint8_t* body = malloc(header.length);
+    if (body == NULL || recv_buffer(s, body, header.length) != header.length) {
+      free(body);
+      free(cursor);
+      return -1;
+    }
+
+    uint16_t count;
+    memcpy(&count, body, sizeof(uint16_t));
+    count = ntohs(count);
+    uint8_t more = body[2] & 0x01;
+
+    size_t offset = 3;
+    for (uint16_t i = 0; i < count && offset + 10 < header.length; i++) {
+      SearchResponse owner = parse_owner(body + offset);
+      offset += 10;
+
+      const char* name = (const char*)body + offset;
+      size_t len = strnlen(name, header.length - offset);
+      offset += len + 1;
+
+      char peer_ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &owner.ip, peer_ip, INET_ADDRSTRLEN);
+      printf("%.*s: Peer %u at %s:%d\n", (int)len, name, owner.peer_id, peer_ip, owner.port);
+
+      free(cursor);
+      cursor = strndup(name, len);
+      total++;
+    }
+
+    free(body);
+    if (!more) {
+      break;
+    }
+  }
+
+  free(cursor);
+  return total;
+}
+
+int p2p_search_digest(string filename, uint8_t k, uint8_t policy, uint8_t digest[DIGEST_LEN], FetchSource* out, int s) {
+  Packet packet = {.tag = SEARCH_DIGEST, .body.search_multi = {.k = k, .policy = policy, .filename = filename}};
+  uint32_t request_id = send_packet(s, packet);
+
+  // [digest][count: u8] then `count` x [10-byte owner record][name\0]
+  FrameHeader header;
+  if (recv_frame_header(s, SEARCH_DIGEST, request_id, &header) < 0 || header.length < DIGEST_LEN + 1 ||
+      header.length > DIGEST_LEN + 1 + (size_t)k * (10 + NAME_MAX + 1)) {
+    fprintf(stderr, "Bad search response from registry.\n");
+    return -1;
+  }
+
+  uint8_t* body = malloc(header.length);
+  if (body == NULL || recv_buffer(s, body, header.length) != header.length) {
+    free(body);
+    return -1;
+  }
+
+  memcpy(digest, body, DIGEST_LEN);
+  uint8_t count = body[DIGEST_LEN];
+
+  size_t offset = DIGEST_LEN + 1;
+  uint8_t found = 0;
+  for (; found < count && found < k && offset + 10 < header.length; found++) {
+    out[found].peer = parse_owner(body + offset);
+    offset += 10;
+
+    const char* name = (const char*)body + offset;
+    size_t len = strnlen(name, header.length - offset);
+    if (len > NAME_MAX || offset + len == header.length) {
+      break;
+    }
+    memcpy(out[found].name, name, len + 1);
+    offset += len + 1;
   }
 
-  int peer_s = connect_to_peer(response);
+  free(body);
+  if (found != count) {
+    fprintf(stderr, "Bad search response from registry.\n");
+    return -1;
+  }
+  return count;
+}
 
-  if (peer_s < 0) {
-    fprintf(stderr, "Failed to connect to peer. Exiting.\n");
+FetchResponse p2p_fetch(string search_term, int s, int out_fd, int checkpoint_fd) {
+  FetchSource sources[MAX_SOURCES];
+  uint8_t digest[DIGEST_LEN];
+  int count = p2p_search_digest(search_term, MAX_SOURCES, POLICY_LEAST_LOADED, digest, sources, s);
+
+  if (count <= 0) {
     return (FetchResponse){.error = 1};
   }
 
-  Packet packet = {.tag = FETCH, .body.fetch = {.filename = search_term}};
-  send_packet(peer_s, packet);
+  // An all-zero digest means nobody told the registry what the bytes should be.
+  static const uint8_t unknown[DIGEST_LEN] = {0};
+  const uint8_t* expected = memcmp(digest, unknown, DIGEST_LEN) == 0 ? NULL : digest;
+
+  int64_t size = fetch_parallel(sources, count, expected, out_fd, checkpoint_fd);
 
-  FetchResponse fetch_response = receive_file(peer_s);
+  if (size < 0) {
+    fprintf(stderr, "Failed to fetch from any of %d peers.\n", count);
+    return (FetchResponse){.error = 1};
+  }
 
-  close(peer_s);
-  return fetch_response;
+  return (FetchResponse){.error = 0, .len = size};
 }
 
-NetBuffer packet_to_netbuf(Packet packet) {
+NetBuffer packet_to_netbuf(Packet packet, uint32_t request_id) {
   // Build the total size of the buffer.
-  size_t size = sizeof(uint8_t);
+  size_t size = FRAME_HEADER_LEN;
   switch (packet.tag) {
     case JOIN:
       size += sizeof(packet.body.join.peer_id);
+      if (packet.body.join.listen_port != 0) {
+        size += sizeof(packet.body.join.listen_port);
+      }
       break;
-    case PUBLISH:
-      size += sizeof(packet.body.publish.count);
-      for (uint32_t i = 0; i < packet.body.publish.count; i++) {
-        size += packet.body.publish.filenames[i].len;
+    case PUBLISH:  // send_packet hands these to send_publish, which never builds a buffer.
+    case PUBLISH_ADD:
+    case PUBLISH_REMOVE:
+      break;
+    case SEARCH_PREFIX:
+      size += sizeof(packet.body.search_prefix.glob) + sizeof(packet.body.search_prefix.limit);
+      size += packet.body.search_prefix.cursor.len + packet.body.search_prefix.pattern.len;
+      break;
+    case SEARCH_BATCH:
+      size += sizeof(packet.body.search_batch.count);
+      for (uint32_t i = 0; i < packet.body.search_batch.count; i++) {
+        size += packet.body.search_batch.filenames[i].len;
       }
       break;
     case SEARCH:
       size += packet.body.search.search_term.len;
       break;
+    case SEARCH_MULTI:
+    case SEARCH_DIGEST:
+      size += sizeof(packet.body.search_multi.k) + sizeof(packet.body.search_multi.policy);
+      size += packet.body.search_multi.filename.len;
+      break;
     case FETCH:  // New!
       size += packet.body.fetch.filename.len;
+      break;
+    case FETCH_RANGE:  // Only ever sent by fetch.c, which frames its own.
+      break;
   }
 
   // Allocate the buffer.
@@ -348,23 +1566,42 @@ NetBuffer packet_to_netbuf(Packet packet) {
   }
 
   uint8_t* offset = buffer;
-  memcpy(offset, &packet.tag, sizeof(uint8_t));
-  offset += sizeof(uint8_t);
+  encode_frame_header(offset, (uint8_t)packet.tag, request_id, (uint32_t)(size - FRAME_HEADER_LEN));
+  offset += FRAME_HEADER_LEN;
 
   // Serialize the body.
   switch (packet.tag) {
     case JOIN: {
       uint32_t peer_id = htonl(packet.body.join.peer_id);
       memcpy(offset, &peer_id, sizeof(peer_id));
+      if (packet.body.join.listen_port != 0) {
+        uint16_t listen_port = htons(packet.body.join.listen_port);
+        memcpy(offset + sizeof(peer_id), &listen_port, sizeof(listen_port));
+      }
       break;
     }
-    case PUBLISH: {
-      uint32_t count = htonl(packet.body.publish.count);
+    case PUBLISH:
+    case PUBLISH_ADD:
+    case PUBLISH_REMOVE:
+      break;
+    case SEARCH_PREFIX: {
+      uint16_t limit = htons(packet.body.search_prefix.limit);
+      memcpy(offset, &packet.body.search_prefix.glob, sizeof(uint8_t));
+      offset += sizeof(uint8_t);
+      memcpy(offset, &limit, sizeof(limit));
+      offset += sizeof(limit);
+      memcpy(offset, packet.body.search_prefix.cursor.buf, packet.body.search_prefix.cursor.len);
+      offset += packet.body.search_prefix.cursor.len;
+      memcpy(offset, packet.body.search_prefix.pattern.buf, packet.body.search_prefix.pattern.len);
+      break;
+    }
+    case SEARCH_BATCH: {
+      uint32_t count = htonl(packet.body.search_batch.count);
       memcpy(offset, &count, sizeof(count));
       offset += sizeof(count);
-      for (uint32_t i = 0; i < packet.body.publish.count; i++) {
-        ptrdiff_t len = packet.body.publish.filenames[i].len;
-        memcpy(offset, packet.body.publish.filenames[i].buf, len);
+      for (uint32_t i = 0; i < packet.body.search_batch.count; i++) {
+        ptrdiff_t len = packet.body.search_batch.filenames[i].len;
+        memcpy(offset, packet.body.search_batch.filenames[i].buf, len);
         offset += len;
       }
       break;
@@ -372,9 +1609,17 @@ NetBuffer packet_to_netbuf(Packet packet) {
     case SEARCH:
       memcpy(offset, packet.body.search.search_term.buf, packet.body.search.search_term.len);
       break;
+    case SEARCH_MULTI:
+    case SEARCH_DIGEST:
+      offset[0] = packet.body.search_multi.k;
+      offset[1] = packet.body.search_multi.policy;
+      memcpy(offset + 2, packet.body.search_multi.filename.buf, packet.body.search_multi.filename.len);
+      break;
     case FETCH:  // New!
       memcpy(offset, packet.body.fetch.filename.buf, packet.body.fetch.filename.len);
       break;
+    case FETCH_RANGE:
+      break;
   }
 
   return (NetBuffer){.buf = buffer, .len = size};
@@ -0,0 +1,119 @@
+#include "peerpool.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fetch.h"
+
+typedef struct {
+  uint32_t ip;  // Network byte order, as in SearchResponse.
+  uint16_t port;
+  int s;
+  double idle_since;
+} IdlePeer;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static IdlePeer idle[MAX_IDLE_PEERS];
+static int idle_count = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int connect_to_peer(SearchResponse peer) {
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(peer.port), .sin_addr.s_addr = peer.ip};
+
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    return -1;
+  }
+  if (connect(s, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    close(s);
+    return -1;
+  }
+
+  // Lets a stalled source fail out instead of hanging its thread forever.
+  struct timeval timeout = {.tv_sec = PEER_TIMEOUT_SECS, .tv_usec = 0};
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return s;
+}
+
+/**
+ * An idle connection should have nothing to read. If it does, it's the peer's FIN (or
+ * an error, or bytes nobody asked for), and the connection is no good to us.
+ */
+static int still_open(int s) {
+  uint8_t byte;
+  ssize_t n = recv(s, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void drop(int i) {
+  close(idle[i].s);
+  idle[i] = idle[--idle_count];
+}
+
+static void expire_locked(double t) {
+  for (int i = idle_count - 1; i >= 0; i--) {
+    if (t - idle[i].idle_since >= PEER_IDLE_SECS) {
+      drop(i);
+    }
+  }
+}
+
+int peer_pool_get(SearchResponse peer) {
+  double t = now();
+  int s = -1;
+
+  pthread_mutex_lock(&lock);
+  expire_locked(t);
+  for (int i = idle_count - 1; i >= 0 && s < 0; i--) {
+    if (idle[i].ip != peer.ip || idle[i].port != peer.port) {
+      continue;
+    }
+    if (still_open(idle[i].s)) {
+      s = idle[i].s;
+      idle[i] = idle[--idle_count];
+    } else {
+      drop(i);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return s >= 0 ? s : connect_to_peer(peer);
+}
+
+void peer_pool_put(SearchResponse peer, int s) {
+  if (s < 0) {
+    return;
+  }
+  double t = now();
+
+  pthread_mutex_lock(&lock);
+  expire_locked(t);
+  if (idle_count == MAX_IDLE_PEERS) {
+    int oldest = 0;
+    for (int i = 1; i < idle_count; i++) {
+      if (idle[i].idle_since < idle[oldest].idle_since) {
+        oldest = i;
+      }
+    }
+    drop(oldest);
+  }
+  idle[idle_count++] = (IdlePeer){.ip = peer.ip, .port = peer.port, .s = s, .idle_since = t};
+  pthread_mutex_unlock(&lock);
+}
+
+void peer_pool_expire(void) {
+  pthread_mutex_lock(&lock);
+  expire_locked(now());
+  pthread_mutex_unlock(&lock);
+}
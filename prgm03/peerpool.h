@@ -0,0 +1,40 @@
+#pragma once
+
+#include "protocol.h"
+
+// An idle connection to a peer is closed once it's gone this long without a request.
+#define PEER_IDLE_SECS 30
+
+// Most idle peer connections kept open at once, across all peers. Past this the one
+// idle longest is closed to make room.
+#define MAX_IDLE_PEERS 64
+
+/**
+ * Opens a TCP connection straight to a peer found through the registry; its address
+ * is already an IP, so there's nothing to resolve.
+ * @return A connected socket, or -1.
+ */
+int connect_to_peer(SearchResponse peer);
+
+/**
+ * @brief A connection to `peer`, for one or more FETCH/FETCH_RANGE requests.
+ *
+ * Reuses an idle connection to the same ip and port if there is one the peer hasn't
+ * closed in the meantime, so back-to-back fetches from one peer cost one handshake
+ * between them instead of one each. Otherwise opens a new one. Thread-safe.
+ *
+ * @return A connected socket, or -1.
+ */
+int peer_pool_get(SearchResponse peer);
+
+/**
+ * Gives a connection from peer_pool_get() back, idle, for the next fetch from `peer`.
+ * Only for a connection between replies: one with part of a reply still unread must be
+ * closed instead.
+ */
+void peer_pool_put(SearchResponse peer, int s);
+
+/**
+ * Closes every connection that's been idle for PEER_IDLE_SECS.
+ */
+void peer_pool_expire(void);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+// Wish we had C23 on jaguar. Could specify enum size.
+// `enum Action : uint8_t {` my beloved.
+enum Action {
+  JOIN = 0,
+  PUBLISH,
+  SEARCH,
+  FETCH,  // New!
+  SEARCH_MULTI,
+  SEARCH_BATCH,
+  SEARCH_PREFIX,
+  FETCH_RANGE,  // Peer to peer only; the registry never sees it.
+  SEARCH_DIGEST,
+  PUBLISH_ADD,
+  PUBLISH_REMOVE,
+};
+
+/**
+ * Every packet goes out in the registry's v1 framing: a 12-byte header
+ * (version, action, flags, request id, body length; network byte order)
+ * followed by the body. Replies come back framed the same way, with our
+ * request id echoed.
+ */
+#define PROTO_V1 0x81
+#define FRAME_HEADER_LEN 12
+
+typedef struct {
+  uint8_t version;
+  uint8_t action;
+  uint16_t flags;
+  uint32_t request_id;
+  uint32_t length;
+} FrameHeader;
+
+// PUBLISH and PUBLISH_ADD frame flag: the names are followed by one digest each.
+#define PUBLISH_DIGESTS 0x0001
+
+/**
+ * A v1 FETCH reply is a frame whose body is [status: u8][size: u64], followed
+ * by `size` raw bytes of file content outside the frame. The connection stays
+ * open afterwards for the next request.
+ */
+#define FETCH_REPLY_LEN 9
+#define FETCH_OK 0
+#define FETCH_NOT_FOUND 1
+
+/**
+ * FETCH_RANGE asks for part of a file: [offset: u64][length: u64][name\0].
+ * The reply frame body is [status: u8][file size: u64][offset: u64][length: u64],
+ * followed by `length` raw bytes. The range is clamped to the file, so asking for
+ * length 0 is a cheap way to learn the size.
+ */
+#define FETCH_RANGE_REQUEST_LEN 16
+#define FETCH_RANGE_REPLY_LEN 25
+
+// SEARCH_MULTI owner selection policies.
+#define POLICY_NEAREST 0
+#define POLICY_LEAST_LOADED 1
+#define POLICY_RANDOM 2
+
+/**
+ * Content digests are 32-byte BLAKE3 hashes (DIGEST_LEN). PUBLISH may end with one per name, in
+ * the same order, after the last name: [count: u32][name\0]...[digest]...
+ *
+ * SEARCH_DIGEST takes the same body as SEARCH_MULTI and answers with the digest the
+ * name was last published with, plus up to k peers holding those bytes under any name:
+ * [digest][count: u8] then `count` x [id: u32][ip: u32][port: u16][name\0].
+ * If nobody published a digest for the name, the digest is all zeros and the
+ * holders are just the name's owners.
+ */
+
+/**
+ * PUBLISH_ADD is laid out exactly like PUBLISH and adds to (or updates the digests of)
+ * what we've already published. PUBLISH_REMOVE is [count: u32][name\0]... with no
+ * digests, and withdraws those names. A full PUBLISH never removes anything.
+ */
+
+/**
+ * Represents a response to a search query.
+ * If all fields are zero, the file was not found.
+ * IP is stored in network byte order.
+ */
+typedef struct {
+  uint32_t peer_id;
+  uint32_t ip;
+  uint16_t port;
+} SearchResponse;
+
+/**
+ * Decodes one 10-byte (id, ip, port) owner record, as found in search responses.
+ */
+static inline SearchResponse parse_owner(const uint8_t* record) {
+  SearchResponse response;
+  memcpy(&response.peer_id, record, sizeof(uint32_t));
+  memcpy(&response.ip, record + sizeof(uint32_t), sizeof(uint32_t));
+  memcpy(&response.port, record + (2 * sizeof(uint32_t)), sizeof(uint16_t));
+  response.peer_id = ntohl(response.peer_id);
+  response.port = ntohs(response.port);
+  return response;
+}
+
+static inline void encode_frame_header(uint8_t* out, uint8_t action, uint32_t request_id, uint32_t length) {
+  memset(out, 0, FRAME_HEADER_LEN);
+  out[0] = PROTO_V1;
+  out[1] = action;
+  request_id = htonl(request_id);
+  length = htonl(length);
+  memcpy(out + 4, &request_id, sizeof(uint32_t));
+  memcpy(out + 8, &length, sizeof(uint32_t));
+}
+
+static inline void decode_frame_header(const uint8_t* raw, FrameHeader* header) {
+  header->version = raw[0];
+  header->action = raw[1];
+  memcpy(&header->flags, raw + 2, sizeof(uint16_t));
+  memcpy(&header->request_id, raw + 4, sizeof(uint32_t));
+  memcpy(&header->length, raw + 8, sizeof(uint32_t));
+  header->flags = ntohs(header->flags);
+  header->request_id = ntohl(header->request_id);
+  header->length = ntohl(header->length);
+}
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE  // accept4
+
+#include "server.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "utilities.h"
+
+#define MAX_EVENTS 64
+#define MAX_PENDING 64
+
+// Longest name we'll accept in a FETCH. Plenty for anything in SharedFiles.
+#define MAX_NAME_LEN NAME_MAX
+
+// Most sendfile(2) will move per call anyway.
+#define SENDFILE_CHUNK 0x7ffff000
+
+typedef struct {
+  int fd;
+
+  // Request bytes we haven't parsed yet.
+  uint8_t in[FRAME_HEADER_LEN + FETCH_RANGE_REQUEST_LEN + MAX_NAME_LEN + 1];
+  size_t in_len;
+
+  // Reply header, then the file itself.
+  uint8_t out[FRAME_HEADER_LEN + FETCH_RANGE_REPLY_LEN];
+  size_t out_len;
+  size_t out_sent;
+  int file_fd;
+  off_t offset;
+  off_t end;
+
+  int sending;
+  int legacy;
+  int read_closed;
+} FetchConn;
+
+static int epoll_fd = -1;
+
+/**
+ * Same as lookup_and_connect, but passive: bind and listen on every local interface.
+ */
+static int bind_and_listen(const char* service) {
+  struct addrinfo hints;
+  struct addrinfo *rp, *result;
+  int s;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_protocol = 0;
+
+  if ((s = getaddrinfo(NULL, service, &hints, &result)) != 0) {
+    fprintf(stderr, "fetch-server: getaddrinfo: %s\n", gai_strerror(s));
+    return -1;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    if ((s = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol)) == -1) {
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (!bind(s, rp->ai_addr, rp->ai_addrlen)) {
+      break;
+    }
+
+    close(s);
+  }
+  freeaddrinfo(result);
+
+  if (rp == NULL) {
+    perror("fetch-server: bind");
+    return -1;
+  }
+  if (listen(s, MAX_PENDING) == -1) {
+    perror("fetch-server: listen");
+    close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+static void set_interest(FetchConn* conn, uint32_t events) {
+  struct epoll_event ev = {.events = events, .data.ptr = conn};
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void close_conn(FetchConn* conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  if (conn->file_fd >= 0) {
+    close(conn->file_fd);
+  }
+  free(conn);
+}
+
+/**
+ * Opens SharedFiles/<name> for reading, refusing anything that isn't a plain
+ * name of a regular file in that directory. Dotfiles are shared like any other,
+ * since list_files() and the watcher publish them.
+ *
+ * @return An open fd with *size set, or -1.
+ */
+static int open_shared(const char* name, off_t* size) {
+  if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL) {
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "SharedFiles/%s", name);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+
+  *size = st.st_size;
+  return fd;
+}
+
+/**
+ * Looks for one complete request at the front of conn->in and, if there is one,
+ * sets up its reply and switches the connection over to sending.
+ *
+ * @return 1 if a reply is ready, 0 if we need more bytes, -1 if the request is garbage.
+ */
+static int start_request(FetchConn* conn) {
+  const char* name;
+  size_t consumed;
+  FrameHeader header = {0};
+  uint64_t offset = 0;
+  uint64_t length = UINT64_MAX;
+
+  if (conn->in_len == 0) {
+    return 0;
+  }
+
+  if (conn->in[0] == FETCH) {
+    // Legacy: [FETCH][name\0], reply is [status][bytes] and then we hang up.
+    name = (const char*)conn->in + 1;
+    if (memchr(name, '\0', conn->in_len - 1) == NULL) {
+      return conn->in_len == sizeof(conn->in) ? -1 : 0;
+    }
+    conn->legacy = 1;
+    consumed = conn->in_len;
+  } else {
+    if (conn->in_len < FRAME_HEADER_LEN) {
+      return 0;
+    }
+    decode_frame_header(conn->in, &header);
+
+    size_t fixed = header.action == FETCH_RANGE ? FETCH_RANGE_REQUEST_LEN : 0;
+    if (header.version != PROTO_V1 || (header.action != FETCH && header.action != FETCH_RANGE) || header.length <= fixed ||
+        header.length > fixed + MAX_NAME_LEN + 1) {
+      return -1;
+    }
+    if (conn->in_len < FRAME_HEADER_LEN + header.length) {
+      return 0;
+    }
+
+    if (header.action == FETCH_RANGE) {
+      memcpy(&offset, conn->in + FRAME_HEADER_LEN, sizeof(uint64_t));
+      memcpy(&length, conn->in + FRAME_HEADER_LEN + sizeof(uint64_t), sizeof(uint64_t));
+      offset = be64toh(offset);
+      length = be64toh(length);
+    }
+
+    name = (const char*)conn->in + FRAME_HEADER_LEN + fixed;
+    if (name[header.length - fixed - 1] != '\0') {
+      return -1;
+    }
+    consumed = FRAME_HEADER_LEN + header.length;
+  }
+
+  off_t size = 0;
+  conn->file_fd = open_shared(name, &size);
+  uint8_t status = conn->file_fd >= 0 ? FETCH_OK : FETCH_NOT_FOUND;
+
+  // Clamp the range to what the file actually has.
+  if (offset > (uint64_t)size) {
+    offset = size;
+  }
+  if (length > (uint64_t)size - offset) {
+    length = size - offset;
+  }
+
+  conn->offset = offset;
+  conn->end = offset + length;
+  conn->out_sent = 0;
+
+  if (conn->legacy) {
+    conn->out[0] = status;
+    conn->out_len = 1;
+  } else if (header.action == FETCH) {
+    uint64_t wire_size = htobe64((uint64_t)size);
+    encode_frame_header(conn->out, FETCH, header.request_id, FETCH_REPLY_LEN);
+    conn->out[FRAME_HEADER_LEN] = status;
+    memcpy(conn->out + FRAME_HEADER_LEN + 1, &wire_size, sizeof(uint64_t));
+    conn->out_len = FRAME_HEADER_LEN + FETCH_REPLY_LEN;
+  } else {
+    uint64_t wire[3] = {htobe64((uint64_t)size), htobe64(offset), htobe64(length)};
+    encode_frame_header(conn->out, FETCH_RANGE, header.request_id, FETCH_RANGE_REPLY_LEN);
+    conn->out[FRAME_HEADER_LEN] = status;
+    memcpy(conn->out + FRAME_HEADER_LEN + 1, wire, sizeof(wire));
+    conn->out_len = FRAME_HEADER_LEN + FETCH_RANGE_REPLY_LEN;
+  }
+
+  memmove(conn->in, conn->in + consumed, conn->in_len - consumed);
+  conn->in_len -= consumed;
+
+  conn->sending = 1;
+  set_interest(conn, EPOLLOUT);
+  return 1;
+}
+
+/**
+ * Pushes as much of the current reply as the socket will take.
+ *
+ * @return 1 when the reply is finished, 0 if the socket is full, -1 on error.
+ */
+static int continue_reply(FetchConn* conn) {
+  // With file data to follow, hold the preamble back so it goes out in the same
+  // segment as the data's first bytes.
+  int more = conn->file_fd >= 0 && conn->offset < conn->end ? MSG_MORE : 0;
+  while (conn->out_sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL | more);
+    if (n < 0) {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    conn->out_sent += n;
+  }
+
+  while (conn->file_fd >= 0 && conn->offset < conn->end) {
+    off_t left = conn->end - conn->offset;
+    ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->offset, left < SENDFILE_CHUNK ? left : SENDFILE_CHUNK);
+    if (n < 0) {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (n == 0) {
+      // File shrank under us. Nothing sane left to send.
+      return -1;
+    }
+  }
+
+  if (conn->file_fd >= 0) {
+    close(conn->file_fd);
+    conn->file_fd = -1;
+  }
+  conn->sending = 0;
+  return 1;
+}
+
+/**
+ * Runs replies back to back for as long as requests are queued and the socket
+ * keeps up. Closes the connection when there's nothing left to do for it.
+ */
+static void pump(FetchConn* conn) {
+  while (1) {
+    if (conn->sending) {
+      int done = continue_reply(conn);
+      if (done < 0 || (done == 1 && conn->legacy)) {
+        close_conn(conn);
+        return;
+      }
+      if (done == 0) {
+        return;
+      }
+    }
+
+    int started = start_request(conn);
+    if (started < 0) {
+      close_conn(conn);
+      return;
+    }
+    if (started == 0) {
+      break;
+    }
+  }
+
+  if (conn->read_closed) {
+    close_conn(conn);
+    return;
+  }
+  set_interest(conn, EPOLLIN | EPOLLRDHUP);
+}
+
+static void on_readable(FetchConn* conn) {
+  while (conn->in_len < sizeof(conn->in)) {
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      close_conn(conn);
+      return;
+    }
+    if (n == 0) {
+      conn->read_closed = 1;
+      break;
+    }
+    conn->in_len += n;
+  }
+
+  pump(conn);
+}
+
+static void accept_all(int listen_socket) {
+  while (1) {
+    int s = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (s < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        perror("fetch-server: accept");
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+
+    FetchConn* conn = calloc(1, sizeof(FetchConn));
+    if (conn == NULL) {
+      close(s);
+      continue;
+    }
+    conn->fd = s;
+    conn->file_fd = -1;
+
+    // Connections stay open for request after request. Without this, the tail of a
+    // reply can sit behind Nagle until the peer's delayed ACK for the one before.
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0) {
+      close(s);
+      free(conn);
+    }
+  }
+}
+
+int serve_files(const char* port) {
+  int listen_socket = bind_and_listen(port);
+  if (listen_socket < 0) {
+    return -1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("fetch-server: epoll_create1");
+    close(listen_socket);
+    return -1;
+  }
+
+  // The listen socket is the only one registered with a NULL data pointer.
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev);
+
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("fetch-server: epoll_wait");
+      return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      FetchConn* conn = events[i].data.ptr;
+      if (conn == NULL) {
+        accept_all(listen_socket);
+      } else if (conn->sending) {
+        pump(conn);
+      } else {
+        on_readable(conn);
+      }
+    }
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Serves FETCH requests for files in the SharedFiles directory until something
+ * unrecoverable happens.
+ *
+ * All connections are multiplexed on one epoll loop, and file contents go from
+ * the page cache to the socket with sendfile(2), never through userspace.
+ * Answers v1 framed FETCH and FETCH_RANGE (connection stays open for more
+ * requests) and legacy FETCH ([status][bytes], then close).
+ *
+ * @param port Local port to listen on, as for getaddrinfo(3).
+ * @return -1 on error. Does not return otherwise.
+ */
+int serve_files(const char* port);
@@ -1,7 +1,22 @@
+#define _GNU_SOURCE  // splice, pipe2
+
 #include "utilities.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Smallest allocation a NetBuffer starts out with.
+#define NETBUF_MIN (64 * 1024)
+
+// Bytes moved per splice(2) pair, and the size of the fallback bounce buffer.
+#define STREAM_CHUNK (1 << 20)
+
+// Bytes of directory entries asked for per getdents64(2), and the arena's first size.
+#define DIRENT_BATCH (1 << 20)
 
 ssize_t recv_buffer(int socket, uint8_t* buff, ssize_t len) {
   ssize_t bytes_received;
@@ -24,27 +39,188 @@ ssize_t recv_buffer(int socket, uint8_t* buff, ssize_t len) {
   return total_received;
 }
 
-NetBuffer recv_all(int s) {
-  ptrdiff_t total = 0;
-  ssize_t bytesleft = 0;
-  ssize_t n;
-  uint8_t* buf = NULL;
+/**
+ * Makes room for at least `want` more bytes past nb->len, doubling so a long
+ * stream costs O(log n) reallocations instead of one per read.
+ */
+static int netbuf_reserve(NetBuffer* nb, ptrdiff_t want) {
+  if (nb->cap - nb->len >= want) {
+    return 0;
+  }
+
+  ptrdiff_t cap = nb->cap > 0 ? nb->cap : NETBUF_MIN;
+  while (cap - nb->len < want) {
+    cap *= 2;
+  }
+
+  uint8_t* buf = realloc(nb->buf, cap);
+  if (buf == NULL) {
+    return -1;
+  }
+  nb->buf = buf;
+  nb->cap = cap;
+  return 0;
+}
+
+int recv_all_into(int s, NetBuffer* nb, size_t size_hint) {
+  nb->len = 0;
+  nb->error = 0;
+
+  // Room for the whole thing up front when we know how big it is.
+  if (netbuf_reserve(nb, size_hint > 0 ? (ptrdiff_t)size_hint : NETBUF_MIN) < 0) {
+    nb->error = -1;
+    return -1;
+  }
 
   while (1) {
-    buf = realloc(buf, total + 1024);
-    bytesleft = 1024;
-    n = recv_buffer(s, buf + total, bytesleft);
+    if (nb->len == nb->cap && size_hint > 0 && (size_t)nb->len >= size_hint) {
+      // Got everything we were told to expect. Check for EOF with a small read
+      // before doubling a buffer that may already be exactly the right size.
+      uint8_t probe[4096];
+      ssize_t n = recv(s, probe, sizeof(probe), 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 || netbuf_reserve(nb, n) < 0) {
+        nb->error = -1;
+        return -1;
+      }
+      if (n == 0) {
+        break;
+      }
+      memcpy(nb->buf + nb->len, probe, n);
+      nb->len += n;
+      continue;
+    }
+
+    if (netbuf_reserve(nb, 1) < 0) {
+      nb->error = -1;
+      return -1;
+    }
+
+    // One read for all the free space we have; the kernel hands back whatever's queued.
+    ssize_t n = recv(s, nb->buf + nb->len, nb->cap - nb->len, 0);
     if (n < 0) {
-      free(buf);
-      return (NetBuffer){.buf = NULL, .len = 0, .error = n};
+      if (errno == EINTR) {
+        continue;
+      }
+      nb->error = -1;
+      return -1;
     } else if (n == 0) {
       // Peer has closed the connection
       break;
     }
+    nb->len += n;
+  }
+
+  return 0;
+}
+
+NetBuffer recv_all(int s) {
+  NetBuffer nb = {.error = 0, .buf = NULL, .len = 0, .cap = 0};
+
+  if (recv_all_into(s, &nb, 0) < 0) {
+    free(nb.buf);
+    return (NetBuffer){.buf = NULL, .len = 0, .cap = 0, .error = -1};
+  }
+
+  return nb;
+}
+
+/**
+ * Copies through userspace with one reusable buffer. Only used when splice(2)
+ * refuses the pair of fds.
+ */
+static ssize_t copy_to_file(int s, int fd, off_t* offset, uint64_t len) {
+  uint8_t* buf = aligned_alloc(4096, STREAM_CHUNK);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  uint64_t total = 0;
+  while (total < len) {
+    size_t want = len - total < STREAM_CHUNK ? len - total : STREAM_CHUNK;
+    ssize_t n = recv(s, buf, want, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      free(buf);
+      return -1;
+    } else if (n == 0) {
+      break;
+    }
+
+    ssize_t written = 0;
+    while (written < n) {
+      ssize_t w = offset != NULL ? pwrite(fd, buf + written, n - written, *offset) : write(fd, buf + written, n - written);
+      if (w < 0) {
+        free(buf);
+        return -1;
+      }
+      written += w;
+      if (offset != NULL) {
+        *offset += w;
+      }
+    }
     total += n;
   }
 
-  return (NetBuffer){.buf = buf, .len = total, .error = 0};
+  free(buf);
+  return total;
+}
+
+ssize_t recv_to_file(int s, int fd, off_t* offset, uint64_t len) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) != 0) {
+    return copy_to_file(s, fd, offset, len);
+  }
+  // Bigger pipe, fewer round trips. Fine if it doesn't take.
+  fcntl(pipefd[1], F_SETPIPE_SZ, STREAM_CHUNK);
+
+  uint64_t total = 0;
+  ssize_t result = 0;
+
+  while (total < len) {
+    size_t want = len - total < STREAM_CHUNK ? len - total : STREAM_CHUNK;
+    ssize_t in = splice(s, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL && total == 0) {
+        // This fd pair can't splice (e.g. fd opened O_APPEND). Nothing is lost yet.
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return copy_to_file(s, fd, offset, len);
+      }
+      result = -1;
+      break;
+    } else if (in == 0) {
+      break;
+    }
+
+    while (in > 0) {
+      // splice advances *offset for us.
+      ssize_t out = splice(pipefd[0], NULL, fd, offset, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out <= 0) {
+        if (out < 0 && errno == EINTR) {
+          continue;
+        }
+        result = -1;
+        break;
+      }
+      in -= out;
+      total += out;
+    }
+    if (result < 0) {
+      break;
+    }
+  }
+
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return result < 0 ? -1 : (ssize_t)total;
 }
 
 ssize_t send_all(int s, uint8_t* buf, ssize_t len) {
@@ -53,7 +229,8 @@ ssize_t send_all(int s, uint8_t* buf, ssize_t len) {
   ssize_t n;
 
   while (total < len) {
-    n = send(s, buf + total, bytesleft, 0);
+    // A peer that hung up should be an error return, not a SIGPIPE that kills us.
+    n = send(s, buf + total, bytesleft, MSG_NOSIGNAL);
     if (n == -1) {
       // Return the error code
       return n;
@@ -68,6 +245,35 @@ ssize_t send_all(int s, uint8_t* buf, ssize_t len) {
   return total;
 }
 
+ssize_t send_iov(int s, struct iovec* iov, int iovcnt, int flags) {
+  ssize_t total = 0;
+
+  while (iovcnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)iovcnt};
+    ssize_t n = sendmsg(s, &msg, flags | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += n;
+
+    // Drop what went out and trim the entry we stopped partway through.
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+
+  return total;
+}
+
 int lookup_and_connect(const char* host, const char* service) {
   struct addrinfo hints;
   struct addrinfo *rp, *result;
@@ -127,29 +333,117 @@ string readline() {
   return out;
 }
 
-int32_t list_files(string** out) {
-  DIR* dir = opendir("SharedFiles");
+/**
+ * What getdents64(2) fills its buffer with. Older glibc doesn't declare it.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-  if (dir == NULL) {
+int32_t list_files(FileList* out) {
+  *out = (FileList){0};
+
+  int dir = open("SharedFiles", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) {
     fprintf(stderr, "Unable to open directory \"SharedFiles\". Exiting.\n");
     return -1;
   }
 
-  struct dirent* entry;
+  char* batch = malloc(DIRENT_BATCH);
+  size_t arena_cap = 0;
   uint32_t count = 0;
+  int failed = batch == NULL;
+  long n = 0;
 
-  while ((entry = readdir(dir))) {
-    // Ignore directories
-    if (entry->d_type == DT_REG) {
-      count++;
-      *out = realloc(*out, count * sizeof(string));
+  while (!failed && (n = syscall(SYS_getdents64, dir, batch, DIRENT_BATCH)) > 0) {
+    for (long pos = 0; pos < n;) {
+      struct linux_dirent64* entry = (struct linux_dirent64*)(batch + pos);
+      pos += entry->d_reclen;
+
+      // Some filesystems don't fill in d_type, so ask.
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dir, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+          type = DT_REG;
+        }
+      }
 
-      string filename = (string){.buf = strdup(entry->d_name), .len = strlen(entry->d_name) + 1};
-      filename.buf[filename.len - 1] = '\0';
-      (*out)[count - 1] = filename;
+      // Ignore directories
+      if (type != DT_REG) {
+        continue;
+      }
+
+      size_t len = strlen(entry->d_name) + 1;
+      if (out->arena_len + len > arena_cap) {
+        size_t cap = arena_cap == 0 ? DIRENT_BATCH : arena_cap * 2;
+        char* arena = realloc(out->arena, cap);
+        if (arena == NULL) {
+          failed = 1;
+          break;
+        }
+        out->arena = arena;
+        arena_cap = cap;
+      }
+
+      memcpy(out->arena + out->arena_len, entry->d_name, len);
+      out->arena_len += len;
+      count++;
     }
   }
 
-  closedir(dir);
-  return count;
-}
\ No newline at end of file
+  free(batch);
+  close(dir);
+
+  // The arena has stopped moving, so now the names can point into it.
+  if (!failed && n == 0) {
+    out->names = malloc((count > 0 ? count : 1) * sizeof(string));
+    failed = out->names == NULL;
+  }
+  if (failed || n < 0) {
+    fprintf(stderr, "Unable to read directory \"SharedFiles\".\n");
+    free_file_list(out);
+    return -1;
+  }
+
+  char* name = out->arena;
+  for (uint32_t i = 0; i < count; i++) {
+    size_t len = strlen(name) + 1;
+    out->names[i] = (string){.buf = name, .len = (ptrdiff_t)len};
+    name += len;
+  }
+  out->count = count;
+  return (int32_t)count;
+}
+
+static int compare_names(const void* a, const void* b) { return strcmp(((const string*)a)->buf, ((const string*)b)->buf); }
+
+int sort_file_list(FileList* list) {
+  char* arena = malloc(list->arena_len > 0 ? list->arena_len : 1);
+  if (arena == NULL) {
+    return -1;
+  }
+
+  qsort(list->names, list->count, sizeof(string), compare_names);
+
+  char* name = arena;
+  for (uint32_t i = 0; i < list->count; i++) {
+    memcpy(name, list->names[i].buf, list->names[i].len);
+    list->names[i].buf = name;
+    name += list->names[i].len;
+  }
+
+  free(list->arena);
+  list->arena = arena;
+  return 0;
+}
+
+void free_file_list(FileList* list) {
+  free(list->arena);
+  free(list->names);
+  *list = (FileList){0};
+}
@@ -9,9 +9,15 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stddef.h>
 
+// IOV_MAX is only declared for _XOPEN_SOURCE; Linux's name for the same limit always is.
+#ifndef IOV_MAX
+#define IOV_MAX UIO_MAXIOV
+#endif
+
 /**
  * INVARIANT: len will always include the null terminator. (len = strlen(buf) + 1)
  * 
@@ -43,6 +49,7 @@ typedef struct {
   int8_t error;
   uint8_t* buf;
   ptrdiff_t len;
+  ptrdiff_t cap;  // Bytes allocated at buf. Always >= len.
 } NetBuffer;
 
 /**
@@ -51,6 +58,37 @@ typedef struct {
  */
 NetBuffer recv_all(int s);
 
+/**
+ * Same as recv_all, but reads into an existing NetBuffer, reusing its allocation.
+ *
+ * The buffer grows geometrically, and every read asks for all the free space at once,
+ * so a transfer costs O(log n) reallocations and about one syscall per socket buffer's
+ * worth of data. Keep the same NetBuffer around between calls and steady-state
+ * receives don't allocate at all.
+ *
+ * @param nb Buffer to fill. Zero-initialise it before first use; free nb->buf when done.
+ *           Previous contents are discarded.
+ * @param size_hint Expected total size (e.g. from a length header), or 0 if unknown.
+ *                  With a correct hint the buffer is sized once and never grows.
+ * @return 0 on success, or -1 on error (also stored in nb->error).
+ */
+int recv_all_into(int s, NetBuffer* nb, size_t size_hint);
+
+/**
+ * Streams exactly `len` bytes from socket `s` into file `fd`.
+ *
+ * Uses splice(2) through a pipe so the data never lands in our address space, and
+ * falls back to a single fixed-size bounce buffer when splice isn't possible. Either
+ * way, memory use doesn't grow with `len`.
+ *
+ * @param offset Where in the file to write, advanced past what was written (like
+ *               pwrite(2), the file position is untouched). NULL writes at, and
+ *               advances, the file's current position.
+ * @return Number of bytes written, which is short of `len` if the peer hung up early,
+ * or -1 on error.
+ */
+ssize_t recv_to_file(int s, int fd, off_t* offset, uint64_t len);
+
 /**
  * Sends all the data in the buffer through the specified socket.
  *
@@ -64,6 +102,17 @@ NetBuffer recv_all(int s);
  */
 ssize_t send_all(int s, uint8_t* buf, ssize_t len);
 
+/**
+ * Sends everything `iov` describes with sendmsg(2), carrying on after short sends.
+ * Nothing is copied; the kernel reads straight from the caller's buffers.
+ *
+ * @param iov At most IOV_MAX entries. Used up along the way: bases and lengths are
+ *            advanced past whatever has been sent.
+ * @param flags Extra send flags, e.g. MSG_MORE when another call will follow at once.
+ * @return Total bytes sent, or -1 on error.
+ */
+ssize_t send_iov(int s, struct iovec* iov, int iovcnt, int flags);
+
 /**
  * Lookup a host IP address and connect to it using service. Arguments match the
  * first two arguments to getaddrinfo(3).
@@ -81,9 +130,35 @@ string readline();
 
 
 /**
- * Read all files in the SharedFiles directory and return them as an array of
- * strings.
- * Reallocation is used to grow the array as needed.
+ * Every regular file in a directory, with all the names stored back to back in one
+ * allocation (`arena`, each name null-terminated) and `names[i].buf` pointing into it.
+ * That's the PUBLISH wire layout already, so the arena can be sent as is.
+ */
+typedef struct {
+  char* arena;
+  size_t arena_len;
+  string* names;
+  uint32_t count;
+} FileList;
+
+/**
+ * Lists the regular files in the SharedFiles directory, in directory order.
+ *
+ * Entries are read with getdents64(2) a megabyte at a time. The listing allocates a
+ * read buffer, the names array, and an arena that starts at a megabyte of names and
+ * doubles as needed: O(log n) allocations in all, never one per file.
+ *
+ * @param out Filled in on success; release it with free_file_list.
+ * @return Number of files, or -1 if the directory couldn't be read.
+ */
+int32_t list_files(FileList* out);
+
+/**
+ * Sorts `list` by name with strcmp, arena included, so the arena stays in the same
+ * order as `names`.
+ * @return 0 on success, -1 if out of memory (`list` is left as it was).
  */
-int32_t list_files(string** out);
+int sort_file_list(FileList* list);
+
+void free_file_list(FileList* list);
 
@@ -0,0 +1,166 @@
+#include "watch.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// Room for a good few events per read(2); each one is a header plus its name.
+#define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+// Changes to a file's contents or whether it's there at all. IN_CREATE is left out
+// on purpose: a new file is reported when the writer closes it, not half-written.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+  string* names;
+  uint32_t count;
+  uint32_t cap;
+  int overflowed;
+} Batch;
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int compare_names(const void* a, const void* b) { return strcmp(((const string*)a)->buf, ((const string*)b)->buf); }
+
+static void batch_add(Batch* batch, const char* name) {
+  if (batch->count == batch->cap) {
+    uint32_t cap = batch->cap == 0 ? 16 : batch->cap * 2;
+    string* names = realloc(batch->names, cap * sizeof(string));
+    if (names == NULL) {
+      // Can't remember it, so make sure the callback rescans.
+      batch->overflowed = 1;
+      return;
+    }
+    batch->names = names;
+    batch->cap = cap;
+  }
+
+  char* copy = strdup(name);
+  if (copy == NULL) {
+    batch->overflowed = 1;
+    return;
+  }
+  batch->names[batch->count++] = (string){.buf = copy, .len = (ptrdiff_t)strlen(copy) + 1};
+}
+
+/**
+ * Sorts the batch and drops repeats, so each name is looked at once however many
+ * events it got.
+ */
+static void batch_dedupe(Batch* batch) {
+  if (batch->count == 0) {
+    return;
+  }
+
+  qsort(batch->names, batch->count, sizeof(string), compare_names);
+
+  uint32_t kept = 1;
+  for (uint32_t i = 1; i < batch->count; i++) {
+    if (strcmp(batch->names[i].buf, batch->names[kept - 1].buf) == 0) {
+      free(batch->names[i].buf);
+    } else {
+      batch->names[kept++] = batch->names[i];
+    }
+  }
+  batch->count = kept;
+}
+
+static void batch_clear(Batch* batch) {
+  for (uint32_t i = 0; i < batch->count; i++) {
+    free(batch->names[i].buf);
+  }
+  batch->count = 0;
+  batch->overflowed = 0;
+}
+
+int watch_shared_files(WatchCallback on_change, void* arg) {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify_init1");
+    return -1;
+  }
+
+  if (inotify_add_watch(fd, "SharedFiles", WATCH_MASK | IN_ONLYDIR) < 0) {
+    perror("inotify_add_watch");
+    close(fd);
+    return -1;
+  }
+
+  // inotify_event has a flexible name member, so read into something aligned for it.
+  char buf[EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+  Batch batch = {0};
+  int64_t deadline = -1;  // When the current burst gets reported; -1 if there isn't one.
+
+  while (1) {
+    int timeout = -1;
+    if (deadline >= 0) {
+      int64_t left = deadline - now_ms();
+      timeout = left > 0 ? (int)left : 0;
+    }
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    if (ready > 0) {
+      ssize_t n;
+      while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+          struct inotify_event* event = (struct inotify_event*)p;
+          p += sizeof(struct inotify_event) + event->len;
+
+          if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            fprintf(stderr, "SharedFiles went away. No longer watching it.\n");
+            batch_clear(&batch);
+            free(batch.names);
+            close(fd);
+            return -1;
+          }
+          if (event->mask & IN_Q_OVERFLOW) {
+            batch.overflowed = 1;
+          } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+            batch_add(&batch, event->name);
+          }
+        }
+      }
+      if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        perror("read");
+        break;
+      }
+
+      if (deadline < 0 && (batch.count > 0 || batch.overflowed)) {
+        deadline = now_ms() + WATCH_COALESCE_MS;
+      }
+    }
+
+    if (deadline >= 0 && now_ms() >= deadline) {
+      if (batch.overflowed) {
+        batch_clear(&batch);
+        on_change(NULL, 0, arg);
+      } else {
+        batch_dedupe(&batch);
+        on_change(batch.names, batch.count, arg);
+      }
+      batch_clear(&batch);
+      deadline = -1;
+    }
+  }
+
+  batch_clear(&batch);
+  free(batch.names);
+  close(fd);
+  return -1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "utilities.h"
+
+// After the first event of a burst, keep collecting for this long before reporting.
+// Copying a tree in or `rm *` then goes out as one batch instead of one per file.
+#define WATCH_COALESCE_MS 20
+
+/**
+ * Called with the names in SharedFiles that changed during one coalescing window,
+ * sorted and without duplicates. A name may have been created, rewritten, renamed in
+ * or out, or deleted; the callback looks at the directory to see which. The names
+ * belong to the watcher and are freed when the callback returns.
+ *
+ * `count` is 0 if the kernel dropped events, in which case anything may have changed.
+ */
+typedef void (*WatchCallback)(string* names, uint32_t count, void* arg);
+
+/**
+ * Watches SharedFiles with inotify(7) and calls `on_change` once per burst of changes.
+ *
+ * Only files count: a file is reported when it's closed after writing, renamed, or
+ * deleted. Subdirectories are ignored.
+ *
+ * @return -1 if the directory couldn't be watched or went away. Does not return
+ *         otherwise.
+ */
+int watch_shared_files(WatchCallback on_change, void* arg);
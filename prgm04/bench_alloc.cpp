@@ -0,0 +1,191 @@
+// Counts heap allocations per request on the registry's request path: a real ConnPool
+// and handle_packet on one thread, a client doing one request at a time on another.
+//
+//   ./bench_alloc [port] [requests] [-u]
+//
+// -u runs the io_uring engine instead of epoll.
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+static std::atomic<uint64_t> allocations{0};
+
+// GCC sees these frees inlined into std::allocator and takes them for mismatched
+// new/free pairs, which they aren't: every new here is a malloc.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size != 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+#include "handler.h"
+
+static int connect_local(const char* port) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result;
+  if (getaddrinfo("127.0.0.1", port, &hints, &result) != 0) {
+    return -1;
+  }
+  int s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (connect(s, result->ai_addr, result->ai_addrlen) != 0) {
+    close(s);
+    s = -1;
+  }
+  freeaddrinfo(result);
+  return s;
+}
+
+static void recv_exact(int s, uint8_t* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = recv(s, buf + got, len - got, 0);
+    if (n <= 0) {
+      fprintf(stderr, "Registry hung up.\n");
+      exit(1);
+    }
+    got += n;
+  }
+}
+
+/**
+ * Writes a v1 frame header plus `body` into `out`.
+ * @return Total length.
+ */
+static size_t build_frame(uint8_t* out, uint8_t action, uint32_t id, const uint8_t* body, uint32_t body_len) {
+  out[0] = PROTO_V1;
+  out[1] = action;
+  out[2] = out[3] = 0;
+  id = htonl(id);
+  uint32_t len = htonl(body_len);
+  memcpy(out + 4, &id, sizeof(id));
+  memcpy(out + 8, &len, sizeof(len));
+  memcpy(out + FRAME_HEADER_LEN, body, body_len);
+  return FRAME_HEADER_LEN + body_len;
+}
+
+/**
+ * Sends the same request `count` times, waiting for each reply.
+ * @return Nanoseconds per request.
+ */
+static double run(int s, const uint8_t* request, size_t request_len, int count) {
+  uint8_t reply[64 * 1024];
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    if (send(s, request, request_len, 0) != (ssize_t)request_len) {
+      exit(1);
+    }
+    recv_exact(s, reply, FRAME_HEADER_LEN);
+    uint32_t len;
+    memcpy(&len, reply + 8, sizeof(len));
+    recv_exact(s, reply + FRAME_HEADER_LEN, ntohl(len));
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / count;
+}
+
+static void measure(int s, const char* label, uint8_t action, const uint8_t* body, uint32_t body_len, int count) {
+  uint8_t request[512];
+  size_t len = build_frame(request, action, 1, body, body_len);
+
+  // Warm up, so buffers and tables have grown to size.
+  run(s, request, len, 1000);
+
+  uint64_t before = allocations.load();
+  double ns = run(s, request, len, count);
+  uint64_t after = allocations.load();
+
+  fprintf(stderr, "%-28s %8.2f allocations/request %8.0f ns/request\n", label, (double)(after - before) / count, ns);
+}
+
+int main(int argc, char** argv) {
+  const char* port = argc > 1 ? argv[1] : "6099";
+  int count = argc > 2 ? atoi(argv[2]) : 100000;
+  bool uring = argc > 3 && strcmp(argv[3], "-u") == 0;
+
+  // The handlers log every request; keep that off the terminal.
+  if (freopen("/dev/null", "w", stdout) == nullptr) {
+    return 1;
+  }
+
+  Registry registry;
+  if (uring && !UringPool::available()) {
+    fprintf(stderr, "io_uring isn't available here.\n");
+    return 1;
+  }
+  std::thread(uring ? serve<UringPool> : serve<ConnPool>, port, std::ref(registry), false, false).detach();
+  usleep(200 * 1000);
+
+  int s = connect_local(port);
+  if (s < 0) {
+    fprintf(stderr, "Can't connect to port %s.\n", port);
+    return 1;
+  }
+
+  // JOIN as peer 7, then PUBLISH a short name and one too long for std::string's
+  // inline buffer.
+  uint8_t frame[512];
+  uint8_t join[] = {0, 0, 0, 7, 0x1b, 0x58};
+  send(s, frame, build_frame(frame, JOIN, 1, join, sizeof(join)), 0);
+
+  const char short_name[] = "song.mp3";
+  const char long_name[] = "a-rather-long-file-name-for-the-benchmark.tar.gz";
+  uint8_t publish[256] = {0, 0, 0, 2};
+  size_t publish_len = 4;
+  memcpy(publish + publish_len, short_name, sizeof(short_name));
+  publish_len += sizeof(short_name);
+  memcpy(publish + publish_len, long_name, sizeof(long_name));
+  publish_len += sizeof(long_name);
+  send(s, frame, build_frame(frame, PUBLISH, 2, publish, (uint32_t)publish_len), 0);
+  usleep(100 * 1000);
+
+  measure(s, "SEARCH (short name)", SEARCH, (const uint8_t*)short_name, sizeof(short_name), count);
+  measure(s, "SEARCH (long name)", SEARCH, (const uint8_t*)long_name, sizeof(long_name), count);
+  measure(s, "SEARCH (not indexed)", SEARCH, (const uint8_t*)"nope", 5, count);
+
+  uint8_t multi[128] = {4, LEAST_LOADED};
+  memcpy(multi + 2, short_name, sizeof(short_name));
+  measure(s, "SEARCH_MULTI k=4", SEARCH_MULTI, multi, 2 + sizeof(short_name), count);
+
+  // The same bytes under a second, long name, published with their digest, so
+  // SEARCH_DIGEST has holders to copy out.
+  const char copy_name[] = "another-rather-long-name-for-the-very-same-bytes.bin";
+  uint8_t with_digests[256] = {0, 0, 0, 2};
+  size_t with_digests_len = 4;
+  memcpy(with_digests + with_digests_len, long_name, sizeof(long_name));
+  with_digests_len += sizeof(long_name);
+  memcpy(with_digests + with_digests_len, copy_name, sizeof(copy_name));
+  with_digests_len += sizeof(copy_name);
+  memset(with_digests + with_digests_len, 0x42, 2 * DIGEST_LEN);
+  with_digests_len += 2 * DIGEST_LEN;
+  size_t frame_len = build_frame(frame, PUBLISH_ADD, 3, with_digests, (uint32_t)with_digests_len);
+  frame[3] = PUBLISH_DIGESTS;
+  send(s, frame, frame_len, 0);
+  usleep(100 * 1000);
+
+  memcpy(multi + 2, long_name, sizeof(long_name));
+  measure(s, "SEARCH_DIGEST k=4", SEARCH_DIGEST, multi, 2 + sizeof(long_name), count);
+
+  close(s);
+  return 0;
+}
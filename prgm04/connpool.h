@@ -1,8 +1,11 @@
 #pragma once
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,86 +16,469 @@
 #include <queue>
 #include <optional>
 #include <algorithm>
-#include <set>
+#include <unordered_map>
 
 #include "netdb.h"
+#include "packet.h"
 #include "peer.h"
 
-#define MAX_PENDING 5
+#define MAX_PENDING SOMAXCONN
+
+// Initial number of epoll events fetched per wakeup. Grows if a wakeup fills it.
+#define MAX_EVENTS 256
+
+// Smallest free space we'll hand to recv(). Receive buffers grow past this as needed.
+#define READ_CHUNK 16384
+
+// How often to try accept() again after it ran out of descriptors. The listen socket
+// is edge-triggered, so connections already queued by then would wait forever otherwise.
+#define ACCEPT_RETRY_MS 100
+
+// Replies queued for a peer that isn't reading them. Past this we stop handling its
+// requests until it catches up, so it's the peer that waits, not everyone else.
+#define MAX_OUTPUT_QUEUE (1024 * 1024)
 
 /**
  * Create, bind and passive open a socket on a local interface for the provided service.
  * Argument matches the second argument to getaddrinfo(3).
  *
+ * If `reuseport` is set, SO_REUSEPORT is enabled before binding so several sockets
+ * (one per worker thread) can share the port and the kernel load-balances new connections.
+ *
  * Returns a passively opened socket or -1 on error. Caller is responsible for calling
  * accept and closing the socket.
  */
-int bind_and_listen(const char* service);
+int bind_and_listen(const char* service, bool reuseport = false);
+
+/**
+ * Turns off Nagle's algorithm on an accepted connection. Replies are small and go out
+ * as soon as they're ready; they shouldn't wait for the client's delayed ACK.
+ */
+void set_nodelay(int s);
+
+/**
+ * Per-connection buffers. Bytes in [head, tail) of `in` have been received but not yet
+ * handed out as packets; a partial message just sits there until the rest arrives.
+ * Bytes in [out_head, out.size()) of `out` are replies the kernel had no room for yet.
+ */
+struct Conn {
+  std::vector<uint8_t> in = {};
+  size_t head = 0;
+  size_t tail = 0;
+
+  std::vector<uint8_t> out = {};
+  size_t out_head = 0;
+
+  // Registered for EPOLLOUT, because `out` isn't empty.
+  bool writing = false;
+
+  size_t queued() const { return out.size() - out_head; }
+
+  /**
+   * Makes sure at least `want` bytes of `in` past `tail` are free, sliding leftovers to
+   * the front before growing.
+   */
+  void make_room(size_t want) {
+    if (head > 0 && in.size() - tail < want) {
+      memmove(in.data(), in.data() + head, tail - head);
+      tail -= head;
+      head = 0;
+    }
+    if (in.size() - tail < want) {
+      in.resize(std::max(in.size() * 2, tail + want));
+    }
+  }
+
+  /**
+   * Pops the next complete frame off `in` into `request`. A malformed one marks the
+   * connection broken.
+   * @return false if there isn't a whole one buffered.
+   */
+  bool take_packet(Packet& request) {
+    size_t frame_len = 0;
+    switch (frame_length(in.data() + head, tail - head, frame_len)) {
+      case FrameStatus::Partial:
+        if (head == tail) {
+          head = tail = 0;
+        }
+        return false;
+      case FrameStatus::Invalid:
+        broken = true;
+        return false;
+      case FrameStatus::Complete:
+        break;
+    }
+
+    request.assign(in.data() + head, frame_len);
+    head += frame_len;
+    return true;
+  }
+
+  // Peer sent FIN, or the stream is unusable (read error, bad frame).
+  bool eof = false;
+  bool broken = false;
+
+  // Not drained to EAGAIN yet, so epoll won't tell us about it again.
+  bool pending = false;
+};
 
 class ConnPool {
  protected:
-  std::set<int> conn_set = {};
-  fd_set all_sockets;
+  std::unordered_map<int, Conn> conns = {};
+  std::vector<int> pending = {};
+  std::vector<int> ready = {};
+  std::vector<struct epoll_event> events;
+
+  // The request being handled and the reply being built. Reused for every message so
+  // that, once they've grown to fit, handling a request allocates nothing.
+  Packet request;
+  Packet response;
+  int epoll_fd;
   int listen_socket;
 
+  // accept() ran out of descriptors or memory last time, with connections still queued.
+  bool accept_stalled = false;
+
+  void watch(int s, uint32_t flags) {
+    struct epoll_event ev = {};
+    ev.events = flags;
+    ev.data.fd = s;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0) {
+      std::cerr << "Error in epoll_ctl(EPOLL_CTL_ADD, " << s << "): " << strerror(errno) << std::endl;
+      abort();
+    }
+  }
+
+  void rewatch(int s, uint32_t flags) {
+    struct epoll_event ev = {};
+    ev.events = flags;
+    ev.data.fd = s;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0) {
+      std::cerr << "Error in epoll_ctl(EPOLL_CTL_MOD, " << s << "): " << strerror(errno) << std::endl;
+      abort();
+    }
+  }
+
+  /**
+   * Writes as much of `conn`'s output queue as the kernel will take right now, and
+   * asks epoll to say when there's room for more if anything is left.
+   */
+  void flush(int s, Conn& conn) {
+    while (conn.queued() > 0) {
+      ssize_t n = ::send(s, conn.out.data() + conn.out_head, conn.queued(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          // Nobody to reply to any more; drop the replies and the connection.
+          conn.broken = true;
+          conn.out.clear();
+          conn.out_head = 0;
+        }
+        break;
+      }
+      conn.out_head += n;
+    }
+
+    if (conn.queued() == 0) {
+      conn.out.clear();
+      conn.out_head = 0;
+    } else if (conn.out_head >= conn.out.size() / 2) {
+      conn.out.erase(conn.out.begin(), conn.out.begin() + (ptrdiff_t)conn.out_head);
+      conn.out_head = 0;
+    }
+
+    bool writing = conn.queued() > 0;
+    if (writing != conn.writing) {
+      rewatch(s, EPOLLIN | EPOLLRDHUP | EPOLLET | (writing ? (uint32_t)EPOLLOUT : 0u));
+      conn.writing = writing;
+    }
+  }
+
+  /**
+   * The listen socket is edge-triggered, so we have to drain the whole accept queue
+   * before going back to sleep or we'll never hear about the leftovers. If we can't,
+   * for want of descriptors, await() comes back every ACCEPT_RETRY_MS to try again.
+   */
+  void accept_all() {
+    while (true) {
+      int new_conn = accept4(listen_socket, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+      if (new_conn < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+          if (!accept_stalled) {
+            std::cerr << "Error in accept call: " << strerror(errno) << "; retrying every " << ACCEPT_RETRY_MS
+                      << " ms" << std::endl;
+          }
+          accept_stalled = true;
+          return;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          std::cerr << "Error in accept call: " << strerror(errno) << std::endl;
+        }
+        accept_stalled = false;
+        return;
+      }
+
+      set_nodelay(new_conn);
+      conns.emplace(new_conn, Conn{});
+      watch(new_conn, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    }
+  }
+
  public:
-  ConnPool(const char* service) {
-    FD_ZERO(&all_sockets);
-    listen_socket = bind_and_listen(service);
-    FD_SET(listen_socket, &all_sockets);
-    conn_set.insert(listen_socket);
+  ConnPool(const char* service, bool reuseport = false) : events(MAX_EVENTS) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      std::cerr << "Error in epoll_create1 call: " << strerror(errno) << std::endl;
+      abort();
+    }
+
+    listen_socket = bind_and_listen(service, reuseport);
+    if (listen_socket < 0) {
+      std::cerr << "Unable to listen on port " << service << std::endl;
+      abort();
+    }
+    fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK);
+    watch(listen_socket, EPOLLIN | EPOLLET);
   }
 
   ~ConnPool() {
-    for (int s : conn_set) {
+    for (const auto& [s, conn] : conns) {
       close(s);
     }
+    close(listen_socket);
+    close(epoll_fd);
   }
 
   /**
    * @brief Waits for activity on any of the sockets and returns a list of active sockets.
    *
-   * @return std::vector<int> A vector containing the file descriptors that are ready for I/O.
+   * Only sockets that are actually ready are visited, so a wakeup costs O(ready) no matter
+   * how many peers are connected. Sockets are edge-triggered: call fill() on every socket
+   * returned, then pull packets with next_packet().
+   *
+   * Sockets that only became writable have their queued replies flushed here, and are
+   * returned only if that lets them go on (see next_packet() and closed()).
    *
-   * @note If an error occurs during the `select` call, the function will print an error message
+   * @return The file descriptors that are ready for I/O, valid until the next call.
+   *
+   * @note If an error occurs during the `epoll_wait` call, the function will print an error message
    *       and abort the program.
    */
-  std::vector<int> await() {
-    fd_set call_set = all_sockets;
-    int max_fd = *conn_set.rbegin();
-    int num_s = select(max_fd + 1, &call_set, NULL, NULL, NULL);
+  const std::vector<int>& await() {
+    // Don't sleep if someone still has unread data from last time, nor for long if
+    // there are connections we couldn't accept.
+    int timeout = !pending.empty() ? 0 : accept_stalled ? ACCEPT_RETRY_MS : -1;
 
-    std::vector<int> active_sockets = {};
+    int num_s;
+    do {
+      num_s = epoll_wait(epoll_fd, events.data(), (int)events.size(), timeout);
+    } while (num_s < 0 && errno == EINTR);
 
     if (num_s < 0) {
-      std::cerr << "Error in select call: " << strerror(errno) << std::endl;
-      std::cerr << "select(" << max_fd + 1 << ", &call_set, NULL, NULL, NULL) -> " << errno << std::endl;
+      std::cerr << "Error in epoll_wait call: " << strerror(errno) << std::endl;
+      std::cerr << "epoll_wait(" << epoll_fd << ", events, " << events.size() << ", " << timeout << ") -> " << errno << std::endl;
       abort();
     }
 
-    for (int s : conn_set) {
-      if (!FD_ISSET(s, &call_set)) {
+    ready.assign(pending.begin(), pending.end());
+    pending.clear();
+
+    if (accept_stalled) {
+      accept_all();
+    }
+
+    for (int i = 0; i < num_s; i++) {
+      int s = events[i].data.fd;
+      if (s == listen_socket) {
+        accept_all();
         continue;
       }
-      if (s == listen_socket) {
-        int new_conn = accept(s, NULL, NULL);
-        conn_set.insert(new_conn);
-        FD_SET(new_conn, &all_sockets);
-      } else {
-        active_sockets.push_back(s);
+
+      auto it = conns.find(s);
+      if (it == conns.end()) {
+        continue;
       }
+
+      Conn& conn = it->second;
+      bool was_full = conn.queued() >= MAX_OUTPUT_QUEUE;
+      if (events[i].events & EPOLLOUT) {
+        flush(s, conn);
+      }
+
+      // Readable, or just drained enough to go back to requests it has buffered
+      // (or to finish closing).
+      bool resumed = was_full && (conn.queued() < MAX_OUTPUT_QUEUE || conn.broken);
+      bool readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+      if ((readable || resumed || (conn.eof && conn.queued() == 0)) && !conn.pending) {
+        conn.pending = true;
+        ready.push_back(s);
+      }
+    }
+
+    for (int s : ready) {
+      conns[s].pending = false;
+    }
+
+    // A full batch means there may be more waiting; fetch more next time.
+    if ((size_t)num_s == events.size()) {
+      events.resize(events.size() * 2);
     }
-    return active_sockets;
+
+    return ready;
+  }
+
+  /**
+   * Reads everything the kernel has for `s` into its reassembly buffer.
+   *
+   * Stops early (and makes sure await() comes back to `s`) once a full frame's worth of
+   * unconsumed data is buffered, so one chatty peer can't balloon our memory.
+   *
+   * @return Number of bytes read (possibly 0), or -1 if recv() failed.
+   */
+  ssize_t fill(int s) {
+    Conn& conn = conns[s];
+    ssize_t total = 0;
+
+    while (!conn.eof) {
+      if (conn.tail - conn.head >= FRAME_HEADER_LEN + MAX_FRAME_LEN) {
+        // If its replies are what's holding it up, await() brings it back once they drain.
+        if (conn.queued() < MAX_OUTPUT_QUEUE) {
+          conn.pending = true;
+          pending.push_back(s);
+        }
+        break;
+      }
+
+      conn.make_room(READ_CHUNK);
+
+      ssize_t n = recv(s, conn.in.data() + conn.tail, conn.in.size() - conn.tail, MSG_DONTWAIT);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        conn.broken = true;
+        return -1;
+      }
+      if (n == 0) {
+        conn.eof = true;
+        break;
+      }
+
+      conn.tail += n;
+      total += n;
+    }
+
+    return total;
+  }
+
+  /**
+   * Pops the next complete packet off `s`'s reassembly buffer, if there is one. It's
+   * only valid until the next call.
+   *
+   * A malformed frame marks the connection broken; see closed(). While MAX_OUTPUT_QUEUE
+   * bytes of replies are waiting for `s`, there's never a next packet; await() hands `s`
+   * back once they've drained.
+   */
+  const Packet* next_packet(int s) {
+    Conn& conn = conns[s];
+    if (conn.broken) {
+      return nullptr;
+    }
+
+    // Backpressure: no more replies until it reads the ones it has.
+    if (conn.queued() >= MAX_OUTPUT_QUEUE) {
+      return nullptr;
+    }
+
+    return conn.take_packet(request) ? &request : nullptr;
+  }
+
+  /**
+   * An empty response to `packet`, to fill in and send(). Only one exists at a time:
+   * it's valid until the next call.
+   */
+  Packet& reply_to(const Packet& packet) {
+    response.reply_to(packet);
+    return response;
+  }
+
+  /**
+   * Sends `packet` to `s` without waiting. Whatever the kernel can't take right away is
+   * queued and written as `s` becomes writable, in order.
+   */
+  void send(int s, const Packet& packet) {
+    Conn& conn = conns[s];
+    if (conn.broken) {
+      return;
+    }
+
+    // Nothing queued ahead of it, so it can go straight from the packet.
+    size_t sent = 0;
+    while (conn.queued() == 0 && sent < packet.buf.size()) {
+      ssize_t n = ::send(s, packet.buf.data() + sent, packet.buf.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          conn.broken = true;
+          return;
+        }
+        break;
+      }
+      sent += n;
+    }
+    if (sent == packet.buf.size()) {
+      return;
+    }
+
+    conn.out.insert(conn.out.end(), packet.buf.begin() + (ptrdiff_t)sent, packet.buf.end());
+    if (!conn.writing) {
+      flush(s, conn);
+    }
+  }
+
+  /**
+   * True once `s` has nothing more to give us: the stream is garbage, or the peer hung
+   * up and has been sent every reply. Call after draining next_packet(), so a request
+   * followed by an immediate close still gets handled.
+   */
+  bool closed(int s) {
+    const Conn& conn = conns[s];
+    return conn.broken || (conn.eof && conn.queued() == 0);
   }
 
   void releaseSocket(int s) {
-    FD_CLR(s, &all_sockets);
-    conn_set.erase(s);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+
+    auto it = conns.find(s);
+    if (it != conns.end()) {
+      if (it->second.pending) {
+        pending.erase(std::find(pending.begin(), pending.end(), s));
+      }
+      conns.erase(it);
+    }
     close(s);
   }
 };
 
-int bind_and_listen(const char* service) {
+void set_nodelay(int s) {
+  int one = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int bind_and_listen(const char* service, bool reuseport) {
   struct addrinfo hints;
   struct addrinfo *rp, *result;
   int s;
@@ -116,6 +502,21 @@ int bind_and_listen(const char* service) {
       continue;
     }
 
+    // Lets a restarted registry bind again straight away, while connections from its
+    // previous run are still in TIME_WAIT.
+    int one = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
+      perror("stream-talk-server: setsockopt(SO_REUSEADDR)");
+      close(s);
+      continue;
+    }
+
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+      perror("stream-talk-server: setsockopt(SO_REUSEPORT)");
+      close(s);
+      continue;
+    }
+
     if (!bind(s, rp->ai_addr, rp->ai_addrlen)) {
       break;
     }
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "connpool.h"
+#include "packet.h"
+#include "peer.h"
+#include "registry.h"
+#include "uring.h"
+
+/**
+ * Handles one complete request from the peer on `ready_peer`. Replies go out through
+ * `pool` (a ConnPool or UringPool), which queues them if the peer is slow to read.
+ *
+ * @param read_only Set on a follower, whose index only changes as its leader's does:
+ *                  JOIN and the PUBLISH messages are turned away.
+ */
+template <typename Pool>
+void handle_packet(const Packet& packet, int ready_peer, Pool& pool, Registry& registry, bool read_only) {
+  if (packet.buf.empty()) {
+    printf("Empty packet.\n");
+    return;
+  }
+
+  if (read_only && (packet.buf[0] == JOIN || packet.buf[0] == PUBLISH || packet.buf[0] == PUBLISH_ADD ||
+                    packet.buf[0] == PUBLISH_REMOVE)) {
+    printf("Ignoring a change on a follower; peers should send those to the leader.\n");
+    return;
+  }
+
+  switch (packet.buf[0]) {
+    case JOIN: {
+      Peer peer = packet.handle_join(ready_peer);
+      registry.join(peer);
+      printf("TEST] JOIN %u\n", peer.id);
+      break;
+    }
+    case SEARCH: {
+      thread_local std::string search_term;
+      packet.handle_search(search_term);
+
+      // Returns default-constructed Peer if not found.
+      Peer peer = registry.search(search_term);
+
+      Packet& response = pool.reply_to(packet);
+      response.search_response(peer);
+      pool.send(ready_peer, response);
+
+      char ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &peer.address.sin_addr, ip, INET_ADDRSTRLEN);
+      uint16_t port = ntohs(peer.address.sin_port);
+
+      printf("TEST] SEARCH %s %u %s:%u\n", search_term.c_str(), peer.id, ip, port);
+      break;
+    }
+    case SEARCH_MULTI: {
+      thread_local SearchQuery query;
+      packet.handle_search_multi(query);
+
+      struct sockaddr_in requester = {};
+      socklen_t len = sizeof(requester);
+      getpeername(ready_peer, (struct sockaddr*)&requester, &len);
+
+      thread_local std::vector<Peer> owners;
+      registry.search_owners(query.filename, query.k, query.policy, requester, owners);
+
+      Packet& response = pool.reply_to(packet);
+      response.search_multi_response(owners);
+      pool.send(ready_peer, response);
+
+      printf("TEST] SEARCH_MULTI %s %zu\n", query.filename.c_str(), owners.size());
+      break;
+    }
+    case SEARCH_DIGEST: {
+      thread_local SearchQuery query;
+      packet.handle_search_multi(query);
+
+      struct sockaddr_in requester = {};
+      socklen_t len = sizeof(requester);
+      getpeername(ready_peer, (struct sockaddr*)&requester, &len);
+
+      Digest digest;
+      thread_local std::vector<std::pair<Peer, std::string_view>> holders;
+      registry.search_digest(query.filename, query.k, query.policy, requester, digest, holders);
+
+      Packet& response = pool.reply_to(packet);
+      response.search_digest_response(digest, holders);
+      pool.send(ready_peer, response);
+
+      printf("TEST] SEARCH_DIGEST %s %zu\n", query.filename.c_str(), holders.size());
+      break;
+    }
+    case SEARCH_BATCH: {
+      auto names = packet.handle_search_batch();
+
+      std::vector<Peer> owners;
+      owners.reserve(names.size());
+      for (const auto& name : names) {
+        owners.push_back(registry.search(name));
+      }
+
+      Packet& response = pool.reply_to(packet);
+      response.search_batch_response(owners);
+      pool.send(ready_peer, response);
+
+      printf("TEST] SEARCH_BATCH %zu\n", names.size());
+      break;
+    }
+    case SEARCH_PREFIX: {
+      PrefixQuery query = packet.handle_search_prefix();
+
+      bool more;
+      auto matches = registry.search_prefix(query, more);
+
+      Packet& response = pool.reply_to(packet);
+      response.search_prefix_response(matches, more);
+      pool.send(ready_peer, response);
+
+      printf("TEST] SEARCH_PREFIX %s %zu%s\n", query.pattern.c_str(), matches.size(), more ? "+" : "");
+      break;
+    }
+    case PUBLISH:
+    case PUBLISH_ADD: {
+      // A full PUBLISH and an addition are the same thing to the registry.
+      const char* action = packet.buf[0] == PUBLISH ? "PUBLISH" : "PUBLISH_ADD";
+
+      std::vector<Digest> digests;
+      auto files = packet.handle_publish(digests);
+      if (!registry.publish(ready_peer, files, digests)) {
+        printf("%s from a peer that never joined.\n", action);
+        break;
+      }
+
+      // Build the line first so other workers can't interleave with it.
+      std::string line = std::string("TEST] ") + action + " " + std::to_string(files.size()) + " ";
+      for (const auto& file : files) {
+        line += file + " ";
+      }
+      printf("%s\n", line.c_str());
+
+      break;
+    }
+    case PUBLISH_REMOVE: {
+      auto files = packet.handle_unpublish();
+      if (!registry.unpublish(ready_peer, files)) {
+        printf("PUBLISH_REMOVE from a peer that never joined.\n");
+        break;
+      }
+
+      std::string line = "TEST] PUBLISH_REMOVE " + std::to_string(files.size()) + " ";
+      for (const auto& file : files) {
+        line += file + " ";
+      }
+      printf("%s\n", line.c_str());
+
+      break;
+    }
+    default:
+      printf("Unknown packet.\n");
+      break;
+  }
+}
+
+/**
+ * Runs one registry event loop on its own listen socket until the process dies.
+ * With more than one worker, each one binds with SO_REUSEPORT and the kernel spreads
+ * incoming connections across them; the registry itself is shared.
+ *
+ * `Pool` is the event loop's engine: ConnPool (epoll) or UringPool (io_uring). A worker
+ * that can't get a ring of its own runs on epoll instead.
+ */
+template <typename Pool>
+void serve(const char* port, Registry& registry, bool reuseport, bool read_only) {
+  auto owned = std::make_unique<Pool>(port, reuseport);
+  if constexpr (std::is_same_v<Pool, UringPool>) {
+    if (!owned->set_up()) {
+      fprintf(stderr, "This worker is using epoll instead.\n");
+      owned.reset();
+      serve<ConnPool>(port, registry, reuseport, read_only);
+      return;
+    }
+  }
+  Pool& pool = *owned;
+
+  while (true) {
+    for (const auto& ready_peer : pool.await()) {
+      ssize_t received = pool.fill(ready_peer);
+
+      if (received < 0) {
+        fprintf(stderr, "Error receiving packet: %s\n", strerror(errno));
+      }
+
+      while (auto packet = pool.next_packet(ready_peer)) {
+        handle_packet(*packet, ready_peer, pool, registry, read_only);
+      }
+
+      // Conn closed (or broken), clean up.
+      if (pool.closed(ready_peer)) {
+        registry.leave(ready_peer);
+        pool.releaseSocket(ready_peer);
+      }
+    }
+  }
+}
@@ -1,101 +1,135 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <thread>
+#include <vector>
 
-#include "connpool.h"
-#include "packet.h"
-#include "peer.h"
+#include "handler.h"
+#include "persist.h"
+#include "registry.h"
+#include "replicate.h"
 
 #define MAX_LINE 256
 
-// This is almost certainly too much memory
-#define BUF_SIZE 1024 + MAX_FILES* MAX_FILENAME_LEN
+/**
+ * Background upkeep for a persistent registry: flushes the journal, checkpoints, and
+ * drops ghosts whose peers never came back.
+ */
+void maintain(Store& store, Registry& registry) {
+  for (unsigned tick = 1;; tick++) {
+    sleep(JOURNAL_SYNC_SECS);
+    store.sync();
+    registry.expire_ghosts(time(nullptr) - GHOST_TTL_SECS);
+
+    if (tick % (SNAPSHOT_SECS / JOURNAL_SYNC_SECS) == 0) {
+      store.checkpoint(registry);
+    }
+  }
+}
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: <%s> [port]\n", argv[0]);
+  const char* state_dir = nullptr;
+  const char* replication_port = nullptr;
+  char* leader = nullptr;
+  bool uring = false;
+  std::vector<char*> args;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      state_dir = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      replication_port = argv[++i];
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      leader = argv[++i];
+    } else if (strcmp(argv[i], "-u") == 0) {
+      uring = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  if (args.empty()) {
+    fprintf(stderr, "Usage: <%s> [port] [threads] [-p state_dir] [-r replication_port | -f leader_host:port] [-u]\n", argv[0]);
+    return -1;
+  }
+
+  char* port = args[0];
+
+  int threads = 1;
+  if (args.size() >= 2) {
+    threads = atoi(args[1]);
+    if (threads < 1) {
+      fprintf(stderr, "Invalid thread count: \"%s\". Exiting.\n", args[1]);
+      return -1;
+    }
+  }
+
+  if (leader != nullptr && (state_dir != nullptr || replication_port != nullptr)) {
+    fprintf(stderr, "A follower keeps no state of its own and feeds no one: -f can't go with -p or -r. Exiting.\n");
     return -1;
   }
 
-  char* port = argv[1];
-
-  ConnPool pool(port);
-  std::unordered_map<int, Peer> peers = {};
-  std::unordered_map<std::string, Peer> filemap = {};
-
-  while (true) {
-    for (const auto& ready_peer : pool.await()) {
-      Packet packet;
-      ssize_t received = packet.recv_buf(ready_peer, BUF_SIZE);
-
-      if (received < 0) {
-        fprintf(stderr, "Error receiving packet: %s\n", strerror(errno));
-        continue;
-      }
-
-      // Conn closed, clean up.
-      if (received == 0) {
-        Peer& peer = peers[ready_peer];
-        for (const auto& file : peer.files) {
-          filemap.erase(file);
-        }
-        peers.erase(ready_peer);
-        pool.releaseSocket(ready_peer);
-
-        continue;
-      }
-
-      // If we made it to here, we have at least one byte. (received >= 1)
-      switch (packet.buf[0]) {
-        case JOIN: {
-          Peer peer = packet.handle_join(ready_peer);
-          peers[ready_peer] = peer;
-          printf("TEST] JOIN %u\n", peer.id);
-          break;
-        }
-        case SEARCH: {
-          std::string search_term = packet.handle_search();
-
-          // Returns default-constructed Peer if not found.
-          Peer& peer = filemap[search_term];
-
-          Packet response;
-          response.search_response(peer);
-          response.send_all(ready_peer);
-
-          char ip[INET_ADDRSTRLEN];
-          inet_ntop(AF_INET, &peer.address.sin_addr, ip, INET_ADDRSTRLEN);
-          uint16_t port = ntohs(peer.address.sin_port);
-
-          printf("TEST] SEARCH %s %u %s:%u\n", search_term.c_str(), peer.id, ip, port);
-          break;
-        }
-        case PUBLISH: {
-          auto files = packet.handle_publish();
-          Peer& peer = peers.at(ready_peer);
-          peer.add_files(files);
-
-          printf("TEST] PUBLISH %zu ", files.size());
-          for (const auto& file : files) {
-            filemap[file] = peer;
-            printf("%s ", file.c_str());
-          }
-          printf("\n");
-
-          break;
-        }
-        default:
-          printf("Unknown packet.\n");
-          break;
-      }
+  Registry registry;
+
+  // With a state directory, start from what was saved there and keep it up to date.
+  std::unique_ptr<Store> store;
+  if (state_dir != nullptr) {
+    store = std::make_unique<Store>(state_dir);
+    if (!store->recover(registry)) {
+      fprintf(stderr, "Can't use state directory %s. Exiting.\n", state_dir);
+      return -1;
     }
+    registry.add_sink(store.get());
+    std::thread(maintain, std::ref(*store), std::ref(registry)).detach();
+  }
+
+  // A leader feeds followers from its own changes.
+  Replicator replicator(registry);
+  if (replication_port != nullptr) {
+    if (!replicator.listen(replication_port)) {
+      fprintf(stderr, "Unable to listen for followers on port %s. Exiting.\n", replication_port);
+      return -1;
+    }
+    registry.add_sink(&replicator);
+  }
+
+  // A follower's index is the leader's.
+  bool read_only = leader != nullptr;
+  if (read_only) {
+    char* colon = strrchr(leader, ':');
+    if (colon == nullptr) {
+      fprintf(stderr, "Invalid leader: \"%s\". Expected host:port. Exiting.\n", leader);
+      return -1;
+    }
+    *colon = '\0';
+    std::thread(follow, leader, colon + 1, std::ref(registry)).detach();
+  }
+
+  // io_uring if asked for and the kernel has it; epoll otherwise.
+  if (uring && !UringPool::available()) {
+    fprintf(stderr, "io_uring isn't available here; using epoll.\n");
+    uring = false;
+  }
+  auto run = uring ? serve<UringPool> : serve<ConnPool>;
+
+  if (threads == 1) {
+    run(port, registry, false, read_only);
+    return 0;
+  }
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back(run, port, std::ref(registry), true, read_only);
+  }
+  for (auto& worker : workers) {
+    worker.join();
   }
 }
@@ -6,8 +6,12 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include "peer.h"
@@ -15,60 +19,422 @@
 #define MAX_FILES 10
 #define MAX_FILENAME_LEN 100
 
+/**
+ * Wire format, version 1.
+ *
+ * Every v1 message starts with a fixed 12-byte header, all fields in network byte order:
+ *
+ *   0       1       2               4                               8                              12
+ *   +-------+-------+---------------+-------------------------------+-------------------------------+
+ *   |version|action|     flags     |          request id           |          body length          |
+ *   +-------+-------+---------------+-------------------------------+-------------------------------+
+ *
+ * followed by `body length` bytes of body. The body layouts are the same as the legacy
+ * packets (minus the leading action byte). Responses to a v1 request are framed the same way,
+ * echo the request's action and request id, and come back in request order.
+ *
+ * Legacy (unversioned) packets have no header: the first byte is the action, which is always
+ * below 0x80, so the high bit of the first byte tells the two apart. A legacy packet is
+ * everything buffered on the connection when it's parsed, which is what the old
+ * one-recv()-per-packet behaviour amounted to for clients that wait for each reply.
+ */
+#define PROTO_V1 0x81
+#define FRAME_HEADER_LEN 12
+
+// Anything bigger than this is a broken or hostile client.
+#define MAX_FRAME_LEN (16 * 1024 * 1024)
+
 enum Action {
   JOIN = 0,
   PUBLISH,
   SEARCH,
   FETCH,
+  SEARCH_MULTI,
+  SEARCH_BATCH,
+  SEARCH_PREFIX,
+  FETCH_RANGE,  // Peer to peer only, listed so the numbers stay in sync.
+  SEARCH_DIGEST,
+  PUBLISH_ADD,
+  PUBLISH_REMOVE,
+};
+
+/**
+ * How SEARCH_MULTI picks which owners to return when there are more than asked for.
+ */
+enum SearchPolicy {
+  NEAREST = 0,   // Longest shared IPv4 prefix with the requester.
+  LEAST_LOADED,  // Owners we've handed out the fewest times so far.
+  RANDOM,
 };
 
+// Most owners a single SEARCH_MULTI response will carry.
+#define MAX_OWNERS 64
+
+// Size of one (id, ip, port) record in a search response.
+#define OWNER_RECORD_LEN 10
+
+// Most (name, owner) records a single SEARCH_PREFIX page will carry.
+#define MAX_PAGE 1024
+
+// SEARCH_PREFIX response flag: there are more matches after this page.
+#define PAGE_MORE 0x01
+
+// BLAKE3 content digest. All zeros means "not given".
+#define DIGEST_LEN 32
+using Digest = std::array<uint8_t, DIGEST_LEN>;
+
+// PUBLISH and PUBLISH_ADD frame flag: the names are followed by one digest each.
+#define PUBLISH_DIGESTS 0x0001
+
+/**
+ * SEARCH_PREFIX body: [mode: u8][limit: u16][cursor\0][pattern\0]
+ *
+ * mode 0 matches names starting with `pattern`, mode 1 treats `pattern` as a
+ * shell glob (fnmatch(3) rules). Results come back sorted by name, starting
+ * strictly after `cursor`; pass the last name of one page as the cursor of the next.
+ */
+struct PrefixQuery {
+  bool glob;
+  uint16_t limit;
+  std::string cursor;
+  std::string pattern;
+};
+
+/**
+ * SEARCH_MULTI and SEARCH_DIGEST body: [k: u8][policy: u8][filename\0]
+ */
+struct SearchQuery {
+  uint8_t k;
+  SearchPolicy policy;
+  std::string filename;
+};
+
+/**
+ * Splits complete messages off the front of a connection's receive buffer.
+ */
+enum class FrameStatus {
+  Complete,
+  Partial,
+  Invalid,
+};
+
+/**
+ * Checks whether `data` starts with a complete message.
+ *
+ * @param data Unconsumed bytes received on a connection.
+ * @param len Number of unconsumed bytes.
+ * @param frame_len Set to the total size of the message (header included) when complete.
+ */
+inline FrameStatus frame_length(const uint8_t* data, size_t len, size_t& frame_len) {
+  if (len == 0) {
+    return FrameStatus::Partial;
+  }
+
+  // Legacy: no length, so take everything we have.
+  if (data[0] < 0x80) {
+    frame_len = len;
+    return FrameStatus::Complete;
+  }
+
+  if (data[0] != PROTO_V1) {
+    return FrameStatus::Invalid;
+  }
+  if (len < FRAME_HEADER_LEN) {
+    return FrameStatus::Partial;
+  }
+
+  uint32_t body_len;
+  memcpy(&body_len, data + 8, sizeof(uint32_t));
+  body_len = ntohl(body_len);
+
+  if (body_len > MAX_FRAME_LEN) {
+    return FrameStatus::Invalid;
+  }
+  if (len < FRAME_HEADER_LEN + (size_t)body_len) {
+    return FrameStatus::Partial;
+  }
+
+  frame_len = FRAME_HEADER_LEN + body_len;
+  return FrameStatus::Complete;
+}
+
 class Packet {
  public:
+  // Always [action][body...], whichever way the packet arrived.
   std::vector<std::uint8_t> buf;
 
-  ssize_t send_all(int s) {
-    size_t total = 0;
-    ssize_t bytesleft = buf.size();
-    ssize_t n;
-
-    while (total < buf.size()) {
-      n = send(s, buf.data() + total, bytesleft, 0);
-      if (n == -1) {
-        // Return the error code
-        return n;
-      } else if (n == 0) {
-        // Connection closed
-        break;
+  // 0 for a legacy packet, PROTO_V1 for a framed one.
+  uint8_t version = 0;
+  uint16_t flags = 0;  // Always 0 for a legacy packet.
+  uint32_t request_id = 0;
+
+  Packet() = default;
+
+  /**
+   * Builds a Packet from one complete message as reported by frame_length().
+   */
+  Packet(const uint8_t* data, size_t frame_len) { assign(data, frame_len); }
+
+  /**
+   * Makes this Packet the message in `data`, as the constructor would. The buffer is
+   * reused, so once it has grown to fit the usual request this never allocates.
+   */
+  void assign(const uint8_t* data, size_t frame_len) {
+    if (data[0] < 0x80) {
+      version = 0;
+      flags = 0;
+      request_id = 0;
+      buf.assign(data, data + frame_len);
+      return;
+    }
+
+    version = data[0];
+    memcpy(&flags, data + 2, sizeof(uint16_t));
+    flags = ntohs(flags);
+    memcpy(&request_id, data + 4, sizeof(uint32_t));
+    request_id = ntohl(request_id);
+
+    // Drop the header but keep the action byte in front so the handlers don't care.
+    buf.resize(1 + frame_len - FRAME_HEADER_LEN);
+    buf[0] = data[1];
+    memcpy(buf.data() + 1, data + FRAME_HEADER_LEN, frame_len - FRAME_HEADER_LEN);
+  }
+
+  /**
+   * Empties this Packet into a response that will be framed the same way as `request`,
+   * keeping the buffer (see assign).
+   */
+  void reply_to(const Packet& request) {
+    buf.clear();
+    version = request.version;
+    request_id = request.request_id;
+  }
+
+  /**
+   * Prepends a v1 header to a response body. Does nothing for legacy packets,
+   * which go out exactly as built.
+   */
+  void frame(uint8_t action) {
+    if (version != PROTO_V1) {
+      return;
+    }
+
+    uint8_t header[FRAME_HEADER_LEN] = {};
+    uint32_t id = htonl(request_id);
+    uint32_t len = htonl((uint32_t)buf.size());
+    header[0] = version;
+    header[1] = action;
+    memcpy(header + 4, &id, sizeof(uint32_t));
+    memcpy(header + 8, &len, sizeof(uint32_t));
+
+    buf.insert(buf.begin(), header, header + FRAME_HEADER_LEN);
+  }
+
+  /**
+   * JOIN body: [peer id: u32] optionally followed by [listen port: u16]. Peers that
+   * serve FETCH send the port they listen on, and that's what SEARCH hands out instead
+   * of the port they happened to connect to us from. Peers that don't serve get port 0:
+   * the one they connected from means nothing to anyone else, and it would keep them
+   * from ever reclaiming their ghost (see Registry) from a new connection.
+   */
+  Peer handle_join(int peer_sfd) const {
+    uint32_t id = 0;
+    if (buf.size() >= sizeof(uint8_t) + sizeof(uint32_t)) {
+      memcpy(&id, buf.data() + 1, sizeof(uint32_t));
+      id = ntohl(id);
+    }
+
+    Peer peer(id, peer_sfd);
+
+    if (buf.size() >= sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint16_t)) {
+      // Already network byte order, same as sin_port.
+      memcpy(&peer.address.sin_port, buf.data() + 1 + sizeof(uint32_t), sizeof(uint16_t));
+    } else {
+      peer.address.sin_port = 0;
+    }
+
+    return peer;
+  }
+
+  /**
+   * PUBLISH body: [count: u32][filename\0]... then, if `flags` has PUBLISH_DIGESTS, one
+   * content digest per name in the same order. `digests` is left empty if the flag is
+   * clear or they aren't all there.
+   */
+  std::vector<std::string> handle_publish(std::vector<Digest>& digests) const {
+    size_t end;
+    std::vector<std::string> files = read_names(&end);
+
+    digests.clear();
+    if ((flags & PUBLISH_DIGESTS) && buf.size() - end == files.size() * DIGEST_LEN) {
+      digests.resize(files.size());
+      for (size_t i = 0; i < files.size(); i++) {
+        memcpy(digests[i].data(), buf.data() + end + i * DIGEST_LEN, DIGEST_LEN);
       }
-      total += n;
-      bytesleft -= n;
     }
-    return total;
+    return files;
   }
 
-  ssize_t recv_buf(int s, int max) {
-    buf.resize(max);
-    ssize_t received = recv(s, buf.data(), buf.size(), 0);
+  /**
+   * PUBLISH_REMOVE body is PUBLISH without the digests: [count: u32][filename\0]...
+   * (PUBLISH_ADD is exactly PUBLISH, and goes through handle_publish.)
+   */
+  std::vector<std::string> handle_unpublish() const { return read_names(); }
+
+  /**
+   * SEARCH_BATCH body is laid out like PUBLISH: [count: u32][filename\0]...
+   */
+  std::vector<std::string> handle_search_batch() const { return read_names(); }
+
+  /**
+   * @param term Set to the name searched for. Reusing one string across calls keeps
+   *             its buffer, so long names don't allocate every time.
+   */
+  void handle_search(std::string& term) const {
+    size_t maxlen = std::min((size_t)MAX_FILENAME_LEN, buf.size() - 1);
+    size_t len = strnlen((char*)buf.data() + 1, maxlen);
 
-    if (received < 0) {
-      return received;
+    term.assign((char*)buf.data() + 1, len);
+  }
+
+  /**
+   * @param query Filled in. Reused like handle_search's `term`.
+   */
+  void handle_search_multi(SearchQuery& query) const {
+    query.k = 1;
+    query.policy = NEAREST;
+    query.filename.clear();
+    if (buf.size() < 3) {
+      return;
     }
 
-    buf.resize(received);
-    buf.shrink_to_fit();
+    query.k = std::clamp<uint8_t>(buf[1], 1, MAX_OWNERS);
+    query.policy = buf[2] <= RANDOM ? (SearchPolicy)buf[2] : NEAREST;
 
-    return received;
+    size_t maxlen = std::min((size_t)MAX_FILENAME_LEN, buf.size() - 3);
+    size_t len = strnlen((char*)buf.data() + 3, maxlen);
+    query.filename.assign((char*)buf.data() + 3, len);
   }
 
-  Peer handle_join(int peer_sfd) {
-    uint32_t id;
-    memcpy(&id, buf.data() + 1, sizeof(uint32_t));
-    id = ntohl(id);
+  PrefixQuery handle_search_prefix() const {
+    PrefixQuery query = {false, MAX_PAGE, "", ""};
+    if (buf.size() < 4) {
+      return query;
+    }
+
+    query.glob = buf[1] == 1;
+
+    uint16_t limit;
+    memcpy(&limit, buf.data() + 2, sizeof(uint16_t));
+    query.limit = std::clamp<uint16_t>(ntohs(limit), 1, MAX_PAGE);
+
+    size_t offset = 4;
+    size_t len = strnlen((char*)buf.data() + offset, buf.size() - offset);
+    query.cursor = std::string((char*)buf.data() + offset, len);
 
-    return Peer(id, peer_sfd);
+    offset = std::min(buf.size(), offset + len + 1);
+    len = strnlen((char*)buf.data() + offset, buf.size() - offset);
+    query.pattern = std::string((char*)buf.data() + offset, len);
+
+    return query;
+  }
+
+  void search_response(const Peer& peer) {
+    buf.resize(OWNER_RECORD_LEN);
+    write_owner(buf.data(), peer);
+
+    frame(SEARCH);
+  }
+
+  /**
+   * SEARCH_MULTI response body: [count: u8] followed by `count` 10-byte (id, ip, port) records,
+   * the same layout as a plain SEARCH response. An unknown file gets count = 0.
+   */
+  void search_multi_response(const std::vector<Peer>& owners) {
+    size_t count = std::min(owners.size(), (size_t)MAX_OWNERS);
+    buf.resize(sizeof(uint8_t) + count * OWNER_RECORD_LEN);
+    buf[0] = (uint8_t)count;
+
+    for (size_t i = 0; i < count; i++) {
+      write_owner(buf.data() + sizeof(uint8_t) + i * OWNER_RECORD_LEN, owners[i]);
+    }
+
+    frame(SEARCH_MULTI);
   }
 
-  std::vector<std::string> handle_publish() {
+  /**
+   * SEARCH_DIGEST response body: [digest][count: u8] followed by `count` records of
+   * [id: u32][ip: u32][port: u16][name\0], where the name is what that peer has the
+   * bytes under. The digest is all zeros if the name was published without one.
+   */
+  void search_digest_response(const Digest& digest, const std::vector<std::pair<Peer, std::string_view>>& holders) {
+    size_t count = std::min(holders.size(), (size_t)MAX_OWNERS);
+    buf.assign(digest.begin(), digest.end());
+    buf.push_back((uint8_t)count);
+
+    for (size_t i = 0; i < count; i++) {
+      const auto& [peer, name] = holders[i];
+      size_t offset = buf.size();
+      buf.resize(offset + OWNER_RECORD_LEN + name.size() + 1);
+      write_owner(buf.data() + offset, peer);
+      memcpy(buf.data() + offset + OWNER_RECORD_LEN, name.data(), name.size());
+      buf.back() = '\0';
+    }
+
+    frame(SEARCH_DIGEST);
+  }
+
+  /**
+   * SEARCH_PREFIX response body: [count: u16][flags: u8] followed by `count` records of
+   * [id: u32][ip: u32][port: u16][name\0], sorted by name. PAGE_MORE in flags means the
+   * client should ask again with the last name as its cursor.
+   */
+  void search_prefix_response(const std::vector<std::pair<std::string, Peer>>& matches, bool more) {
+    uint16_t count = htons((uint16_t)matches.size());
+    buf.resize(sizeof(uint16_t) + sizeof(uint8_t));
+    memcpy(buf.data(), &count, sizeof(uint16_t));
+    buf[2] = more ? PAGE_MORE : 0;
+
+    for (const auto& [name, peer] : matches) {
+      size_t offset = buf.size();
+      buf.resize(offset + OWNER_RECORD_LEN + name.size() + 1);
+      write_owner(buf.data() + offset, peer);
+      memcpy(buf.data() + offset + OWNER_RECORD_LEN, name.c_str(), name.size() + 1);
+    }
+
+    frame(SEARCH_PREFIX);
+  }
+
+  /**
+   * SEARCH_BATCH response body: [count: u32] followed by one 10-byte (id, ip, port) record
+   * per requested name, in request order. Names that aren't indexed get an all-zero record.
+   */
+  void search_batch_response(const std::vector<Peer>& owners) {
+    uint32_t count = htonl((uint32_t)owners.size());
+    buf.resize(sizeof(uint32_t) + owners.size() * OWNER_RECORD_LEN);
+    memcpy(buf.data(), &count, sizeof(uint32_t));
+
+    for (size_t i = 0; i < owners.size(); i++) {
+      write_owner(buf.data() + sizeof(uint32_t) + i * OWNER_RECORD_LEN, owners[i]);
+    }
+
+    frame(SEARCH_BATCH);
+  }
+
+ private:
+  /**
+   * Reads a [count: u32][name\0]... list starting right after the action byte.
+   *
+   * @param end If given, set to the offset just past the last name.
+   */
+  std::vector<std::string> read_names(size_t* end = nullptr) const {
+    if (end != nullptr) {
+      *end = buf.size();
+    }
+    if (buf.size() < sizeof(uint8_t) + sizeof(uint32_t)) {
+      return {};
+    }
+
     uint32_t count;
     memcpy(&count, buf.data() + 1, sizeof(uint32_t));
     count = ntohl(count);
@@ -77,7 +443,7 @@ class Packet {
     size_t offset = sizeof(uint8_t) + sizeof(uint32_t);
 
     // Read each null-terminated string
-    for (uint32_t i = 0; i < count; ++i) {
+    for (uint32_t i = 0; i < count && offset < buf.size(); ++i) {
       size_t maxlen = std::min((size_t)MAX_FILENAME_LEN, buf.size() - offset);
       size_t len = strnlen((char*)buf.data() + offset, maxlen);
 
@@ -87,25 +453,19 @@ class Packet {
       offset += len + 1;
     }
 
-
+    if (end != nullptr) {
+      *end = std::min(offset, buf.size());
+    }
     return files;
   }
 
-  std::string handle_search() {
-    size_t maxlen = std::min((size_t)MAX_FILENAME_LEN, buf.size() - 1);
-    size_t len = strnlen((char*)buf.data() + 1, maxlen);
-
-    return std::string((char*)buf.data() + 1, len);
-  }
-
-  void search_response(const Peer& peer) {
-    buf.resize(sizeof(uint32_t) * 2 + sizeof(uint16_t));
+  static void write_owner(uint8_t* out, const Peer& peer) {
     uint32_t id = htonl(peer.id);
     uint32_t ip = peer.address.sin_addr.s_addr;
     uint16_t port = peer.address.sin_port;
 
-    memcpy(buf.data(), &id, sizeof(uint32_t));
-    memcpy(buf.data() + sizeof(uint32_t), &ip, sizeof(uint32_t));
-    memcpy(buf.data() + sizeof(uint32_t) * 2, &port, sizeof(uint16_t));
+    memcpy(out, &id, sizeof(uint32_t));
+    memcpy(out + sizeof(uint32_t), &ip, sizeof(uint32_t));
+    memcpy(out + sizeof(uint32_t) * 2, &port, sizeof(uint16_t));
   }
 };
\ No newline at end of file
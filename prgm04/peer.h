@@ -9,13 +9,14 @@
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 class Peer {
  public:
   uint32_t id;
   int socket_fd;
-  std::vector<std::string> files = {};
+  std::unordered_set<std::string> files = {};
   struct sockaddr_in address;
 
   Peer() : id(0), socket_fd(0), address{} {}
@@ -37,7 +38,12 @@ class Peer {
     }
   }
 
-  void add_file(const std::string& file) { files.push_back(file); }
+  void add_file(const std::string& file) { files.insert(file); }
+
+  /**
+   * @return true if the peer had `file`.
+   */
+  bool remove_file(const std::string& file) { return files.erase(file) > 0; }
 
   bool operator==(const Peer& other) const { return socket_fd == other.socket_fd; }
 };
\ No newline at end of file
@@ -0,0 +1,636 @@
+#pragma once
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "packet.h"
+#include "peer.h"
+#include "registry.h"
+
+// How often a persistent registry flushes its journal to disk.
+#define JOURNAL_SYNC_SECS 1
+
+// How often it writes a fresh snapshot (if anything changed) and starts a new journal.
+#define SNAPSHOT_SECS 60
+
+// How long a peer restored from disk has to JOIN again before its files are dropped.
+#define GHOST_TTL_SECS 300
+
+/**
+ * Change records, as journaled. Integers in network byte order:
+ *
+ *   [length: u32][session: u64][type: u8][body]
+ *
+ * `length` counts everything after itself. The body is
+ *   CHANGE_JOIN:             [peer id: u32][ip: u32][port: u16] (ip and port as in a search response)
+ *   CHANGE_PUBLISH:          a PUBLISH body: [count: u32][name\0]...
+ *   CHANGE_PUBLISH_DIGESTS:  the same, then one digest per name
+ *   CHANGE_UNPUBLISH:        a PUBLISH_REMOVE body: [count: u32][name\0]...
+ *   CHANGE_LEAVE:            nothing
+ *   CHANGE_RESET:            nothing; the session is 0. Everything before it is void. Only
+ *                            sent to followers, never journaled.
+ *   CHANGE_SYNCED:           nothing; the session is 0. Ends the whole index that follows a
+ *                            CHANGE_RESET. Only sent to followers, never journaled.
+ *
+ * [type][body] is laid out like a packet, so Packet's parsers read it as is.
+ */
+enum ChangeType : uint8_t {
+  CHANGE_JOIN = 1,
+  CHANGE_PUBLISH,
+  CHANGE_UNPUBLISH,
+  CHANGE_LEAVE,
+  CHANGE_RESET,
+  CHANGE_PUBLISH_DIGESTS,
+  CHANGE_SYNCED,
+};
+
+#define CHANGE_HEADER_LEN 13
+
+// Anything bigger can't have come from a single packet.
+#define MAX_CHANGE_LEN (MAX_FRAME_LEN + 16)
+
+/**
+ * Appends a record header to `out`, with the length left for end_change to fill in.
+ * @return Where the record starts in `out`.
+ */
+inline size_t begin_change(std::vector<uint8_t>& out, uint64_t session, ChangeType type) {
+  size_t start = out.size();
+  out.resize(start + CHANGE_HEADER_LEN);
+  uint64_t be_session = htobe64(session);
+  memcpy(out.data() + start + sizeof(uint32_t), &be_session, sizeof(uint64_t));
+  out[start + sizeof(uint32_t) + sizeof(uint64_t)] = type;
+  return start;
+}
+
+inline void end_change(std::vector<uint8_t>& out, size_t start) {
+  uint32_t length = htonl((uint32_t)(out.size() - start - sizeof(uint32_t)));
+  memcpy(out.data() + start, &length, sizeof(uint32_t));
+}
+
+inline void encode_names(std::vector<uint8_t>& out, const std::vector<std::string>& files) {
+  uint32_t count = htonl((uint32_t)files.size());
+  out.insert(out.end(), (uint8_t*)&count, (uint8_t*)&count + sizeof(uint32_t));
+  for (const auto& file : files) {
+    out.insert(out.end(), file.begin(), file.end());
+    out.push_back('\0');
+  }
+}
+
+inline void encode_join(std::vector<uint8_t>& out, uint64_t session, const Peer& peer) {
+  size_t start = begin_change(out, session, CHANGE_JOIN);
+  uint32_t id = htonl(peer.id);
+  out.insert(out.end(), (uint8_t*)&id, (uint8_t*)&id + sizeof(uint32_t));
+  out.insert(out.end(), (uint8_t*)&peer.address.sin_addr.s_addr, (uint8_t*)&peer.address.sin_addr.s_addr + sizeof(uint32_t));
+  out.insert(out.end(), (uint8_t*)&peer.address.sin_port, (uint8_t*)&peer.address.sin_port + sizeof(uint16_t));
+  end_change(out, start);
+}
+
+inline void encode_publish(std::vector<uint8_t>& out, uint64_t session, const std::vector<std::string>& files,
+                           const std::vector<Digest>& digests) {
+  size_t start = begin_change(out, session, digests.empty() ? CHANGE_PUBLISH : CHANGE_PUBLISH_DIGESTS);
+  encode_names(out, files);
+  for (const auto& digest : digests) {
+    out.insert(out.end(), digest.begin(), digest.end());
+  }
+  end_change(out, start);
+}
+
+inline void encode_unpublish(std::vector<uint8_t>& out, uint64_t session, const std::vector<std::string>& files) {
+  size_t start = begin_change(out, session, CHANGE_UNPUBLISH);
+  encode_names(out, files);
+  end_change(out, start);
+}
+
+inline void encode_leave(std::vector<uint8_t>& out, uint64_t session) {
+  size_t start = begin_change(out, session, CHANGE_LEAVE);
+  end_change(out, start);
+}
+
+inline void encode_reset(std::vector<uint8_t>& out) {
+  size_t start = begin_change(out, 0, CHANGE_RESET);
+  end_change(out, start);
+}
+
+inline void encode_synced(std::vector<uint8_t>& out) {
+  size_t start = begin_change(out, 0, CHANGE_SYNCED);
+  end_change(out, start);
+}
+
+/**
+ * Checks whether `data` starts with a complete change record.
+ *
+ * @param record_len Set to the record's total size, length field included, when complete.
+ */
+inline FrameStatus change_length(const uint8_t* data, size_t len, size_t& record_len) {
+  if (len < sizeof(uint32_t)) {
+    return FrameStatus::Partial;
+  }
+
+  uint32_t length;
+  memcpy(&length, data, sizeof(uint32_t));
+  length = ntohl(length);
+
+  if (length < CHANGE_HEADER_LEN - sizeof(uint32_t) || length > MAX_CHANGE_LEN) {
+    return FrameStatus::Invalid;
+  }
+  if (len < sizeof(uint32_t) + (size_t)length) {
+    return FrameStatus::Partial;
+  }
+
+  record_len = sizeof(uint32_t) + length;
+  return FrameStatus::Complete;
+}
+
+/**
+ * Makes the change in one complete record (as sized by change_length) to `registry`,
+ * through its replay_ calls.
+ *
+ * @return false if the record type is unknown.
+ */
+inline bool apply_change(Registry& registry, const uint8_t* record, size_t record_len) {
+  uint64_t session;
+  memcpy(&session, record + sizeof(uint32_t), sizeof(uint64_t));
+  session = be64toh(session);
+
+  Packet body;
+  body.buf.assign(record + sizeof(uint32_t) + sizeof(uint64_t), record + record_len);
+
+  switch (body.buf[0]) {
+    case CHANGE_JOIN: {
+      Peer peer;
+      if (body.buf.size() >= 1 + sizeof(uint32_t) * 2 + sizeof(uint16_t)) {
+        memcpy(&peer.id, body.buf.data() + 1, sizeof(uint32_t));
+        peer.id = ntohl(peer.id);
+        peer.address.sin_family = AF_INET;
+        memcpy(&peer.address.sin_addr.s_addr, body.buf.data() + 1 + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&peer.address.sin_port, body.buf.data() + 1 + sizeof(uint32_t) * 2, sizeof(uint16_t));
+      }
+      registry.replay_join(session, peer);
+      return true;
+    }
+    case CHANGE_PUBLISH:
+    case CHANGE_PUBLISH_DIGESTS: {
+      body.flags = body.buf[0] == CHANGE_PUBLISH_DIGESTS ? PUBLISH_DIGESTS : 0;
+      std::vector<Digest> digests;
+      auto files = body.handle_publish(digests);
+      registry.replay_publish(session, files, digests);
+      return true;
+    }
+    case CHANGE_UNPUBLISH:
+      registry.replay_unpublish(session, body.handle_unpublish());
+      return true;
+    case CHANGE_LEAVE:
+      registry.replay_leave(session);
+      return true;
+    case CHANGE_RESET:
+      registry.clear();
+      return true;
+    case CHANGE_SYNCED:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Keeps a Registry on disk so a restart can pick up where it left off.
+ *
+ * The state lives in a directory as one snapshot plus journals of the changes since:
+ *  - `snapshot` is the whole index in fixed-size records (layout below), written to a
+ *    temporary file, fsynced and renamed into place, so it's always either the old one
+ *    or the new one. It's read back with mmap(2).
+ *  - `journal.N` files get every change as it happens (as a ChangeSink), in the record
+ *    format above. A checkpoint switches to journal N+1 before it copies the registry
+ *    out, so replaying everything from the journal named in the snapshot on brings the
+ *    copy up to date, and anything older is deleted. A torn record at the end of a
+ *    journal (from a crash mid-write) ends the replay of that file.
+ *
+ * Journals are flushed to disk every JOURNAL_SYNC_SECS, so a crash of the whole machine
+ * can lose that much; a crash of just the registry loses nothing.
+ *
+ * Everyone restored comes back as a ghost (see Registry), so SEARCH has answers from the
+ * moment the snapshot is loaded, and peers that really are gone fall out after
+ * GHOST_TTL_SECS.
+ */
+class Store : public ChangeSink {
+ protected:
+  /**
+   * Snapshot layout. The file never leaves this machine, so it's in host byte order
+   * (apart from addresses, which stay in network order) and read in place:
+   *
+   *   [Header][Header::peers x SavedPeerRecord][Header::files x SavedFileRecord][names]
+   *
+   * Every file record points at its name in the names block.
+   */
+  struct Header {
+    char magic[8];
+    uint64_t journal;  // First journal to replay on top of this.
+    uint64_t next_session;
+    uint64_t peers;
+    uint64_t files;
+    uint64_t names_len;
+  };
+
+  struct SavedPeerRecord {
+    uint64_t session;
+    uint32_t id;
+    uint32_t ip;
+    uint16_t port;
+    uint16_t padding[3];
+  };
+
+  struct SavedFileRecord {
+    uint64_t session;
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t padding;
+    uint8_t digest[DIGEST_LEN];
+  };
+
+  static constexpr char MAGIC[8] = {'P', '2', 'P', 'S', 'N', 'A', 'P', '1'};
+
+  std::string dir;
+
+  // Guards everything below.
+  std::mutex lock;
+  int journal_fd = -1;
+  uint64_t generation = 0;
+  bool dirty = false;
+
+  std::string journal_path(uint64_t journal) const { return dir + "/journal." + std::to_string(journal); }
+  std::string snapshot_path() const { return dir + "/snapshot"; }
+
+ public:
+  explicit Store(const std::string& dir) : dir(dir) {}
+
+  ~Store() {
+    if (journal_fd >= 0) {
+      close(journal_fd);
+    }
+  }
+
+  /**
+   * Loads the snapshot and replays the journals after it into `registry`, then opens a
+   * new journal. Call once, before `registry` serves anyone and before it's told to
+   * report to this Store.
+   *
+   * @return false if the directory can't be used at all. A missing snapshot or journal
+   *         just means starting empty.
+   */
+  bool recover(Registry& registry) {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Can't create %s: %s\n", dir.c_str(), strerror(errno));
+      return false;
+    }
+
+    uint64_t first_journal = 0;
+    size_t peers = 0;
+    size_t files = 0;
+    load_snapshot(registry, first_journal, peers, files);
+
+    std::vector<uint64_t> journals = list_journals();
+    size_t changes = 0;
+    for (uint64_t journal : journals) {
+      if (journal >= first_journal) {
+        changes += replay_journal(registry, journal);
+      }
+    }
+
+    generation = journals.empty() ? first_journal : std::max(first_journal, journals.back() + 1);
+    journal_fd = open(journal_path(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0) {
+      fprintf(stderr, "Can't open %s: %s\n", journal_path(generation).c_str(), strerror(errno));
+      return false;
+    }
+    dirty = changes > 0;
+
+    printf("Restored %zu peers and %zu files from the snapshot, then %zu changes from journals.\n", peers, files, changes);
+    return true;
+  }
+
+  void joined(uint64_t session, const Peer& peer) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_join(record, session, peer);
+    append(record);
+  }
+
+  void published(uint64_t session, const std::vector<std::string>& files, const std::vector<Digest>& digests) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_publish(record, session, files, digests);
+    append(record);
+  }
+
+  void unpublished(uint64_t session, const std::vector<std::string>& files) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_unpublish(record, session, files);
+    append(record);
+  }
+
+  void left(uint64_t session) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_leave(record, session);
+    append(record);
+  }
+
+  /**
+   * Flushes the journal to disk. Workers keep appending while it runs: the lock is only
+   * held to take a descriptor of our own, which stays valid if checkpoint() swaps the
+   * journal out meanwhile.
+   */
+  void sync() {
+    int fd;
+    {
+      std::lock_guard guard(lock);
+      fd = journal_fd >= 0 ? dup(journal_fd) : -1;
+    }
+    if (fd >= 0) {
+      fdatasync(fd);
+      close(fd);
+    }
+  }
+
+  /**
+   * Writes a fresh snapshot of `registry` and deletes the journals it makes redundant.
+   * Does nothing if nothing has changed since the last one. Workers keep going while it
+   * runs.
+   *
+   * @return false if the snapshot couldn't be written; the journals are kept then.
+   */
+  bool checkpoint(const Registry& registry) {
+    uint64_t journal;
+    int old_fd;
+    {
+      std::lock_guard guard(lock);
+      if (!dirty) {
+        return true;
+      }
+
+      int fd = open(journal_path(generation + 1).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", journal_path(generation + 1).c_str(), strerror(errno));
+        return false;
+      }
+      old_fd = journal_fd;
+      journal_fd = fd;
+      journal = ++generation;
+      dirty = false;
+    }
+
+    // Nothing writes to the old journal any more; flush it without holding up appends.
+    if (old_fd >= 0) {
+      fdatasync(old_fd);
+      close(old_fd);
+    }
+
+    std::vector<Registry::SavedPeer> peers;
+    std::vector<Registry::SavedFile> files;
+    uint64_t next_session = registry.save(peers, files);
+
+    if (!write_snapshot(journal, next_session, peers, files)) {
+      std::lock_guard guard(lock);
+      dirty = true;
+      return false;
+    }
+
+    for (uint64_t old : list_journals()) {
+      if (old < journal) {
+        unlink(journal_path(old).c_str());
+      }
+    }
+    return true;
+  }
+
+ protected:
+  void append(const std::vector<uint8_t>& record) {
+    std::lock_guard guard(lock);
+    dirty = true;
+    if (journal_fd < 0) {
+      return;
+    }
+
+    size_t total = 0;
+    while (total < record.size()) {
+      ssize_t n = write(journal_fd, record.data() + total, record.size() - total);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "Journal write failed: %s\n", strerror(errno));
+        return;
+      }
+      total += n;
+    }
+  }
+
+  /**
+   * Journal numbers present in the directory, lowest first.
+   */
+  std::vector<uint64_t> list_journals() const {
+    std::vector<uint64_t> journals;
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+      return journals;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != nullptr) {
+      if (strncmp(entry->d_name, "journal.", 8) == 0) {
+        char* end;
+        uint64_t journal = strtoull(entry->d_name + 8, &end, 10);
+        if (*end == '\0' && end != entry->d_name + 8) {
+          journals.push_back(journal);
+        }
+      }
+    }
+    closedir(d);
+
+    std::sort(journals.begin(), journals.end());
+    return journals;
+  }
+
+  /**
+   * Maps the file at `path` read-only.
+   * @return The mapping and its size, or {nullptr, 0} if it's missing or empty.
+   */
+  static std::pair<const uint8_t*, size_t> map_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return {nullptr, 0};
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return {nullptr, 0};
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return {nullptr, 0};
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    return {(const uint8_t*)data, (size_t)st.st_size};
+  }
+
+  void load_snapshot(Registry& registry, uint64_t& journal, size_t& peer_count, size_t& file_count) {
+    auto [data, size] = map_file(snapshot_path());
+    if (data == nullptr) {
+      return;
+    }
+
+    Header header;
+    bool valid = size >= sizeof(Header);
+    if (valid) {
+      memcpy(&header, data, sizeof(Header));
+      valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.peers <= size && header.files <= size &&
+              header.names_len <= size &&
+              sizeof(Header) + header.peers * sizeof(SavedPeerRecord) + header.files * sizeof(SavedFileRecord) +
+                      header.names_len ==
+                  size;
+    }
+    if (!valid) {
+      fprintf(stderr, "Ignoring %s: not a snapshot, or cut short.\n", snapshot_path().c_str());
+      munmap((void*)data, size);
+      return;
+    }
+
+    const auto* peers = (const SavedPeerRecord*)(data + sizeof(Header));
+    const auto* files = (const SavedFileRecord*)(peers + header.peers);
+    const char* names = (const char*)(files + header.files);
+
+    for (uint64_t i = 0; i < header.peers; i++) {
+      Peer peer;
+      peer.id = peers[i].id;
+      peer.address.sin_family = AF_INET;
+      peer.address.sin_addr.s_addr = peers[i].ip;
+      peer.address.sin_port = peers[i].port;
+      registry.replay_join(peers[i].session, peer);
+    }
+
+    // Records are grouped by session, so each peer's files go in as one publish.
+    std::vector<std::string> group;
+    std::vector<Digest> digests;
+    for (uint64_t i = 0; i < header.files; i++) {
+      const SavedFileRecord& file = files[i];
+      if (file.name_offset > header.names_len || file.name_len > header.names_len - file.name_offset) {
+        continue;
+      }
+
+      group.emplace_back(names + file.name_offset, file.name_len);
+      digests.emplace_back();
+      memcpy(digests.back().data(), file.digest, DIGEST_LEN);
+
+      if (i + 1 == header.files || files[i + 1].session != file.session) {
+        registry.replay_publish(file.session, group, digests);
+        group.clear();
+        digests.clear();
+      }
+    }
+
+    registry.reserve_sessions(header.next_session);
+    journal = header.journal;
+    peer_count = header.peers;
+    file_count = header.files;
+    munmap((void*)data, size);
+  }
+
+  /**
+   * @return Number of records applied.
+   */
+  size_t replay_journal(Registry& registry, uint64_t journal) {
+    auto [data, size] = map_file(journal_path(journal));
+    if (data == nullptr) {
+      return 0;
+    }
+
+    size_t changes = 0;
+    size_t offset = 0;
+    size_t record_len = 0;
+    while (change_length(data + offset, size - offset, record_len) == FrameStatus::Complete) {
+      if (!apply_change(registry, data + offset, record_len)) {
+        break;
+      }
+      offset += record_len;
+      changes++;
+    }
+
+    if (offset != size) {
+      fprintf(stderr, "%s: stopped at a damaged record %zu bytes from the end.\n", journal_path(journal).c_str(),
+              size - offset);
+    }
+    munmap((void*)data, size);
+    return changes;
+  }
+
+  bool write_snapshot(uint64_t journal, uint64_t next_session, const std::vector<Registry::SavedPeer>& peers,
+                      const std::vector<Registry::SavedFile>& files) {
+    std::string tmp = snapshot_path() + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+      fprintf(stderr, "Can't write %s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+    }
+
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.journal = journal;
+    header.next_session = next_session;
+    header.peers = peers.size();
+    header.files = files.size();
+    for (const auto& file : files) {
+      header.names_len += file.name.size();
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for (const auto& peer : peers) {
+      SavedPeerRecord record = {peer.session, peer.id, peer.ip, peer.port, {}};
+      ok = ok && fwrite(&record, sizeof(record), 1, f) == 1;
+    }
+
+    uint64_t offset = 0;
+    for (const auto& file : files) {
+      SavedFileRecord record = {file.session, offset, (uint32_t)file.name.size(), 0, {}};
+      memcpy(record.digest, file.digest.data(), DIGEST_LEN);
+      ok = ok && fwrite(&record, sizeof(record), 1, f) == 1;
+      offset += file.name.size();
+    }
+
+    for (const auto& file : files) {
+      ok = ok && fwrite(file.name.data(), 1, file.name.size(), f) == file.name.size();
+    }
+
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), snapshot_path().c_str()) != 0) {
+      fprintf(stderr, "Can't write %s: %s\n", snapshot_path().c_str(), strerror(errno));
+      unlink(tmp.c_str());
+      return false;
+    }
+
+    // Make the rename itself durable before the journals it replaces go.
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+    return true;
+  }
+};
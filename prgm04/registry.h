@@ -0,0 +1,906 @@
+#pragma once
+
+#include <fnmatch.h>
+#include <stdint.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <set>
+#include <string_view>
+#include <vector>
+
+#include "packet.h"
+#include "peer.h"
+
+// Number of independently locked slices of the file index.
+#define FILE_SHARDS 64
+
+/**
+ * Compact reference to a row in the Registry's peer table.
+ * The generation changes whenever a slot is reused, so a stale handle left in the
+ * file index never resolves to whoever got the slot next.
+ */
+struct PeerHandle {
+  uint32_t slot;
+  uint32_t generation;
+
+  bool operator==(const PeerHandle& other) const { return slot == other.slot && generation == other.generation; }
+};
+
+/**
+ * Digests are already uniformly random, so any 8 bytes of one make a fine hash.
+ */
+struct DigestHash {
+  size_t operator()(const Digest& digest) const {
+    size_t h;
+    memcpy(&h, digest.data(), sizeof(h));
+    return h;
+  }
+};
+
+/**
+ * Told about every change to the index, right after it's made. Changes for one peer
+ * arrive in the order they were made; changes for different peers can arrive from
+ * several worker threads at once.
+ *
+ * Peers are identified by session: a number given out at JOIN that, unlike a socket,
+ * stays the same across registry restarts.
+ */
+class ChangeSink {
+ public:
+  virtual ~ChangeSink() = default;
+
+  // Also called when a joined peer sends JOIN again with a new id.
+  virtual void joined(uint64_t session, const Peer& peer) = 0;
+  virtual void published(uint64_t session, const std::vector<std::string>& files, const std::vector<Digest>& digests) = 0;
+  virtual void unpublished(uint64_t session, const std::vector<std::string>& files) = 0;
+  virtual void left(uint64_t session) = 0;
+};
+
+/**
+ * Shared registry state: who is connected, and who has which file.
+ *
+ * Peers live in one table, and the file index only stores PeerHandles into it, so a
+ * published file costs one name plus a handle and a digest per owner no matter how
+ * much the owners have shared. Every peer that publishes a name is kept as an owner
+ * of it until it withdraws the name or leaves. Each peer's own set of names lives in
+ * its Peer, so publishing or withdrawing a name costs the same however many the peer
+ * already has.
+ *
+ * Files published with a content digest are also indexed by digest, so anyone holding
+ * the same bytes can serve a fetch whatever they called the file.
+ *
+ * Besides connected peers, the table can hold ghosts: peers restored from disk (see
+ * replay_join) with no connection behind them. They answer SEARCH like anyone else.
+ * A ghost that JOINs again from the same address with the same id turns back into a
+ * connected peer with everything it had published, and one that doesn't is dropped
+ * by expire_ghosts. For a peer that doesn't serve FETCH the port is always 0 (see
+ * Packet::handle_join), so it only has to come back from the same IP.
+ *
+ * Every worker thread talks to the same Registry, so it does its own locking:
+ *  - The file index is split into FILE_SHARDS shards by filename hash, each behind
+ *    its own std::shared_mutex. SEARCH takes a shared lock on exactly one shard, so
+ *    readers never wait on each other and only wait on a writer touching that shard.
+ *  - The peer table has one std::shared_mutex. It's only written by JOIN, the
+ *    PUBLISH messages and disconnects.
+ *  - A sorted secondary index of every indexed name answers prefix and glob queries.
+ *    It holds views of the shard map keys rather than copies, has its own
+ *    std::shared_mutex, and is only written when a name gains its first owner or
+ *    loses its last one.
+ *  - The digest index is sharded the same way as the file index, by digest.
+ *
+ * The peer table lock is never held together with any other lock; handle generations
+ * cover the gap. A writer may take names_lock while holding a shard lock, never the
+ * other way around. Digest shard locks are never held with any other lock.
+ */
+class Registry {
+ protected:
+  struct Owner {
+    PeerHandle handle;
+    Digest digest;  // All zeros if published without one.
+  };
+
+  struct alignas(64) Shard {
+    mutable std::shared_mutex lock;
+    // Owners in publish order, oldest first.
+    std::unordered_map<std::string, std::vector<Owner>> files = {};
+  };
+
+  // Someone with a given digest, and the name they published it under.
+  struct Holder {
+    PeerHandle handle;
+    std::string name;
+  };
+
+  struct alignas(64) DigestShard {
+    mutable std::shared_mutex lock;
+    std::unordered_map<Digest, std::vector<Holder>, DigestHash> holders = {};
+  };
+
+  struct Slot {
+    Peer peer;  // socket_fd is -1 for a ghost.
+    uint32_t generation = 0;
+    bool in_use = false;
+    uint64_t session = 0;
+    time_t ghost_since = 0;
+
+    // How many times a SEARCH_MULTI has handed this peer out. Bumped atomically
+    // under the shared lock.
+    uint32_t handed_out = 0;
+  };
+
+  std::array<Shard, FILE_SHARDS> shards;
+  std::array<DigestShard, FILE_SHARDS> digest_shards;
+
+  // Views into the shard maps' keys. Unordered map nodes don't move, and a name
+  // is removed from here before its node is erased.
+  mutable std::shared_mutex names_lock;
+  std::set<std::string_view> names = {};
+
+  mutable std::shared_mutex peers_lock;
+  std::vector<Slot> table = {};
+  std::vector<uint32_t> free_slots = {};
+  std::unordered_map<int, uint32_t> by_socket = {};
+  std::unordered_map<uint64_t, uint32_t> by_session = {};
+  std::unordered_multimap<uint32_t, uint32_t> ghosts_by_id = {};
+  uint64_t next_session = 1;
+
+  std::vector<ChangeSink*> sinks;
+
+  Shard& shard_for(const std::string& file) { return shards[std::hash<std::string>{}(file) % FILE_SHARDS]; }
+  const Shard& shard_for(const std::string& file) const { return shards[std::hash<std::string>{}(file) % FILE_SHARDS]; }
+
+  // Not the bytes DigestHash uses, so shards and buckets don't line up.
+  DigestShard& digest_shard_for(const Digest& digest) { return digest_shards[digest[DIGEST_LEN - 1] % FILE_SHARDS]; }
+  const DigestShard& digest_shard_for(const Digest& digest) const { return digest_shards[digest[DIGEST_LEN - 1] % FILE_SHARDS]; }
+
+  static bool is_unknown(const Digest& digest) { return digest == Digest{}; }
+
+ public:
+  /**
+   * Reports every change from now on to `sink`, as well as to any added before.
+   * Add them all before any worker starts.
+   */
+  void add_sink(ChangeSink* sink) { sinks.push_back(sink); }
+
+  void join(const Peer& peer) {
+    uint64_t session;
+    {
+      std::unique_lock guard(peers_lock);
+
+      auto it = by_socket.find(peer.socket_fd);
+      if (it != by_socket.end()) {
+        // A second JOIN on the same connection just changes the id.
+        table[it->second].peer.id = peer.id;
+        session = table[it->second].session;
+      } else if (auto ghost = take_ghost(peer)) {
+        table[*ghost].peer.socket_fd = peer.socket_fd;
+        by_socket[peer.socket_fd] = *ghost;
+        session = table[*ghost].session;
+      } else {
+        uint32_t slot = new_slot(peer, next_session++);
+        by_socket[peer.socket_fd] = slot;
+        session = table[slot].session;
+      }
+    }
+
+    for (ChangeSink* sink : sinks) {
+      sink->joined(session, peer);
+    }
+  }
+
+  /**
+   * Adds `files` to the peer connected on `peer_sfd` and indexes them. Names the peer
+   * already published are not added twice.
+   *
+   * @param digests Content digest of each file, in the same order, or empty if the
+   *                peer didn't send any. Republishing a name replaces its digest.
+   * @return false if the peer never sent a JOIN.
+   */
+  bool publish(int peer_sfd, const std::vector<std::string>& files, const std::vector<Digest>& digests = {}) {
+    return publish_to(by_socket, peer_sfd, files, digests);
+  }
+
+  /**
+   * Withdraws `files` from the peer connected on `peer_sfd`. Names it never published
+   * are ignored.
+   *
+   * @return false if the peer never sent a JOIN.
+   */
+  bool unpublish(int peer_sfd, const std::vector<std::string>& files) {
+    return unpublish_from(by_socket, peer_sfd, files);
+  }
+
+  /**
+   * Forgets the peer on `peer_sfd` and everything it published.
+   * Index entries that have since been taken over by another peer are left alone.
+   */
+  void leave(int peer_sfd) { leave_from(by_socket, peer_sfd, 0); }
+
+  /**
+   * The replay_ calls make the same changes as the ones above, but name the peer by
+   * session, as a ChangeSink sees them. They're for rebuilding the index from disk, or
+   * from another registry's changes.
+   *
+   * replay_join makes a ghost if `session` isn't in the table yet, and otherwise just
+   * updates its id. Replaying a change that has already been made is harmless.
+   */
+  void replay_join(uint64_t session, const Peer& peer) {
+    std::unique_lock guard(peers_lock);
+    next_session = std::max(next_session, session + 1);
+
+    auto it = by_session.find(session);
+    if (it == by_session.end()) {
+      uint32_t slot = new_slot(peer, session);
+      table[slot].peer.socket_fd = -1;
+      table[slot].ghost_since = time(nullptr);
+      ghosts_by_id.emplace(peer.id, slot);
+      return;
+    }
+
+    Slot& slot = table[it->second];
+    if (slot.peer.socket_fd < 0) {
+      forget_ghost(it->second);
+      ghosts_by_id.emplace(peer.id, it->second);
+    }
+    slot.peer.id = peer.id;
+  }
+
+  bool replay_publish(uint64_t session, const std::vector<std::string>& files, const std::vector<Digest>& digests) {
+    return publish_to(by_session, session, files, digests);
+  }
+
+  bool replay_unpublish(uint64_t session, const std::vector<std::string>& files) {
+    return unpublish_from(by_session, session, files);
+  }
+
+  void replay_leave(uint64_t session) { leave_from(by_session, session, 0); }
+
+  /**
+   * Forgets every peer, connected or ghost, and everything they published.
+   */
+  void clear() {
+    std::vector<uint64_t> sessions;
+    {
+      std::shared_lock guard(peers_lock);
+      for (const auto& [session, slot] : by_session) {
+        sessions.push_back(session);
+      }
+    }
+
+    for (uint64_t session : sessions) {
+      leave_from(by_session, session, 0);
+    }
+  }
+
+  /**
+   * Drops every ghost that has been waiting since before `cutoff` for its peer to come
+   * back, along with everything it published.
+   */
+  void expire_ghosts(time_t cutoff) {
+    std::vector<uint64_t> expired;
+    {
+      std::shared_lock guard(peers_lock);
+      for (const auto& [id, slot] : ghosts_by_id) {
+        if (table[slot].ghost_since < cutoff) {
+          expired.push_back(table[slot].session);
+        }
+      }
+    }
+
+    // Checked again under the lock, in case one came back in the meantime.
+    for (uint64_t session : expired) {
+      leave_from(by_session, session, cutoff);
+    }
+  }
+
+  /**
+   * A peer as saved to disk: everything replay_join needs to bring it back.
+   */
+  struct SavedPeer {
+    uint64_t session;
+    uint32_t id;
+    uint32_t ip;    // Network byte order.
+    uint16_t port;  // Network byte order.
+  };
+
+  struct SavedFile {
+    uint64_t session;
+    std::string name;
+    Digest digest;
+  };
+
+  /**
+   * Copies out the whole index, one lock at a time, so workers carry on meanwhile. The
+   * copy isn't a single point in time: a change made while it runs may or may not be in
+   * it, but replaying any change made after the call started brings it up to date.
+   *
+   * @param files Grouped by session, in no particular order otherwise.
+   * @return The session the next new peer will get.
+   */
+  uint64_t save(std::vector<SavedPeer>& peers, std::vector<SavedFile>& files) const {
+    // Session of each slot as of now, by slot and generation.
+    std::vector<std::pair<uint32_t, uint64_t>> sessions;
+    uint64_t next;
+    {
+      std::shared_lock guard(peers_lock);
+      next = next_session;
+      sessions.resize(table.size(), {0, 0});
+      for (uint32_t i = 0; i < table.size(); i++) {
+        const Slot& slot = table[i];
+        if (!slot.in_use) {
+          continue;
+        }
+        sessions[i] = {slot.generation, slot.session};
+        peers.push_back(SavedPeer{slot.session, slot.peer.id, slot.peer.address.sin_addr.s_addr, slot.peer.address.sin_port});
+      }
+    }
+
+    for (const Shard& shard : shards) {
+      std::shared_lock guard(shard.lock);
+      for (const auto& [name, owners] : shard.files) {
+        for (const Owner& owner : owners) {
+          if (owner.handle.slot >= sessions.size()) {
+            continue;
+          }
+          auto [generation, session] = sessions[owner.handle.slot];
+          if (session != 0 && generation == owner.handle.generation) {
+            files.push_back(SavedFile{session, name, owner.digest});
+          }
+        }
+      }
+    }
+
+    std::stable_sort(files.begin(), files.end(), [](const SavedFile& a, const SavedFile& b) { return a.session < b.session; });
+    return next;
+  }
+
+  /**
+   * Makes sure sessions handed out from now on start at `next` or above.
+   */
+  void reserve_sessions(uint64_t next) {
+    std::unique_lock guard(peers_lock);
+    next_session = std::max(next_session, next);
+  }
+
+ protected:
+  /**
+   * Adds `files` to the peer `index` maps `key` to, and indexes them.
+   * @return false if there's no such peer.
+   */
+  template <typename Key>
+  bool publish_to(const std::unordered_map<Key, uint32_t>& index, Key key, const std::vector<std::string>& files,
+                  const std::vector<Digest>& digests) {
+    PeerHandle handle;
+    uint64_t session;
+    {
+      std::unique_lock guard(peers_lock);
+      auto it = index.find(key);
+      if (it == index.end()) {
+        return false;
+      }
+
+      Slot& slot = table[it->second];
+      slot.peer.add_files(files);
+      handle = PeerHandle{it->second, slot.generation};
+      session = slot.session;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+      const std::string& file = files[i];
+      Digest digest = i < digests.size() ? digests[i] : Digest{};
+      Digest previous = {};
+      {
+        Shard& shard = shard_for(file);
+        std::unique_lock shard_guard(shard.lock);
+
+        auto [it, inserted] = shard.files.try_emplace(file);
+        if (inserted) {
+          std::unique_lock names_guard(names_lock);
+          names.insert(it->first);
+        }
+
+        auto& owners = it->second;
+        auto owner = find_owner(owners, handle);
+        if (owner == owners.end()) {
+          owners.push_back(Owner{handle, digest});
+        } else {
+          previous = owner->digest;
+          owner->digest = digest;
+        }
+      }
+
+      if (previous != digest) {
+        if (!is_unknown(previous)) {
+          remove_holder(previous, handle, file);
+        }
+        if (!is_unknown(digest)) {
+          add_holder(digest, handle, file);
+        }
+      }
+    }
+
+    for (ChangeSink* sink : sinks) {
+      sink->published(session, files, digests);
+    }
+    return true;
+  }
+
+  /**
+   * Withdraws `files` from the peer `index` maps `key` to.
+   * @return false if there's no such peer.
+   */
+  template <typename Key>
+  bool unpublish_from(const std::unordered_map<Key, uint32_t>& index, Key key, const std::vector<std::string>& files) {
+    PeerHandle handle;
+    uint64_t session;
+    std::vector<std::string> removed;
+    {
+      std::unique_lock guard(peers_lock);
+      auto it = index.find(key);
+      if (it == index.end()) {
+        return false;
+      }
+
+      Slot& slot = table[it->second];
+      for (const auto& file : files) {
+        if (slot.peer.remove_file(file)) {
+          removed.push_back(file);
+        }
+      }
+      handle = PeerHandle{it->second, slot.generation};
+      session = slot.session;
+    }
+
+    for (const auto& file : removed) {
+      unindex(handle, file);
+    }
+
+    for (ChangeSink* sink : sinks) {
+      sink->unpublished(session, files);
+    }
+    return true;
+  }
+
+  /**
+   * Forgets the peer `index` maps `key` to and everything it published.
+   *
+   * @param ghosts_before If non-zero, only a ghost that has been one since before this
+   *                      time is forgotten.
+   */
+  template <typename Key>
+  void leave_from(const std::unordered_map<Key, uint32_t>& index, Key key, time_t ghosts_before) {
+    PeerHandle handle;
+    uint64_t session;
+    std::unordered_set<std::string> files;
+    {
+      std::unique_lock guard(peers_lock);
+      auto it = index.find(key);
+      if (it == index.end()) {
+        return;
+      }
+
+      uint32_t slot_index = it->second;
+      Slot& slot = table[slot_index];
+      bool ghost = slot.peer.socket_fd < 0;
+      if (ghosts_before != 0 && (!ghost || slot.ghost_since >= ghosts_before)) {
+        return;
+      }
+
+      handle = PeerHandle{slot_index, slot.generation};
+      session = slot.session;
+      files.swap(slot.peer.files);
+
+      if (ghost) {
+        forget_ghost(slot_index);
+      } else {
+        by_socket.erase(slot.peer.socket_fd);
+      }
+      by_session.erase(session);
+
+      slot.peer = Peer();
+      slot.in_use = false;
+      slot.generation++;
+      free_slots.push_back(slot_index);
+    }
+
+    for (const auto& file : files) {
+      unindex(handle, file);
+    }
+
+    for (ChangeSink* sink : sinks) {
+      sink->left(session);
+    }
+  }
+
+  /**
+   * Takes a free row of the table for `peer`. Caller holds peers_lock and adds it to
+   * by_socket or ghosts_by_id.
+   */
+  uint32_t new_slot(const Peer& peer, uint64_t session) {
+    uint32_t slot;
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      slot = (uint32_t)table.size();
+      table.emplace_back();
+    }
+
+    table[slot].peer = peer;
+    table[slot].in_use = true;
+    table[slot].session = session;
+    table[slot].ghost_since = 0;
+    // Not the last occupant's load.
+    table[slot].handed_out = 0;
+    by_session[session] = slot;
+    return slot;
+  }
+
+  /**
+   * The ghost `peer` is coming back as, if any, no longer a ghost. Caller holds peers_lock.
+   */
+  std::optional<uint32_t> take_ghost(const Peer& peer) {
+    auto [begin, end] = ghosts_by_id.equal_range(peer.id);
+    for (auto it = begin; it != end; ++it) {
+      const Peer& ghost = table[it->second].peer;
+      if (ghost.address.sin_addr.s_addr == peer.address.sin_addr.s_addr && ghost.address.sin_port == peer.address.sin_port) {
+        uint32_t slot = it->second;
+        ghosts_by_id.erase(it);
+        return slot;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void forget_ghost(uint32_t slot) {
+    auto [begin, end] = ghosts_by_id.equal_range(table[slot].peer.id);
+    for (auto it = begin; it != end; ++it) {
+      if (it->second == slot) {
+        ghosts_by_id.erase(it);
+        return;
+      }
+    }
+  }
+
+ public:
+  /**
+   * Looks up the most recent publisher of `file`.
+   *
+   * @return A Peer with only `id` and `address` filled in, or a default-constructed
+   *         Peer if the file isn't indexed.
+   */
+  Peer search(const std::string& file) const {
+    // Reused across calls so the common lookup doesn't allocate.
+    thread_local std::vector<Owner> owners;
+    copy_owners(file, owners);
+
+    std::shared_lock guard(peers_lock);
+    for (auto it = owners.rbegin(); it != owners.rend(); ++it) {
+      const Slot* slot = resolve(it->handle);
+      if (slot != nullptr) {
+        Peer found;
+        found.id = slot->peer.id;
+        found.address = slot->peer.address;
+        return found;
+      }
+    }
+    return Peer();
+  }
+
+  /**
+   * Picks up to `k` owners of `file` according to `policy`.
+   *
+   * @param requester Address of whoever asked, for NEAREST.
+   * @param found Set to peers with only `id` and `address` filled in, best first. Empty
+   *              if the file isn't indexed. Reusing one vector across calls keeps its
+   *              buffer, so once everything has grown to fit a search allocates nothing.
+   */
+  void search_owners(const std::string& file, size_t k, SearchPolicy policy, const struct sockaddr_in& requester,
+                     std::vector<Peer>& found) {
+    thread_local std::vector<Owner> owners;
+    thread_local std::vector<PeerHandle> handles;
+    thread_local std::vector<std::pair<size_t, Peer>> picked;
+    copy_owners(file, owners);
+    handles.clear();
+    for (const auto& owner : owners) {
+      handles.push_back(owner.handle);
+    }
+
+    pick(handles, k, policy, requester, picked);
+    found.clear();
+    for (auto& [index, peer] : picked) {
+      found.push_back(peer);
+    }
+  }
+
+  /**
+   * Finds up to `k` peers holding the same bytes as `file`, under any name, picked
+   * according to `policy`. The digest used is the one the name's most recent
+   * still-connected owner published it with.
+   *
+   * @param digest Set to that digest, or all zeros if nobody published one, in which
+   *               case the holders are just the name's owners, as for search_owners.
+   * @param found Set to (peer, name that peer has the bytes under) pairs, best first.
+   *              The names are good until the next call on this thread (or while `file`
+   *              is). Reused like search_owners' `found`.
+   */
+  void search_digest(const std::string& file, size_t k, SearchPolicy policy, const struct sockaddr_in& requester,
+                     Digest& digest, std::vector<std::pair<Peer, std::string_view>>& found) {
+    thread_local std::vector<Owner> owners;
+    copy_owners(file, owners);
+    digest = {};
+    {
+      std::shared_lock guard(peers_lock);
+      for (auto it = owners.rbegin(); it != owners.rend(); ++it) {
+        if (!is_unknown(it->digest) && resolve(it->handle) != nullptr) {
+          digest = it->digest;
+          break;
+        }
+      }
+    }
+
+    found.clear();
+    if (is_unknown(digest)) {
+      thread_local std::vector<Peer> owners_found;
+      search_owners(file, k, policy, requester, owners_found);
+      for (auto& peer : owners_found) {
+        found.emplace_back(peer, file);
+      }
+      return;
+    }
+
+    // Copied over the last call's holders, so their names' buffers get reused.
+    thread_local std::vector<Holder> holders;
+    {
+      const DigestShard& shard = digest_shard_for(digest);
+      std::shared_lock guard(shard.lock);
+      auto it = shard.holders.find(digest);
+      if (it != shard.holders.end()) {
+        holders.assign(it->second.begin(), it->second.end());
+      } else {
+        holders.clear();
+      }
+    }
+
+    // A peer with the bytes under several names only needs to be asked once.
+    thread_local std::vector<PeerHandle> handles;
+    thread_local std::vector<size_t> holder_of;
+    thread_local std::vector<std::pair<size_t, Peer>> picked;
+    handles.clear();
+    holder_of.clear();
+    for (size_t i = 0; i < holders.size(); i++) {
+      if (std::find(handles.begin(), handles.end(), holders[i].handle) == handles.end()) {
+        handles.push_back(holders[i].handle);
+        holder_of.push_back(i);
+      }
+    }
+
+    pick(handles, k, policy, requester, picked);
+    for (auto& [index, peer] : picked) {
+      found.emplace_back(peer, holders[holder_of[index]].name);
+    }
+  }
+
+  /**
+   * Lists indexed names starting with `prefix` (or matching the glob `pattern`), in
+   * name order, starting strictly after `cursor`. Costs O(log n + names scanned).
+   *
+   * @param more Set if there are matches past the last one returned.
+   * @return Up to `limit` (name, most recent owner) pairs, owners with only `id` and
+   *         `address` filled in.
+   */
+  std::vector<std::pair<std::string, Peer>> search_prefix(const PrefixQuery& query, bool& more) const {
+    // Every glob match starts with the pattern's literal head.
+    std::string prefix = query.pattern;
+    if (query.glob) {
+      prefix = prefix.substr(0, prefix.find_first_of("*?[\\"));
+    }
+
+    // A page whose owners all left while we looked would come back empty yet say there's
+    // more, with no last name to carry on from. Skip past it instead.
+    std::string cursor = query.cursor;
+    while (true) {
+      std::vector<std::string> page;
+      more = false;
+      {
+        std::shared_lock guard(names_lock);
+
+        auto it = names.lower_bound(prefix);
+        if (!cursor.empty() && cursor >= prefix) {
+          it = names.upper_bound(cursor);
+        }
+
+        for (; it != names.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+          // The view is of a std::string key in the index, so it ends in a NUL already.
+          if (query.glob && fnmatch(query.pattern.c_str(), it->data(), 0) != 0) {
+            continue;
+          }
+          if (page.size() == query.limit) {
+            more = true;
+            break;
+          }
+          page.emplace_back(*it);
+        }
+      }
+
+      std::vector<std::pair<std::string, Peer>> matches;
+      matches.reserve(page.size());
+      for (auto& name : page) {
+        // The owner may have left since we copied the name out.
+        Peer owner = search(name);
+        if (owner.id != 0) {
+          matches.emplace_back(std::move(name), owner);
+        }
+      }
+      if (!matches.empty() || !more) {
+        return matches;
+      }
+      cursor = page.back();
+    }
+  }
+
+ protected:
+  /**
+   * Copies the owner list for `file` out from under its shard lock into `out`, reusing
+   * its buffer.
+   */
+  void copy_owners(const std::string& file, std::vector<Owner>& out) const {
+    const Shard& shard = shard_for(file);
+    std::shared_lock guard(shard.lock);
+
+    auto it = shard.files.find(file);
+    if (it == shard.files.end()) {
+      out.clear();
+      return;
+    }
+    out.assign(it->second.begin(), it->second.end());
+  }
+
+  /**
+   * Drops `handle` as an owner of `file`, and the name itself once nobody has it.
+   */
+  void unindex(const PeerHandle& handle, const std::string& file) {
+    Digest digest = {};
+    {
+      Shard& shard = shard_for(file);
+      std::unique_lock shard_guard(shard.lock);
+
+      auto it = shard.files.find(file);
+      if (it == shard.files.end()) {
+        return;
+      }
+
+      auto& owners = it->second;
+      auto owner = find_owner(owners, handle);
+      if (owner == owners.end()) {
+        return;
+      }
+      digest = owner->digest;
+      owners.erase(owner);
+
+      if (owners.empty()) {
+        {
+          std::unique_lock names_guard(names_lock);
+          names.erase(it->first);
+        }
+        shard.files.erase(it);
+      }
+    }
+
+    if (!is_unknown(digest)) {
+      remove_holder(digest, handle, file);
+    }
+  }
+
+  static std::vector<Owner>::iterator find_owner(std::vector<Owner>& owners, const PeerHandle& handle) {
+    return std::find_if(owners.begin(), owners.end(), [&](const Owner& owner) { return owner.handle == handle; });
+  }
+
+  void add_holder(const Digest& digest, const PeerHandle& handle, const std::string& name) {
+    DigestShard& shard = digest_shard_for(digest);
+    std::unique_lock guard(shard.lock);
+    shard.holders[digest].push_back(Holder{handle, name});
+  }
+
+  void remove_holder(const Digest& digest, const PeerHandle& handle, const std::string& name) {
+    DigestShard& shard = digest_shard_for(digest);
+    std::unique_lock guard(shard.lock);
+
+    auto it = shard.holders.find(digest);
+    if (it == shard.holders.end()) {
+      return;
+    }
+
+    auto& holders = it->second;
+    holders.erase(std::remove_if(holders.begin(), holders.end(),
+                                 [&](const Holder& holder) { return holder.handle == handle && holder.name == name; }),
+                  holders.end());
+    if (holders.empty()) {
+      shard.holders.erase(it);
+    }
+  }
+
+  /**
+   * Ranks `handles` by `policy` and sets `found` to the best `k` that are still
+   * connected, as (index into handles, peer) pairs with only `id` and `address` filled
+   * in. Counts each one returned as handed out, for LEAST_LOADED.
+   */
+  void pick(const std::vector<PeerHandle>& handles, size_t k, SearchPolicy policy, const struct sockaddr_in& requester,
+            std::vector<std::pair<size_t, Peer>>& found) {
+    struct Candidate {
+      size_t index;
+      Slot* slot;
+      uint32_t rank;
+    };
+    thread_local std::vector<Candidate> candidates;
+    candidates.clear();
+    found.clear();
+
+    std::shared_lock guard(peers_lock);
+    for (size_t i = 0; i < handles.size(); i++) {
+      Slot* slot = resolve(handles[i]);
+      if (slot == nullptr) {
+        continue;
+      }
+
+      uint32_t rank = 0;
+      switch (policy) {
+        case NEAREST: {
+          // Fewer differing leading bits means a longer shared prefix.
+          uint32_t diff = ntohl(slot->peer.address.sin_addr.s_addr ^ requester.sin_addr.s_addr);
+          rank = diff == 0 ? 0 : 32 - __builtin_clz(diff);
+          break;
+        }
+        case LEAST_LOADED:
+          rank = __atomic_load_n(&slot->handed_out, __ATOMIC_RELAXED);
+          break;
+        case RANDOM:
+          break;
+      }
+      candidates.push_back(Candidate{i, slot, rank});
+    }
+
+    // Shuffle first so ties (and RANDOM) don't always favour the earliest publisher.
+    thread_local std::minstd_rand rng(std::random_device{}());
+    std::shuffle(candidates.begin(), candidates.end(), rng);
+
+    k = std::min(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(),
+                      [](const Candidate& a, const Candidate& b) { return a.rank < b.rank; });
+
+    for (size_t i = 0; i < k; i++) {
+      Slot* slot = candidates[i].slot;
+      __atomic_fetch_add(&slot->handed_out, 1, __ATOMIC_RELAXED);
+
+      Peer peer;
+      peer.id = slot->peer.id;
+      peer.address = slot->peer.address;
+      found.emplace_back(candidates[i].index, peer);
+    }
+  }
+
+  /**
+   * The slot `handle` points to, or nullptr if that peer has since left.
+   * Caller must hold peers_lock.
+   */
+  const Slot* resolve(const PeerHandle& handle) const {
+    const Slot& slot = table[handle.slot];
+    if (!slot.in_use || slot.generation != handle.generation) {
+      return nullptr;
+    }
+    return &slot;
+  }
+
+  Slot* resolve(const PeerHandle& handle) { return const_cast<Slot*>(static_cast<const Registry*>(this)->resolve(handle)); }
+};
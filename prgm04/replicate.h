@@ -0,0 +1,415 @@
+#pragma once
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "connpool.h"
+#include "persist.h"
+#include "registry.h"
+
+// Changes queued for one follower beyond this and it's cut off, to catch up from
+// scratch when it reconnects.
+#define MAX_FOLLOWER_BACKLOG (64 * 1024 * 1024)
+
+// A follower that takes longer than this to accept a write is cut off too.
+#define FOLLOWER_SEND_TIMEOUT_SECS 5
+
+// How long a follower waits before reconnecting to its leader.
+#define FOLLOWER_RETRY_SECS 1
+
+/**
+ * Sends a byte buffer whole, or fails.
+ */
+inline bool send_bytes(int s, const std::vector<uint8_t>& data) {
+  size_t total = 0;
+  while (total < data.size()) {
+    ssize_t n = send(s, data.data() + total, data.size() - total, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    total += n;
+  }
+  return true;
+}
+
+/**
+ * The leader's side of replication: streams every change to the index to any number of
+ * follower registries, which apply them to their own copy and answer searches from it.
+ *
+ * The stream is the journal's change records (see persist.h). A follower that connects
+ * first gets a CHANGE_RESET, then the whole index as JOINs and PUBLISHes, then a
+ * CHANGE_SYNCED, then the live changes. It's registered for live changes before the index is copied out, so
+ * nothing falls between the two; changes made while the copy runs may reach it twice,
+ * which replaying takes in its stride.
+ *
+ * Each follower has its own queue and its own sending thread, so workers never wait on
+ * the network, and a slow follower only holds up itself. One that falls too far behind
+ * is disconnected and starts over.
+ */
+class Replicator : public ChangeSink {
+ protected:
+  struct Follower {
+    int socket_fd;
+    std::vector<uint8_t> queue;
+    bool cut_off = false;
+  };
+
+  Registry& registry;
+  int listen_fd = -1;
+
+  // Guards followers and their queues.
+  std::mutex lock;
+  std::condition_variable wake;
+  std::vector<std::shared_ptr<Follower>> followers;
+
+ public:
+  explicit Replicator(Registry& registry) : registry(registry) {}
+
+  /**
+   * Starts taking followers on `port`, in the background.
+   * @return false if the port can't be listened on.
+   */
+  bool listen(const char* port) {
+    listen_fd = bind_and_listen(port, false);
+    if (listen_fd < 0) {
+      return false;
+    }
+    std::thread(&Replicator::accept_followers, this).detach();
+    return true;
+  }
+
+  void joined(uint64_t session, const Peer& peer) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_join(record, session, peer);
+    broadcast(record);
+  }
+
+  void published(uint64_t session, const std::vector<std::string>& files, const std::vector<Digest>& digests) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_publish(record, session, files, digests);
+    broadcast(record);
+  }
+
+  void unpublished(uint64_t session, const std::vector<std::string>& files) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_unpublish(record, session, files);
+    broadcast(record);
+  }
+
+  void left(uint64_t session) override {
+    thread_local std::vector<uint8_t> record;
+    record.clear();
+    encode_leave(record, session);
+    broadcast(record);
+  }
+
+ protected:
+  void broadcast(const std::vector<uint8_t>& record) {
+    std::lock_guard guard(lock);
+    if (followers.empty()) {
+      return;
+    }
+
+    for (auto& follower : followers) {
+      if (follower->cut_off) {
+        continue;
+      }
+      if (follower->queue.size() + record.size() > MAX_FOLLOWER_BACKLOG) {
+        follower->cut_off = true;
+        follower->queue = std::vector<uint8_t>();
+        continue;
+      }
+      follower->queue.insert(follower->queue.end(), record.begin(), record.end());
+    }
+    wake.notify_all();
+  }
+
+  void accept_followers() {
+    while (true) {
+      int s = accept(listen_fd, nullptr, nullptr);
+      if (s < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        perror("replication: accept");
+        // Out of descriptors or memory: wait for some to free up rather than spin.
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+          sleep(FOLLOWER_RETRY_SECS);
+          continue;
+        }
+        fprintf(stderr, "No longer taking followers.\n");
+        return;
+      }
+
+      struct timeval timeout = {FOLLOWER_SEND_TIMEOUT_SECS, 0};
+      setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+      auto follower = std::make_shared<Follower>();
+      follower->socket_fd = s;
+      {
+        std::lock_guard guard(lock);
+        followers.push_back(follower);
+      }
+      std::thread(&Replicator::feed, this, follower).detach();
+    }
+  }
+
+  /**
+   * Brings one follower up to date, then keeps it there until it goes away or is cut off.
+   */
+  void feed(std::shared_ptr<Follower> follower) {
+    std::vector<uint8_t> out;
+    encode_reset(out);
+    encode_index(out);
+    encode_synced(out);
+    printf("Follower connected; sending %zu bytes of index.\n", out.size());
+
+    bool ok = send_bytes(follower->socket_fd, out);
+    while (ok) {
+      out.clear();
+      {
+        std::unique_lock guard(lock);
+        wake.wait(guard, [&] { return follower->cut_off || !follower->queue.empty(); });
+        if (follower->cut_off) {
+          break;
+        }
+        out.swap(follower->queue);
+      }
+      ok = send_bytes(follower->socket_fd, out);
+    }
+
+    printf("Follower %s.\n", ok ? "fell too far behind; cut off" : "disconnected");
+    {
+      std::lock_guard guard(lock);
+      followers.erase(std::find(followers.begin(), followers.end(), follower));
+    }
+    close(follower->socket_fd);
+  }
+
+  /**
+   * Appends the whole index to `out` as JOIN and PUBLISH records.
+   */
+  void encode_index(std::vector<uint8_t>& out) {
+    std::vector<Registry::SavedPeer> peers;
+    std::vector<Registry::SavedFile> files;
+    registry.save(peers, files);
+
+    for (const auto& saved : peers) {
+      Peer peer;
+      peer.id = saved.id;
+      peer.address.sin_family = AF_INET;
+      peer.address.sin_addr.s_addr = saved.ip;
+      peer.address.sin_port = saved.port;
+      encode_join(out, saved.session, peer);
+    }
+
+    // Files come grouped by session, so each peer's go in one record, split only
+    // where a record would get too big for a follower to take.
+    std::vector<std::string> group;
+    std::vector<Digest> digests;
+    size_t group_len = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+      group.push_back(std::move(files[i].name));
+      digests.push_back(files[i].digest);
+      group_len += group.back().size() + 1 + DIGEST_LEN;
+
+      if (i + 1 == files.size() || files[i + 1].session != files[i].session ||
+          group_len + MAX_FILENAME_LEN + 1 + DIGEST_LEN > MAX_FRAME_LEN) {
+        encode_publish(out, files[i].session, group, digests);
+        group.clear();
+        digests.clear();
+        group_len = 0;
+      }
+    }
+  }
+};
+
+/**
+ * Connects to `host`:`port`.
+ * @return The socket, or -1.
+ */
+inline int connect_to(const char* host, const char* port) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* result;
+  int err = getaddrinfo(host, port, &hints, &result);
+  if (err != 0) {
+    fprintf(stderr, "follower: getaddrinfo: %s\n", gai_strerror(err));
+    return -1;
+  }
+
+  int s = -1;
+  for (struct addrinfo* rp = result; rp != nullptr; rp = rp->ai_next) {
+    s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (s < 0) {
+      continue;
+    }
+    if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+      break;
+    }
+    close(s);
+    s = -1;
+  }
+  freeaddrinfo(result);
+  return s;
+}
+
+/**
+ * Brings `registry` to match `fresh`, touching only what differs, so a search on it
+ * meanwhile finds everything the two have in common.
+ */
+inline void adopt_index(Registry& registry, const Registry& fresh) {
+  std::vector<Registry::SavedPeer> old_peers, new_peers;
+  std::vector<Registry::SavedFile> old_files, new_files;
+  registry.save(old_peers, old_files);
+  fresh.save(new_peers, new_files);
+
+  // What each session has now, name to digest; whatever is still here at the end is gone.
+  std::unordered_map<uint64_t, std::unordered_map<std::string, Digest>> had;
+  for (auto& file : old_files) {
+    had[file.session].emplace(std::move(file.name), file.digest);
+  }
+
+  std::unordered_map<uint64_t, const Registry::SavedPeer*> by_session;
+  for (const auto& saved : new_peers) {
+    by_session.emplace(saved.session, &saved);
+  }
+  for (const auto& saved : old_peers) {
+    auto it = by_session.find(saved.session);
+    // replay_join only updates the id of a session it has, so a move is a leave and a join.
+    if (it == by_session.end() || it->second->ip != saved.ip || it->second->port != saved.port) {
+      registry.replay_leave(saved.session);
+      had.erase(saved.session);
+    }
+  }
+  for (const auto& saved : new_peers) {
+    Peer peer;
+    peer.id = saved.id;
+    peer.address.sin_family = AF_INET;
+    peer.address.sin_addr.s_addr = saved.ip;
+    peer.address.sin_port = saved.port;
+    registry.replay_join(saved.session, peer);
+  }
+
+  // Files come grouped by session: publish each peer's new or changed ones in one go.
+  std::vector<std::string> group;
+  std::vector<Digest> digests;
+  for (size_t i = 0; i < new_files.size(); i++) {
+    auto& file = new_files[i];
+    auto& names = had[file.session];
+    auto it = names.find(file.name);
+    if (it == names.end() || it->second != file.digest) {
+      group.push_back(std::move(file.name));
+      digests.push_back(file.digest);
+    }
+    if (it != names.end()) {
+      names.erase(it);
+    }
+
+    if ((i + 1 == new_files.size() || new_files[i + 1].session != file.session) && !group.empty()) {
+      registry.replay_publish(file.session, group, digests);
+      group.clear();
+      digests.clear();
+    }
+  }
+
+  for (auto& [session, names] : had) {
+    if (names.empty()) {
+      continue;
+    }
+    for (auto& [name, digest] : names) {
+      group.push_back(name);
+    }
+    registry.replay_unpublish(session, group);
+    group.clear();
+  }
+}
+
+/**
+ * The follower's side: keeps `registry` a copy of the leader's at `host`:`port`,
+ * reconnecting whenever the connection drops. Until it reconnects, searches are
+ * answered from what it had, and on reconnecting the leader's index is built up on
+ * the side and then adopted, so they never see it half-copied. Never returns.
+ */
+inline void follow(const char* host, const char* port, Registry& registry) {
+  std::vector<uint8_t> buf;
+  while (true) {
+    int s = connect_to(host, port);
+    if (s < 0) {
+      sleep(FOLLOWER_RETRY_SECS);
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    printf("Following %s:%s.\n", host, port);
+
+    buf.clear();
+    size_t changes = 0;
+    // The index being sent after a CHANGE_RESET, until its CHANGE_SYNCED.
+    std::unique_ptr<Registry> incoming;
+    while (true) {
+      size_t filled = buf.size();
+      buf.resize(std::max(filled + READ_CHUNK, buf.capacity()));
+      ssize_t n = recv(s, buf.data() + filled, buf.size() - filled, 0);
+      if (n < 0 && errno == EINTR) {
+        buf.resize(filled);
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      buf.resize(filled + n);
+
+      size_t offset = 0;
+      size_t record_len = 0;
+      FrameStatus status;
+      while ((status = change_length(buf.data() + offset, buf.size() - offset, record_len)) == FrameStatus::Complete) {
+        uint8_t type = buf[offset + CHANGE_HEADER_LEN - 1];
+        if (type == CHANGE_RESET) {
+          incoming = std::make_unique<Registry>();
+        } else if (type == CHANGE_SYNCED && incoming) {
+          adopt_index(registry, *incoming);
+          incoming.reset();
+        } else if (!apply_change(incoming ? *incoming : registry, buf.data() + offset, record_len)) {
+          status = FrameStatus::Invalid;
+          break;
+        }
+        offset += record_len;
+        changes++;
+      }
+      if (status == FrameStatus::Invalid) {
+        fprintf(stderr, "Bad change record from the leader.\n");
+        break;
+      }
+      buf.erase(buf.begin(), buf.begin() + offset);
+    }
+
+    printf("Lost the leader after %zu changes; reconnecting.\n", changes);
+    close(s);
+    sleep(FOLLOWER_RETRY_SECS);
+  }
+}
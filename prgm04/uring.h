@@ -0,0 +1,757 @@
+#pragma once
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "connpool.h"
+#include "packet.h"
+
+// Submission queue entries per ring. The completion queue gets four times as many,
+// since multishot requests post many completions for one submission.
+#define URING_ENTRIES 1024
+
+// Receive buffers the kernel picks from, shared by every connection on a ring. The
+// count must be a power of two.
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/**
+ * Just enough of io_uring for UringPool, over the raw system calls: the submission and
+ * completion rings mapped from the kernel, and a ring of provided receive buffers.
+ */
+class Ring {
+ protected:
+  int ring_fd = -1;
+
+  void* sq_map = MAP_FAILED;
+  size_t sq_map_len = 0;
+  void* cq_map = MAP_FAILED;
+  size_t cq_map_len = 0;
+  struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_len = 0;
+
+  unsigned* sq_head = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  // Entries filled in but not yet published to the kernel end at this one.
+  unsigned sq_next = 0;
+
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe* cqes = nullptr;
+
+  struct io_uring_buf_ring* buf_ring = static_cast<struct io_uring_buf_ring*>(MAP_FAILED);
+  size_t buf_ring_len = 0;
+  uint8_t* buffers = static_cast<uint8_t*>(MAP_FAILED);
+  size_t buffer_size = 0;
+  unsigned buffer_count = 0;
+  uint16_t buf_next = 0;
+  // Buffers go back with IORING_OP_PROVIDE_BUFFERS instead of through `buf_ring`.
+  bool legacy_buffers = false;
+
+  static void* at(void* base, unsigned offset) { return static_cast<uint8_t*>(base) + offset; }
+
+ public:
+  Ring() = default;
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  ~Ring() {
+    if (buffers != MAP_FAILED) {
+      munmap(buffers, buffer_size * buffer_count);
+    }
+    if (buf_ring != MAP_FAILED) {
+      munmap(buf_ring, buf_ring_len);
+    }
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqes_len);
+    }
+    if (cq_map != MAP_FAILED && cq_map != sq_map) {
+      munmap(cq_map, cq_map_len);
+    }
+    if (sq_map != MAP_FAILED) {
+      munmap(sq_map, sq_map_len);
+    }
+    if (ring_fd >= 0) {
+      close(ring_fd);
+    }
+  }
+
+  /**
+   * Sets up the ring and maps its queues.
+   * @return false, with errno set, if the kernel won't.
+   */
+  bool init(unsigned entries) {
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+      return false;
+    }
+
+    sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map) {
+      sq_map_len = cq_map_len = std::max(sq_map_len, cq_map_len);
+    }
+
+    sq_map = mmap(nullptr, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) {
+      return false;
+    }
+    cq_map = single_map ? sq_map
+                        : mmap(nullptr, cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_CQ_RING);
+    if (cq_map == MAP_FAILED) {
+      return false;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe*>(
+        mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+
+    sq_head = static_cast<unsigned*>(at(sq_map, params.sq_off.head));
+    sq_tail = static_cast<unsigned*>(at(sq_map, params.sq_off.tail));
+    sq_array = static_cast<unsigned*>(at(sq_map, params.sq_off.array));
+    sq_mask = *static_cast<unsigned*>(at(sq_map, params.sq_off.ring_mask));
+    sq_entries = params.sq_entries;
+    sq_next = *sq_tail;
+
+    cq_head = static_cast<unsigned*>(at(cq_map, params.cq_off.head));
+    cq_tail = static_cast<unsigned*>(at(cq_map, params.cq_off.tail));
+    cq_mask = *static_cast<unsigned*>(at(cq_map, params.cq_off.ring_mask));
+    cqes = static_cast<struct io_uring_cqe*>(at(cq_map, params.cq_off.cqes));
+    return true;
+  }
+
+  /**
+   * Registers `count` buffers of `size` bytes as URING_BUFFER_GROUP, for receives that
+   * let the kernel pick where the data goes: as a mapped buffer ring, or if `legacy`,
+   * with IORING_OP_PROVIDE_BUFFERS, which older kernels (and some that accept a ring
+   * but never draw from it) still do.
+   * @return false, with errno set, if the kernel won't.
+   */
+  bool provide_buffers(unsigned count, size_t size, bool legacy) {
+    buffers = static_cast<uint8_t*>(
+        mmap(nullptr, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buffers == MAP_FAILED) {
+      return false;
+    }
+    buffer_size = size;
+    buffer_count = count;
+    legacy_buffers = legacy;
+
+    if (legacy) {
+      struct io_uring_sqe* sqe = next_sqe();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = (int)count;
+      sqe->addr = (uint64_t)(uintptr_t)buffers;
+      sqe->len = (uint32_t)size;
+      sqe->buf_group = URING_BUFFER_GROUP;
+      if (submit(1) < 0) {
+        return false;
+      }
+      int res = 0;
+      reap([&](const struct io_uring_cqe& cqe) { res = cqe.res; });
+      errno = -res;
+      return res >= 0;
+    }
+
+    buf_ring_len = count * sizeof(struct io_uring_buf);
+    buf_ring = static_cast<struct io_uring_buf_ring*>(
+        mmap(nullptr, buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buf_ring == MAP_FAILED) {
+      return false;
+    }
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+      recycle((uint16_t)i);
+    }
+    publish_buffers();
+    return true;
+  }
+
+  const uint8_t* buffer(uint16_t id) const { return buffers + (size_t)id * buffer_size; }
+
+  /**
+   * Hands buffer `id` back to the kernel, once publish_buffers() (for a ring) or the
+   * next submit() is called.
+   */
+  void recycle(uint16_t id) {
+    if (legacy_buffers) {
+      struct io_uring_sqe* sqe = next_sqe();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+      sqe->fd = 1;
+      sqe->addr = (uint64_t)(uintptr_t)buffer(id);
+      sqe->len = (uint32_t)buffer_size;
+      sqe->buf_group = URING_BUFFER_GROUP;
+      sqe->off = id;
+      return;
+    }
+
+    struct io_uring_buf& buf = buf_ring->bufs[buf_next & (buffer_count - 1)];
+    buf.addr = (uint64_t)(uintptr_t)buffer(id);
+    buf.len = (uint32_t)buffer_size;
+    buf.bid = id;
+    buf_next++;
+  }
+
+  void publish_buffers() {
+    if (!legacy_buffers) {
+      __atomic_store_n(&buf_ring->tail, buf_next, __ATOMIC_RELEASE);
+    }
+  }
+
+  /**
+   * A zeroed submission entry to fill in. It goes to the kernel with the next submit();
+   * if the queue is full, everything before it goes now.
+   */
+  struct io_uring_sqe* next_sqe() {
+    while (sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+      if (submit(0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        std::cerr << "Error in io_uring_enter call: " << strerror(errno) << std::endl;
+        abort();
+      }
+    }
+
+    unsigned index = sq_next & sq_mask;
+    sq_array[index] = index;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_next++;
+    return sqe;
+  }
+
+  /**
+   * Passes every entry filled in since the last call to the kernel, and waits until at
+   * least `wait` completions are ready. One system call either way.
+   * @return As io_uring_enter(2).
+   */
+  int submit(unsigned wait) {
+    __atomic_store_n(sq_tail, sq_next, __ATOMIC_RELEASE);
+    unsigned count = sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (count == 0 && wait == 0) {
+      return 0;
+    }
+    return (int)syscall(__NR_io_uring_enter, ring_fd, count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr,
+                        0);
+  }
+
+  /**
+   * Calls `handle` with a copy of every completion ready now, then lets the kernel reuse
+   * their slots. `handle` may queue new submissions.
+   */
+  template <typename Handler>
+  void reap(Handler&& handle) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe cqe = cqes[head & cq_mask];
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      handle(cqe);
+    }
+  }
+};
+
+/**
+ * Per-connection state for UringPool. `conn` holds the reassembly buffer as for
+ * ConnPool; its `out` collects replies while `sending` is with the kernel, and must not
+ * move until that send completes.
+ */
+struct UringConn {
+  Conn conn = {};
+
+  // Generation this fd was accepted in, so completions for an earlier connection that
+  // had the same fd can be told apart.
+  uint32_t generation = 0;
+
+  std::vector<uint8_t> sending = {};
+  size_t sent = 0;
+  bool send_busy = false;
+  bool flush_queued = false;
+
+  // Whether a multishot receive is armed; off while we're holding input back.
+  bool receiving = false;
+  bool paused = false;
+
+  // Bytes received since the last fill().
+  ssize_t received = 0;
+
+  size_t queued() const { return conn.out.size() + sending.size() - sent; }
+};
+
+/**
+ * A drop-in for ConnPool on io_uring: one multishot accept for the listen socket, one
+ * multishot receive per connection into a ring of kernel-picked buffers, and replies
+ * gathered into one send per connection per wakeup. All of a wakeup's sends, re-armed
+ * receives and the wait for the next completions go to the kernel in a single
+ * io_uring_enter(), where epoll spends a system call on each.
+ *
+ * Needs Linux 6.0 or later; available() says whether this kernel will do.
+ */
+class UringPool {
+ protected:
+  enum Op : uint8_t { ACCEPT = 1, RECV, SEND, CANCEL, ACCEPT_RETRY };
+
+  Ring ring;
+  int listen_socket;
+  uint32_t next_generation = 1;
+
+  // accept() ran out of descriptors or memory; it's re-armed after accept_delay, which
+  // the kernel reads when the timeout is submitted.
+  bool accept_stalled = false;
+  struct __kernel_timespec accept_delay = {0, ACCEPT_RETRY_MS * 1000000LL};
+
+  std::unordered_map<int, UringConn> conns = {};
+  std::vector<int> ready = {};
+  std::vector<int> to_flush = {};
+
+  // Replies still being sent when their connection was released. The kernel reads them
+  // until their send completes, keyed by its user_data.
+  std::unordered_map<uint64_t, std::vector<uint8_t>> orphaned = {};
+
+  Packet request;
+  Packet response;
+
+  static uint64_t tag(Op op, uint32_t generation, int s) {
+    return (uint64_t)op << 56 | (uint64_t)(generation & 0xffffff) << 32 | (uint32_t)s;
+  }
+  static Op op_of(uint64_t tag) { return (Op)(tag >> 56); }
+  static uint32_t generation_of(uint64_t tag) { return (uint32_t)(tag >> 32) & 0xffffff; }
+  static int socket_of(uint64_t tag) { return (int)(uint32_t)tag; }
+
+  void arm_accept() {
+    struct io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(ACCEPT, 0, listen_socket);
+  }
+
+  void arm_accept_later() {
+    struct io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&accept_delay;
+    sqe->len = 1;
+    sqe->user_data = tag(ACCEPT_RETRY, 0, listen_socket);
+  }
+
+  void arm_recv(int s, UringConn& uc) {
+    struct io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = tag(RECV, uc.generation, s);
+    uc.receiving = true;
+  }
+
+  void cancel_recv(int s, const UringConn& uc) {
+    struct io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(RECV, uc.generation, s);
+    sqe->user_data = tag(CANCEL, uc.generation, s);
+  }
+
+  /**
+   * Starts sending whatever `uc` has queued, unless a send is already in flight; its
+   * completion starts the next one.
+   */
+  void start_send(int s, UringConn& uc) {
+    if (uc.send_busy || uc.conn.broken) {
+      return;
+    }
+    if (uc.sent == uc.sending.size()) {
+      if (uc.conn.out.empty()) {
+        return;
+      }
+      uc.sending.clear();
+      uc.sent = 0;
+      uc.sending.swap(uc.conn.out);
+    }
+
+    struct io_uring_sqe* sqe = ring.next_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s;
+    sqe->addr = (uint64_t)(uintptr_t)(uc.sending.data() + uc.sent);
+    sqe->len = (uint32_t)(uc.sending.size() - uc.sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(SEND, uc.generation, s);
+    uc.send_busy = true;
+  }
+
+  void mark_ready(int s, UringConn& uc) {
+    if (!uc.conn.pending) {
+      uc.conn.pending = true;
+      ready.push_back(s);
+    }
+  }
+
+  void accepted(const struct io_uring_cqe& cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM) {
+      // Re-arming now would only fail again, straight away: give descriptors a chance
+      // to free up first.
+      if (!accept_stalled) {
+        std::cerr << "Error in accept call: " << strerror(-cqe.res) << "; retrying every " << ACCEPT_RETRY_MS
+                  << " ms" << std::endl;
+      }
+      accept_stalled = true;
+      if (!more) {
+        arm_accept_later();
+      }
+      return;
+    }
+
+    if (!more) {
+      arm_accept();
+    }
+    if (cqe.res < 0) {
+      if (cqe.res != -ECONNABORTED && cqe.res != -EINTR) {
+        std::cerr << "Error in accept call: " << strerror(-cqe.res) << std::endl;
+      }
+      return;
+    }
+    accept_stalled = false;
+
+    set_nodelay(cqe.res);
+    UringConn& uc = conns[cqe.res];
+    uc = UringConn{};
+    uc.generation = next_generation++ & 0xffffff;
+    arm_recv(cqe.res, uc);
+  }
+
+  void received(const struct io_uring_cqe& cqe, UringConn* uc, int s) {
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    uint16_t buffer_id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (uc == nullptr) {
+      if (has_buffer) {
+        ring.recycle(buffer_id);
+      }
+      return;
+    }
+
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more) {
+      uc->receiving = false;
+    }
+
+    if (cqe.res > 0) {
+      Conn& conn = uc->conn;
+      conn.make_room((size_t)cqe.res);
+      memcpy(conn.in.data() + conn.tail, ring.buffer(buffer_id), (size_t)cqe.res);
+      conn.tail += (size_t)cqe.res;
+      uc->received += cqe.res;
+      ring.recycle(buffer_id);
+
+      // Hold back once a full frame's worth is waiting; next_packet() starts it again.
+      if (conn.tail - conn.head >= FRAME_HEADER_LEN + MAX_FRAME_LEN) {
+        if (uc->receiving && !uc->paused) {
+          cancel_recv(s, *uc);
+        }
+        uc->paused = true;
+      } else if (!uc->receiving && !uc->paused) {
+        arm_recv(s, *uc);
+      }
+    } else if (cqe.res == 0) {
+      uc->conn.eof = true;
+    } else if (cqe.res == -ENOBUFS) {
+      // Every buffer is waiting to be copied out; they're handed back before the next wait.
+      if (!uc->receiving && !uc->paused) {
+        arm_recv(s, *uc);
+      }
+      return;
+    } else if (cqe.res == -ECANCELED) {
+      return;
+    } else {
+      uc->conn.broken = true;
+    }
+    mark_ready(s, *uc);
+  }
+
+  void sent(const struct io_uring_cqe& cqe, UringConn* uc, int s) {
+    if (uc == nullptr) {
+      orphaned.erase(cqe.user_data);
+      return;
+    }
+
+    uc->send_busy = false;
+    bool was_full = uc->queued() >= MAX_OUTPUT_QUEUE;
+    if (cqe.res < 0) {
+      // Nobody to reply to any more; drop the replies and the connection.
+      uc->conn.broken = true;
+      uc->conn.out.clear();
+      uc->sending.clear();
+      uc->sent = 0;
+      mark_ready(s, *uc);
+      return;
+    }
+
+    uc->sent += (size_t)cqe.res;
+    start_send(s, *uc);
+
+    // Drained enough to go back to requests it has buffered, or to finish closing.
+    if ((was_full && uc->queued() < MAX_OUTPUT_QUEUE) || (uc->conn.eof && uc->queued() == 0)) {
+      mark_ready(s, *uc);
+    }
+  }
+
+  void complete(const struct io_uring_cqe& cqe) {
+    Op op = op_of(cqe.user_data);
+    if (op == ACCEPT) {
+      accepted(cqe);
+      return;
+    }
+    if (op == ACCEPT_RETRY) {
+      arm_accept();
+      return;
+    }
+    if (op == CANCEL) {
+      return;
+    }
+
+    int s = socket_of(cqe.user_data);
+    auto it = conns.find(s);
+    UringConn* uc = it != conns.end() && it->second.generation == generation_of(cqe.user_data) ? &it->second : nullptr;
+    if (op == RECV) {
+      received(cqe, uc, s);
+    } else if (op == SEND) {
+      sent(cqe, uc, s);
+    }
+  }
+
+ public:
+  /**
+   * Sets up this worker's ring, then listens. If the ring can't be set up even though
+   * available() said io_uring works (each ring takes locked memory and descriptors, which
+   * a later worker can run short of), it doesn't listen either: see set_up().
+   */
+  UringPool(const char* service, bool reuseport = false) {
+    if (!ring.init(URING_ENTRIES) || !ring.provide_buffers(URING_BUFFERS, URING_BUFFER_SIZE, legacy_buffers)) {
+      std::cerr << "Error setting up io_uring: " << strerror(errno) << std::endl;
+      listen_socket = -1;
+      return;
+    }
+
+    listen_socket = bind_and_listen(service, reuseport);
+    if (listen_socket < 0) {
+      std::cerr << "Unable to listen on port " << service << std::endl;
+      abort();
+    }
+    arm_accept();
+  }
+
+  ~UringPool() {
+    for (const auto& [s, uc] : conns) {
+      close(s);
+    }
+    if (listen_socket >= 0) {
+      close(listen_socket);
+    }
+  }
+
+  /**
+   * Whether the ring was set up and the pool is listening. If not, use a ConnPool.
+   */
+  bool set_up() const { return listen_socket >= 0; }
+
+  /**
+   * Whether this kernel has everything UringPool uses. Tries a multishot receive into
+   * a provided buffer on a socket pair, the newest of them: first from a buffer ring,
+   * then from buffers provided the older way. Call before constructing one.
+   */
+  static bool available() {
+    if (!works(false)) {
+      if (!works(true)) {
+        return false;
+      }
+      legacy_buffers = true;
+    }
+    return true;
+  }
+
+  // Which way works() found to provide receive buffers.
+  static inline bool legacy_buffers = false;
+
+ protected:
+  static bool works(bool legacy) {
+    Ring probe;
+    if (!probe.init(8) || !probe.provide_buffers(8, 64, legacy)) {
+      return false;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+      return false;
+    }
+
+    struct io_uring_sqe* sqe = probe.next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = pair[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+
+    bool ok = false;
+    if (write(pair[1], "x", 1) == 1 && probe.submit(1) >= 0) {
+      probe.reap([&](const struct io_uring_cqe& cqe) {
+        ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER) && (cqe.flags & IORING_CQE_F_MORE);
+      });
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return ok;
+  }
+
+ public:
+  /**
+   * @brief Sends the replies queued since the last call, then waits for activity and
+   * returns the sockets that have something new: data, a hangup, or room again after
+   * backpressure. Call fill() on each, then pull packets with next_packet().
+   *
+   * @return The file descriptors that are ready, valid until the next call.
+   */
+  const std::vector<int>& await() {
+    ready.clear();
+
+    for (int s : to_flush) {
+      auto it = conns.find(s);
+      if (it != conns.end()) {
+        it->second.flush_queued = false;
+        start_send(s, it->second);
+      }
+    }
+    to_flush.clear();
+
+    while (ready.empty()) {
+      ring.publish_buffers();
+      if (ring.submit(1) < 0 && errno != EINTR && errno != EBUSY) {
+        std::cerr << "Error in io_uring_enter call: " << strerror(errno) << std::endl;
+        abort();
+      }
+      ring.reap([this](const struct io_uring_cqe& cqe) { complete(cqe); });
+    }
+    ring.publish_buffers();
+
+    for (int s : ready) {
+      conns[s].conn.pending = false;
+    }
+    return ready;
+  }
+
+  /**
+   * Receiving already happened in await(); this just reports how much came in.
+   * @return Number of bytes received for `s` since the last call (possibly 0).
+   */
+  ssize_t fill(int s) {
+    UringConn& uc = conns[s];
+    ssize_t total = uc.received;
+    uc.received = 0;
+    return total;
+  }
+
+  /**
+   * As ConnPool::next_packet(): the next complete packet from `s`, valid until the next
+   * call. None while MAX_OUTPUT_QUEUE bytes of replies are waiting for `s`.
+   */
+  const Packet* next_packet(int s) {
+    UringConn& uc = conns[s];
+    if (uc.conn.broken || uc.queued() >= MAX_OUTPUT_QUEUE) {
+      return nullptr;
+    }
+    if (uc.conn.take_packet(request)) {
+      return &request;
+    }
+
+    // Caught up with what it sent; take more.
+    if (uc.paused && !uc.conn.broken && !uc.conn.eof) {
+      uc.paused = false;
+      if (!uc.receiving) {
+        arm_recv(s, uc);
+      }
+    }
+    return nullptr;
+  }
+
+  Packet& reply_to(const Packet& packet) {
+    response.reply_to(packet);
+    return response;
+  }
+
+  /**
+   * Queues `packet` for `s`. Everything queued in one round goes out in one send, when
+   * await() is next called.
+   */
+  void send(int s, const Packet& packet) {
+    UringConn& uc = conns[s];
+    if (uc.conn.broken) {
+      return;
+    }
+    uc.conn.out.insert(uc.conn.out.end(), packet.buf.begin(), packet.buf.end());
+    if (!uc.flush_queued) {
+      uc.flush_queued = true;
+      to_flush.push_back(s);
+    }
+  }
+
+  bool closed(int s) {
+    const UringConn& uc = conns[s];
+    return uc.conn.broken || (uc.conn.eof && uc.queued() == 0 && !uc.send_busy);
+  }
+
+  void releaseSocket(int s) {
+    auto it = conns.find(s);
+    if (it != conns.end()) {
+      UringConn& uc = it->second;
+
+      // Stop the receive, and any send, before the fd can be reused.
+      struct io_uring_sqe* sqe = ring.next_sqe();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = s;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe->user_data = tag(CANCEL, uc.generation, s);
+      ring.submit(0);
+
+      if (uc.send_busy) {
+        orphaned.emplace(tag(SEND, uc.generation, s), std::move(uc.sending));
+      }
+      if (uc.flush_queued) {
+        to_flush.erase(std::find(to_flush.begin(), to_flush.end(), s));
+      }
+      conns.erase(it);
+    }
+    close(s);
+  }
+};